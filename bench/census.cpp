@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "census.hpp"
+#include "synthetic.hpp"
+
+using hamster::Bench::MakeEndpoints;
+using hamster::Bench::MakeInfoHashes;
+using hamster::DhtCensus;
+
+// The cost of feeding a sample, which the indexer pays for every one
+static void BM_CensusAddSample(benchmark::State& state)
+{
+    auto const hashes = MakeInfoHashes(1 << 16, 1);
+    auto const endpoints = MakeEndpoints(1024, 1);
+
+    DhtCensus census;
+    std::size_t next = 0;
+
+    for (auto _ : state)
+    {
+        census.AddSample(hashes[next % hashes.size()].v1, endpoints[next % endpoints.size()]);
+        next += 1;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_CensusAddSample);
+
+// Samples a synthetic DHT of the given number of info hashes, each stored
+// on 8 of 20000 nodes. Every response comes from a random node, and carries
+// up to 20 of the info hashes that node stores, the number it stores, and 8
+// nodes. Takes twice as many samples as there are info hashes. Reports the
+// error of the recaptured and the reported population estimates.
+static void BM_CensusAccuracy(benchmark::State& state)
+{
+    static const std::size_t numNodes = 20000;
+    static const int replicas = 8;
+    static const std::size_t samplesPerResponse = 20;
+    static const int nodesPerResponse = 8;
+
+    auto const population = static_cast<std::size_t>(state.range(0));
+    auto const hashes = MakeInfoHashes(population, 1);
+    auto const endpoints = MakeEndpoints(numNodes, 1);
+    auto const nodeIds = MakeInfoHashes(numNodes, 2);
+
+    // The info hashes each node stores
+    std::vector<std::vector<std::uint32_t>> stored(numNodes);
+
+    {
+        std::mt19937_64 rng(0);
+
+        for (std::size_t i = 0; i < population; i++)
+        {
+            for (int r = 0; r < replicas; r++)
+            {
+                stored[rng() % numNodes].push_back(static_cast<std::uint32_t>(i));
+            }
+        }
+    }
+
+    double recapturedError = 0;
+    double reportedError = 0;
+
+    for (auto _ : state)
+    {
+        std::mt19937_64 rng(state.iterations());
+        DhtCensus census;
+        std::vector<std::uint32_t> samples;
+        std::size_t taken = 0;
+
+        while (taken < 2 * population)
+        {
+            auto const node = rng() % numNodes;
+            auto const& source = endpoints[node];
+
+            samples.clear();
+            std::sample(stored[node].begin(), stored[node].end(), std::back_inserter(samples), samplesPerResponse, rng);
+
+            for (auto const sample : samples)
+            {
+                census.AddSample(hashes[sample].v1, source);
+            }
+
+            census.AddReport(static_cast<int>(stored[node].size()));
+
+            for (int n = 0; n < nodesPerResponse; n++)
+            {
+                census.AddNode(nodeIds[rng() % nodeIds.size()].v1, source);
+            }
+
+            taken += samples.size();
+        }
+
+        auto const estimates = census.Estimate();
+
+        recapturedError += std::abs(estimates.population / static_cast<double>(population) - 1);
+        reportedError += std::abs(estimates.reportedPopulation / static_cast<double>(population) - 1);
+    }
+
+    state.counters["recaptured_error"] = benchmark::Counter(recapturedError, benchmark::Counter::kAvgIterations);
+    state.counters["reported_error"] = benchmark::Counter(reportedError, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_CensusAccuracy)->Arg(1 << 20)->Unit(benchmark::kMillisecond)->Iterations(3);
@@ -0,0 +1,141 @@
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <unistd.h>
+
+#include "fetchjournal.hpp"
+#include "synthetic.hpp"
+
+namespace fs = std::filesystem;
+using hamster::Bench::MakeEndpoints;
+using hamster::Bench::MakeInfoHashes;
+using hamster::FetchJournal;
+
+static std::string ScratchPath()
+{
+    return (fs::temp_directory_path() / ("hamster-bench-journal-" + std::to_string(::getpid()))).string();
+}
+
+static void RemoveJournal(const std::string& path)
+{
+    auto const prefix = fs::path(path).filename().string();
+
+    for (auto const& file : fs::directory_iterator(fs::path(path).parent_path()))
+    {
+        if (file.path().filename().string().rfind(prefix, 0) == 0) { fs::remove(file.path()); }
+    }
+}
+
+// Journals sampled hashes the way the indexer does, flushing once per tick
+static void BM_FetchJournalAdd(benchmark::State& state)
+{
+    static const std::size_t flushInterval = 10000;
+
+    auto const path = ScratchPath();
+    auto const hashes = MakeInfoHashes(flushInterval, 1);
+    auto const endpoints = MakeEndpoints(1024, 1);
+    auto const now = std::chrono::system_clock::now();
+
+    {
+        FetchJournal journal(path);
+        std::size_t next = 0;
+
+        for (auto _ : state)
+        {
+            journal.Add({ hashes[next % hashes.size()], now, 0, endpoints[next % endpoints.size()] });
+
+            if (++next % flushInterval == 0)
+            {
+                journal.Flush();
+            }
+        }
+    }
+
+    RemoveJournal(path);
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_FetchJournalAdd);
+
+// Replays a journal of the given number of pending hashes, and a tenth as
+// many which were resolved since. Reports the time it takes to open the
+// journal and start replaying in the background (startup_ms), and the hashes
+// recovered per second.
+static void BM_FetchJournalReplay(benchmark::State& state)
+{
+    static const std::size_t chunkSize = 100000;
+
+    auto const count = static_cast<std::size_t>(state.range(0));
+    auto const path = ScratchPath();
+    auto const endpoints = MakeEndpoints(1024, 1);
+    auto const now = std::chrono::system_clock::now();
+
+    {
+        FetchJournal journal(path, std::numeric_limits<std::uint64_t>::max());
+
+        // Written in chunks to keep the hashes out of memory
+        auto const write = [&](std::size_t total, std::uint32_t seed, bool resolved)
+        {
+            for (std::size_t i = 0; i < total; i += chunkSize)
+            {
+                auto const hashes = MakeInfoHashes(std::min(chunkSize, total - i), seed++);
+
+                for (std::size_t j = 0; j < hashes.size(); j++)
+                {
+                    journal.Add({ hashes[j], now, 0, endpoints[j % endpoints.size()] });
+                    if (resolved) { journal.Remove(hashes[j]); }
+                }
+
+                journal.Flush();
+            }
+        };
+
+        write(count, 1, false);
+        write(count / 10, 1 << 20, true);
+    }
+
+    std::size_t recovered = 0;
+    double startup = 0;
+
+    for (auto _ : state)
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool done = false;
+
+        auto const started = std::chrono::steady_clock::now();
+
+        FetchJournal journal(path);
+        journal.Replay(
+            [&](std::vector<FetchJournal::Entry> entries)
+            {
+                recovered += entries.size();
+                journal.Next();
+            },
+            [&]
+            {
+                std::lock_guard lock(mutex);
+                done = true;
+                cv.notify_one();
+            });
+
+        startup += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&] { return done; });
+    }
+
+    RemoveJournal(path);
+
+    state.SetItemsProcessed(static_cast<std::int64_t>(recovered));
+    state.counters["startup_ms"] = benchmark::Counter(startup, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_FetchJournalReplay)->Arg(1 << 20)->Arg(10000000)->Unit(benchmark::kMillisecond)->Iterations(3)->UseRealTime();
@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <array>
+#include <random>
+#include <unordered_set>
+
+#include <benchmark/benchmark.h>
+#include <libtorrent/info_hash.hpp>
+#include <libtorrent/time.hpp>
+
+#include "fetchqueue.hpp"
+#include "nodeschedule.hpp"
+#include "synthetic.hpp"
+
+namespace lt = libtorrent;
+
+using hamster::Bench::MakeEndpoints;
+using hamster::Bench::MakeInfoHashes;
+using hamster::NodeSchedule;
+
+// The seen hashes lookup, done for every sampled hash
+
+static void BM_HashSetLookup(benchmark::State& state)
+{
+    auto const size = static_cast<std::size_t>(state.range(0));
+    auto const known = MakeInfoHashes(size, 1);
+    auto const unknown = MakeInfoHashes(1024, 2);
+
+    std::unordered_set<lt::info_hash_t> hashes(known.begin(), known.end());
+    std::size_t next = 0;
+
+    for (auto _ : state)
+    {
+        // Alternate hits and misses, like the samples from a busy node
+        auto const& ih = (next % 2 == 0)
+            ? known[next % known.size()]
+            : unknown[next % unknown.size()];
+
+        benchmark::DoNotOptimize(hashes.find(ih) != hashes.end());
+        next++;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_HashSetLookup)->RangeMultiplier(16)->Range(1024, 16 << 20);
+
+// Takes the due nodes out of a schedule of the given number of nodes, half
+// of them IPv6 ones, the way the indexer does on every sample tick
+static void BM_SampleNodeSelection(benchmark::State& state)
+{
+    auto const numNodes = static_cast<std::size_t>(state.range(0));
+    auto const endpoints = MakeEndpoints(numNodes, 1);
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> minutes(-30, 30);
+
+    std::array<NodeSchedule, 2> families;
+    auto now = lt::clock_type::now();
+
+    for (std::size_t i = 0; i < endpoints.size(); i++)
+    {
+        auto endpoint = endpoints[i];
+
+        if (i % 2 == 1)
+        {
+            boost::asio::ip::address_v6::bytes_type bytes{};
+            bytes[0] = 0x20;
+            bytes[1] = 0x01;
+
+            auto const v4 = endpoint.address().to_v4().to_bytes();
+            std::copy(v4.begin(), v4.end(), bytes.begin() + 12);
+
+            endpoint.address(boost::asio::ip::address_v6(bytes));
+        }
+
+        families[NodeSchedule::FamilyOf(endpoint)].Defer(endpoint, now + std::chrono::minutes(minutes(rng)));
+    }
+
+    std::size_t taken = 0;
+
+    for (auto _ : state)
+    {
+        for (auto& family : families)
+        {
+            taken += family.TakeDue(now, numNodes, std::chrono::hours(1), nullptr).size();
+        }
+
+        // Every node is due again on the next tick
+        now += std::chrono::hours(2);
+    }
+
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(numNodes));
+    state.counters["taken"] = benchmark::Counter(static_cast<double>(taken), benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_SampleNodeSelection)->RangeMultiplier(8)->Range(64, 256 << 10);
+
+static void BM_AddTorrentParams(benchmark::State& state)
+{
+    auto const hashes = MakeInfoHashes(1024, 1);
+    std::size_t next = 0;
+
+    for (auto _ : state)
+    {
+        auto params = hamster::FetchParams(hashes[next++ % hashes.size()]);
+        benchmark::DoNotOptimize(params);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_AddTorrentParams);
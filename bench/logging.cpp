@@ -0,0 +1,51 @@
+#include <ostream>
+
+#include <benchmark/benchmark.h>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+
+#include "logging.hpp"
+#include "nullbuffer.hpp"
+#include "synthetic.hpp"
+
+using hamster::Bench::MakeInfoHashes;
+using hamster::Bench::NullBuffer;
+
+// Measures the cost of the per-torrent log line in PopAlerts as seen by the
+// io thread. Argument 0 runs with debug logging off, 1 with logging on and no
+// rate limit, and 2 with logging on and a rate limit of 20 per second.
+static void BM_LogAddedTorrent(benchmark::State& state)
+{
+    static hamster::Logging::RateLimiter limiter("Added torrent");
+
+    auto const mode = state.range(0);
+    auto const hashes = MakeInfoHashes(1024, 1);
+
+    NullBuffer buffer;
+    std::ostream stream(&buffer);
+
+    hamster::Logging::Setup(
+        mode == 0 ? boost::log::trivial::info : boost::log::trivial::debug,
+        stream);
+    hamster::Logging::SetRateLimit(mode == 2 ? 20 : 0);
+
+    auto const dropped = hamster::Logging::Dropped();
+    std::size_t next = 0;
+
+    for (auto _ : state)
+    {
+        HAMSTER_LOG_RATE_LIMITED(debug, limiter, "Added torrent ", hashes[next++ % hashes.size()]);
+    }
+
+    state.counters["dropped"] = static_cast<double>(hamster::Logging::Dropped() - dropped);
+    state.SetItemsProcessed(state.iterations());
+
+    hamster::Logging::Shutdown();
+    hamster::Logging::SetRateLimit(0);
+
+    boost::log::core::get()->set_filter(
+        boost::log::trivial::severity >= boost::log::trivial::warning);
+}
+
+BENCHMARK(BM_LogAddedTorrent)->Arg(0)->Arg(1)->Arg(2);
@@ -0,0 +1,29 @@
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+
+int main(int argc, char* argv[])
+{
+    // Keep migration chatter out of the results
+    boost::log::core::get()->set_filter(
+        boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    // Report in JSON unless told otherwise - later arguments win.
+    std::string format = "--benchmark_format=json";
+    std::vector<char*> args { argv[0], format.data() };
+    args.insert(args.end(), argv + 1, argv + argc);
+
+    int count = static_cast<int>(args.size());
+
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data())) { return 1; }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
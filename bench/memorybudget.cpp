@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <benchmark/benchmark.h>
+#include <libtorrent/info_hash.hpp>
+
+#include "fetchqueue.hpp"
+#include "memorybudget.hpp"
+
+namespace lt = libtorrent;
+
+using hamster::FetchQueue;
+using hamster::MemoryBudget;
+using Pressure = MemoryBudget::Pressure;
+
+// Large enough for the resident set size of the benchmark to stay far below
+// every threshold, so the accounted usage alone decides the level.
+static const std::uint64_t budgetLimit = std::uint64_t(1) << 40;
+
+static std::uint64_t Percent(double percent)
+{
+    return static_cast<std::uint64_t>(static_cast<double>(budgetLimit) * percent / 100);
+}
+
+// The level the budget should report after rising to, or falling to, the
+// given usage from the other end
+static Pressure Expected(double percent, bool rising)
+{
+    auto const margin = rising ? 0.0 : 5.0;
+
+    if (percent + margin >= 95) { return Pressure::Critical; }
+    if (percent + margin >= 85) { return Pressure::High; }
+    if (percent + margin >= 70) { return Pressure::Elevated; }
+
+    return Pressure::Normal;
+}
+
+// Ramps the accounted usage from 0 to 100% of the budget and back in steps
+// of half a percent, four times over, split over three consumers, and checks
+// every level change against the thresholds and the hysteresis. Reports the
+// cost of an update, which samples the resident set size.
+static void BM_MemoryBudgetUpdate(benchmark::State& state)
+{
+    static const int steps = 200;
+
+    MemoryBudget budget(budgetLimit);
+    std::vector<double> ramp;
+
+    // Half way between the steps, clear of the thresholds
+    for (int i = 0; i < steps; i++) { ramp.push_back(100.0 * (i + 0.5) / steps); }
+    for (int i = steps - 1; i >= 0; i--) { ramp.push_back(100.0 * (i + 0.5) / steps); }
+
+    std::size_t next = 0;
+    std::size_t changes = 0;
+    auto previous = budget.Current();
+
+    for (auto _ : state)
+    {
+        auto const index = next++ % ramp.size();
+        auto const percent = ramp[index];
+        auto const bytes = Percent(percent);
+
+        budget.Set(MemoryBudget::Consumer::ActiveFetches, bytes / 2);
+        budget.Set(MemoryBudget::Consumer::SeenHashes, bytes / 4);
+        budget.Set(MemoryBudget::Consumer::Storage, bytes - bytes / 2 - bytes / 4);
+
+        auto const pressure = budget.Update();
+
+        if (pressure != Expected(percent, index < steps))
+        {
+            state.SkipWithError("Pressure level does not match the thresholds");
+            break;
+        }
+
+        if (pressure != previous) { changes += 1; }
+        previous = pressure;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["level_changes"] = static_cast<double>(changes);
+}
+
+BENCHMARK(BM_MemoryBudgetUpdate)->Iterations(4 * 400);
+
+// Moves the usage back and forth by 2% of the budget around each threshold,
+// like a consumer which grows and shrinks with the crawl, and checks that
+// the level changes once on the way up and stays put after.
+static void BM_MemoryBudgetFlapping(benchmark::State& state)
+{
+    static const double thresholds[] = { 70, 85, 95 };
+
+    std::size_t changes = 0;
+
+    for (auto _ : state)
+    {
+        for (auto const threshold : thresholds)
+        {
+            MemoryBudget budget(budgetLimit);
+
+            budget.Set(MemoryBudget::Consumer::FetchQueue, Percent(threshold - 1));
+            auto previous = budget.Update();
+            std::size_t local = 0;
+
+            for (int i = 0; i < 100; i++)
+            {
+                budget.Set(MemoryBudget::Consumer::FetchQueue, Percent(i % 2 == 0 ? threshold + 1 : threshold - 1));
+
+                auto const pressure = budget.Update();
+                if (pressure != previous) { local += 1; }
+                previous = pressure;
+            }
+
+            if (local != 1)
+            {
+                state.SkipWithError("Pressure level flaps around a threshold");
+                return;
+            }
+
+            changes += local;
+        }
+    }
+
+    state.counters["level_changes"] = benchmark::Counter(static_cast<double>(changes), benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_MemoryBudgetFlapping)->Unit(benchmark::kMicrosecond);
+
+// A fresh info hash for every value of next, without keeping them around
+static lt::info_hash_t NextInfoHash(std::uint64_t& next)
+{
+    lt::sha1_hash hash;
+
+    for (std::size_t offset = 0; offset < hash.size(); offset += 8)
+    {
+        // splitmix64
+        auto z = (next += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        z ^= z >> 31;
+
+        std::memcpy(hash.data() + offset, &z, std::min<std::size_t>(8, hash.size() - offset));
+    }
+
+    return lt::info_hash_t(hash);
+}
+
+// Overloads a budget of 256 MiB above the resident set size at the start
+// with the containers the indexer accounts for, and backs off on pressure
+// the way the indexer does: sampling every other tick and starting half the
+// fetches when elevated, neither from high up, trimming the queue and
+// forgetting the fetched hashes when high, and dropping the newest half of
+// the fetches when critical.
+// Sampling finds ten times more hashes than the fetches can take. A fetch
+// holds 64 KiB of resident memory for 20 ticks, standing in for libtorrent.
+// Reports the resident set size at every tenth of the run, and fails if it
+// ever goes over the budget.
+static void BM_MemoryBudgetOverload(benchmark::State& state)
+{
+    static const std::uint64_t headroom = std::uint64_t(256) << 20;
+    static const int ticks = 400;
+    static const int fetchTicks = 20;
+    static const std::size_t sampledPerTick = 20000;
+    static const std::size_t maxActiveFetches = 1000;
+    static const std::size_t fetchSize = 64 * 1024;
+
+    // The estimates of the indexer
+    static const std::uint64_t activeFetchCost = 64 * 1024;
+    static const std::uint64_t seenHashCost = sizeof(lt::info_hash_t) + 2 * sizeof(void*);
+    static const std::uint64_t queuedHashCost = 2 * sizeof(lt::info_hash_t) + 2 * sizeof(void*);
+
+    struct Fetch
+    {
+        int started;
+        std::vector<char> memory;
+    };
+
+    for (auto _ : state)
+    {
+        using Consumer = MemoryBudget::Consumer;
+        using Pressure = MemoryBudget::Pressure;
+
+        auto const limit = MemoryBudget::ResidentSetSize() + headroom;
+
+        MemoryBudget budget(limit);
+        std::unordered_set<lt::info_hash_t> hashes;
+        FetchQueue queue;
+        std::unordered_map<lt::info_hash_t, Fetch> active;
+        std::uint64_t next = 0;
+
+        std::uint64_t peak = 0;
+        std::size_t levels[4] = {};
+
+        for (int tick = 0; tick < ticks; tick++)
+        {
+            budget.Set(Consumer::ActiveFetches, active.size() * activeFetchCost);
+            budget.Set(Consumer::SeenHashes, hashes.size() * seenHashCost + hashes.bucket_count() * sizeof(void*));
+            budget.Set(Consumer::FetchQueue, queue.Size(FetchQueue::Priority::Background) * queuedHashCost);
+
+            auto const pressure = budget.Update();
+            levels[static_cast<std::size_t>(pressure)] += 1;
+            peak = std::max(peak, budget.Resident());
+
+            if (tick % (ticks / 10) == 0)
+            {
+                char name[16];
+                std::snprintf(name, sizeof(name), "rss_mib_%02d", 100 * tick / ticks);
+                state.counters[name] = static_cast<double>(budget.Resident() >> 20);
+            }
+
+            auto const release = [&](const lt::info_hash_t& hash) { hashes.erase(hash); };
+
+            if (pressure == Pressure::Critical)
+            {
+                std::vector<std::unordered_map<lt::info_hash_t, Fetch>::iterator> fetches;
+                for (auto it = active.begin(); it != active.end(); it++) { fetches.push_back(it); }
+
+                std::sort(
+                    fetches.begin(),
+                    fetches.end(),
+                    [](auto const& lhs, auto const& rhs) { return lhs->second.started > rhs->second.started; });
+
+                fetches.resize(fetches.size() / 2);
+
+                for (auto const& it : fetches)
+                {
+                    release(it->first);
+                    active.erase(it);
+                }
+
+                queue.Trim(FetchQueue::Priority::Background, 0, release);
+            }
+            else if (pressure == Pressure::High)
+            {
+                queue.Trim(FetchQueue::Priority::Background, maxActiveFetches, release);
+            }
+
+            if (pressure >= Pressure::High)
+            {
+                std::unordered_set<lt::info_hash_t> inFlight;
+
+                for (auto const& hash : hashes)
+                {
+                    if (queue.Contains(hash) || active.find(hash) != active.end()) { inFlight.insert(hash); }
+                }
+
+                hashes.swap(inFlight);
+
+#ifdef __GLIBC__
+                malloc_trim(0);
+#endif
+            }
+
+            // Finished fetches stay in the seen hashes
+            for (auto it = active.begin(); it != active.end();)
+            {
+                it = tick - it->second.started >= fetchTicks ? active.erase(it) : std::next(it);
+            }
+
+            if (pressure == Pressure::Normal || (pressure == Pressure::Elevated && tick % 2 == 0))
+            {
+                for (std::size_t i = 0; i < sampledPerTick; i++)
+                {
+                    auto const hash = NextInfoHash(next);
+                    if (hashes.insert(hash).second) { queue.Push(hash, FetchQueue::Priority::Background); }
+                }
+            }
+
+            auto const fetchLimit = pressure == Pressure::Normal
+                ? maxActiveFetches
+                : pressure == Pressure::Elevated ? maxActiveFetches / 2 : 0;
+
+            while (active.size() < fetchLimit)
+            {
+                auto const hash = queue.Pop(FetchQueue::Priority::Background);
+                if (!hash) { break; }
+
+                // Touched, so it is resident
+                active.insert({ *hash, { tick, std::vector<char>(fetchSize, 1) }});
+            }
+        }
+
+        state.counters["limit_mib"] = static_cast<double>(limit >> 20);
+        state.counters["peak_rss_mib"] = static_cast<double>(peak >> 20);
+        state.counters["ticks_elevated"] = static_cast<double>(levels[1]);
+        state.counters["ticks_high"] = static_cast<double>(levels[2]);
+        state.counters["ticks_critical"] = static_cast<double>(levels[3]);
+
+        if (peak > limit)
+        {
+            state.SkipWithError("The resident set size went over the budget");
+            break;
+        }
+    }
+}
+
+BENCHMARK(BM_MemoryBudgetOverload)->Iterations(1)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "minhash.hpp"
+
+using hamster::MinHash;
+
+static std::vector<std::uint64_t> MakeFeatures(std::size_t count, std::mt19937_64& rng)
+{
+    std::vector<std::uint64_t> features;
+    features.reserve(count);
+
+    for (std::size_t i = 0; i < count; i++)
+    {
+        features.push_back(MinHash::Feature("file-" + std::to_string(rng()) + ".bin", rng() % (1ll << 32)));
+    }
+
+    return features;
+}
+
+static double Jaccard(const std::vector<std::uint64_t>& lhs, const std::vector<std::uint64_t>& rhs)
+{
+    std::set<std::uint64_t> a(lhs.begin(), lhs.end());
+    std::set<std::uint64_t> b(rhs.begin(), rhs.end());
+
+    std::size_t common = 0;
+    for (auto const f : a) { common += b.count(f); }
+
+    return static_cast<double>(common) / static_cast<double>(a.size() + b.size() - common);
+}
+
+static void BM_MinHashCompute(benchmark::State& state)
+{
+    std::mt19937_64 rng(1);
+    auto const features = MakeFeatures(static_cast<std::size_t>(state.range(0)), rng);
+
+    for (auto _ : state)
+    {
+        auto signature = MinHash::Compute(features);
+        benchmark::DoNotOptimize(signature);
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_MinHashCompute)->RangeMultiplier(8)->Range(1, 4096);
+
+// Builds a corpus of torrents and re-packs of them with a share of their
+// files replaced, then compares what the LSH index finds with exact Jaccard
+// similarity over all pairs sharing an origin.
+static void BM_MinHashAccuracy(benchmark::State& state)
+{
+    static const double threshold = 0.5;
+    static const int numOrigins = 2000;
+    static const int repacksPerOrigin = 3;
+
+    std::mt19937_64 rng(1);
+    std::uniform_int_distribution<std::size_t> fileCounts(2, 200);
+    std::uniform_real_distribution<double> mutation(0.0, 0.8);
+
+    std::vector<std::vector<std::uint64_t>> torrents;
+    std::vector<int> origins;
+
+    for (int origin = 0; origin < numOrigins; origin++)
+    {
+        auto const base = MakeFeatures(fileCounts(rng), rng);
+
+        torrents.push_back(base);
+        origins.push_back(origin);
+
+        for (int r = 0; r < repacksPerOrigin; r++)
+        {
+            auto repack = base;
+            auto const replaced = static_cast<std::size_t>(static_cast<double>(repack.size()) * mutation(rng));
+            auto const fresh = MakeFeatures(replaced, rng);
+
+            std::copy(fresh.begin(), fresh.end(), repack.begin());
+
+            torrents.push_back(repack);
+            origins.push_back(origin);
+        }
+    }
+
+    std::size_t truePairs = 0;
+    std::size_t found = 0;
+    std::size_t reported = 0;
+    std::size_t correct = 0;
+
+    for (auto _ : state)
+    {
+        std::vector<MinHash::Signature> signatures;
+        std::unordered_map<std::int64_t, std::vector<std::size_t>> buckets[MinHash::NumBands];
+
+        for (std::size_t i = 0; i < torrents.size(); i++)
+        {
+            signatures.push_back(MinHash::Compute(torrents[i]));
+            auto const bands = MinHash::ComputeBands(signatures.back());
+
+            for (int band = 0; band < MinHash::NumBands; band++)
+            {
+                buckets[band][bands[band]].push_back(i);
+            }
+        }
+
+        truePairs = found = reported = correct = 0;
+
+        for (std::size_t i = 0; i < torrents.size(); i++)
+        {
+            std::set<std::size_t> candidates;
+            auto const bands = MinHash::ComputeBands(signatures[i]);
+
+            for (int band = 0; band < MinHash::NumBands; band++)
+            {
+                for (auto const j : buckets[band][bands[band]])
+                {
+                    if (j != i) { candidates.insert(j); }
+                }
+            }
+
+            // Unrelated torrents share no files, so only pairs with a common
+            // origin can be similar.
+            for (std::size_t j = i - i % (repacksPerOrigin + 1); origins[j] == origins[i]; j++)
+            {
+                if (j != i && Jaccard(torrents[i], torrents[j]) >= threshold)
+                {
+                    truePairs += 1;
+                    found += candidates.count(j) > 0 && MinHash::Similarity(signatures[i], signatures[j]) >= threshold ? 1 : 0;
+                }
+
+                if (j + 1 == torrents.size()) { break; }
+            }
+
+            for (auto const j : candidates)
+            {
+                if (MinHash::Similarity(signatures[i], signatures[j]) < threshold) { continue; }
+
+                reported += 1;
+                correct += Jaccard(torrents[i], torrents[j]) >= threshold ? 1 : 0;
+            }
+        }
+    }
+
+    state.counters["recall"] = truePairs > 0 ? static_cast<double>(found) / static_cast<double>(truePairs) : 1.0;
+    state.counters["precision"] = reported > 0 ? static_cast<double>(correct) / static_cast<double>(reported) : 1.0;
+    state.counters["torrents"] = static_cast<double>(torrents.size());
+}
+
+BENCHMARK(BM_MinHashAccuracy)->Iterations(1)->Unit(benchmark::kMillisecond);
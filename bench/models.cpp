@@ -0,0 +1,210 @@
+#include <filesystem>
+#include <string>
+
+#include <benchmark/benchmark.h>
+#include <sqlite3.h>
+#include <unistd.h>
+
+#include "database.hpp"
+#include "migrator.hpp"
+#include "models/infohash.hpp"
+#include "models/torrent.hpp"
+#include "models/torrentsignature.hpp"
+#include "synthetic.hpp"
+
+namespace fs = std::filesystem;
+using hamster::Bench::MakeInfoHashes;
+using hamster::Bench::MakeTorrentInfo;
+
+// The schema version shipped before any indexing related migrations. The
+// migration benchmark creates databases at this version and migrates them
+// forward.
+static const int BaselineSchemaVersion = 2;
+
+static sqlite3* OpenMigratedDatabase()
+{
+    sqlite3* db = hamster::OpenDatabase(":memory:");
+    hamster::MigrateDatabase(db);
+    return db;
+}
+
+static void BM_TorrentInsert(benchmark::State& state)
+{
+    static const int poolSize = 256;
+
+    auto const numFiles = static_cast<int>(state.range(0));
+
+    std::vector<std::shared_ptr<lt::torrent_info>> pool;
+
+    for (int i = 0; i < poolSize; i++)
+    {
+        pool.push_back(MakeTorrentInfo(numFiles, i));
+    }
+
+    sqlite3* db = OpenMigratedDatabase();
+    std::size_t next = 0;
+
+    for (auto _ : state)
+    {
+        // Start over with an empty database once every torrent is inserted
+        // to keep the unique constraints from short circuiting the insert.
+        if (next == pool.size())
+        {
+            state.PauseTiming();
+            sqlite3_close(db);
+            db = OpenMigratedDatabase();
+            next = 0;
+            state.ResumeTiming();
+        }
+
+        hamster::Models::Torrent::Insert(db, *pool[next++]);
+    }
+
+    sqlite3_close(db);
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["files"] = numFiles;
+}
+
+BENCHMARK(BM_TorrentInsert)->RangeMultiplier(8)->Range(1, 4096);
+
+static void BM_InfoHashString(benchmark::State& state)
+{
+    auto const hashes = MakeInfoHashes(1024, 1);
+    std::size_t next = 0;
+
+    for (auto _ : state)
+    {
+        auto str = hamster::Models::InfoHashString(hashes[next++ % hashes.size()].v1);
+        benchmark::DoNotOptimize(str);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_InfoHashString);
+
+// Migrates a database which was created by the baseline schema and filled
+// with the given number of torrents of 8 files each, the way a database
+// indexed before any of the later migrations looks.
+static void BM_MigrateDatabase(benchmark::State& state)
+{
+    auto const numTorrents = static_cast<int>(state.range(0));
+    auto const path = (fs::temp_directory_path() / ("hamster-bench-migrate-" + std::to_string(::getpid()))).string();
+
+    auto const remove = [&]
+    {
+        fs::remove(path);
+        fs::remove(path + "-wal");
+        fs::remove(path + "-shm");
+    };
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+
+        remove();
+
+        sqlite3* db = hamster::OpenDatabase(path);
+
+        if (!hamster::MigrateDatabase(db, BaselineSchemaVersion))
+        {
+            state.SkipWithError(sqlite3_errmsg(db));
+            sqlite3_close(db);
+            break;
+        }
+
+        // Written with plain SQL, the models expect the current schema
+        sqlite3_stmt* torrent = nullptr;
+        sqlite3_stmt* file = nullptr;
+        sqlite3_prepare_v2(db, "INSERT INTO torrents (info_hash_v1, name, size) VALUES ($1, $2, $3);", -1, &torrent, nullptr);
+        sqlite3_prepare_v2(db, "INSERT INTO torrentfiles (torrent_id, path, size) VALUES ($1, $2, $3);", -1, &file, nullptr);
+        sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+
+        for (int i = 0; i < numTorrents; i++)
+        {
+            auto const ti = MakeTorrentInfo(8, i);
+            auto const hash = hamster::Models::InfoHashString(ti->info_hashes().v1);
+
+            sqlite3_bind_text(torrent, 1, hash.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(torrent, 2, ti->name().c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(torrent, 3, ti->total_size());
+            sqlite3_step(torrent);
+            sqlite3_reset(torrent);
+
+            auto const id = sqlite3_last_insert_rowid(db);
+            auto const& files = ti->files();
+
+            for (int f = 0; f < files.num_files(); f++)
+            {
+                auto const filePath = files.file_path(lt::file_index_t{f});
+
+                sqlite3_bind_int64(file, 1, id);
+                sqlite3_bind_text(file, 2, filePath.c_str(), -1, SQLITE_TRANSIENT);
+                sqlite3_bind_int64(file, 3, files.file_size(lt::file_index_t{f}));
+                sqlite3_step(file);
+                sqlite3_reset(file);
+            }
+        }
+
+        sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+        sqlite3_finalize(torrent);
+        sqlite3_finalize(file);
+
+        state.ResumeTiming();
+
+        if (!hamster::MigrateDatabase(db))
+        {
+            state.SkipWithError(sqlite3_errmsg(db));
+        }
+
+        state.PauseTiming();
+        sqlite3_close(db);
+        state.ResumeTiming();
+    }
+
+    remove();
+
+    state.counters["torrents"] = numTorrents;
+}
+
+BENCHMARK(BM_MigrateDatabase)->RangeMultiplier(10)->Range(1000, 100000)->Unit(benchmark::kMillisecond)->Iterations(5);
+
+static void BM_FindSimilar(benchmark::State& state)
+{
+    auto const numTorrents = static_cast<int>(state.range(0));
+
+    sqlite3* db = OpenMigratedDatabase();
+    std::vector<lt::info_hash_t> hashes;
+
+    sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+
+    // Torrents built from the same seed share their leading files, so every
+    // torrent has one re-pack with a Jaccard similarity of 0.8.
+    for (int i = 0; i < numTorrents / 2; i++)
+    {
+        auto const ti = MakeTorrentInfo(16, i);
+        hamster::Models::Torrent::Insert(db, *ti);
+        hamster::Models::Torrent::Insert(db, *MakeTorrentInfo(20, i));
+
+        hashes.push_back(ti->info_hashes());
+    }
+
+    sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+
+    std::size_t next = 0;
+    std::size_t matches = 0;
+
+    for (auto _ : state)
+    {
+        auto const found = hamster::Models::TorrentSignature::FindSimilar(db, hashes[next++ % hashes.size()], 20);
+        matches += found.size();
+    }
+
+    sqlite3_close(db);
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["matches"] = benchmark::Counter(static_cast<double>(matches), benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_FindSimilar)->RangeMultiplier(10)->Range(1000, 100000)->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <streambuf>
+
+namespace hamster::Bench
+{
+    // Discards everything written to it, for measuring what it takes to
+    // format output without the cost of writing it anywhere
+    class NullBuffer : public std::streambuf
+    {
+    protected:
+        int overflow(int c) override { return c; }
+    };
+}
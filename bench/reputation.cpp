@@ -0,0 +1,114 @@
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "reputation.hpp"
+#include "synthetic.hpp"
+
+using hamster::Bench::MakeEndpoints;
+using hamster::NodeReputation;
+
+// The cost of judging a source, which the indexer pays for every
+// sample_infohashes response, against a trie of the given number of hosts
+static void BM_ReputationWeight(benchmark::State& state)
+{
+    auto const endpoints = MakeEndpoints(static_cast<std::size_t>(state.range(0)), 1);
+    std::mt19937 rng(1);
+
+    NodeReputation reputation;
+
+    for (auto const& endpoint : endpoints)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            if (rng() % 4 == 0) { reputation.Resolved(endpoint.address()); }
+            else { reputation.Failed(endpoint.address()); }
+        }
+    }
+
+    std::size_t next = 0;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(reputation.Weight(endpoints[next++ % endpoints.size()].address()));
+    }
+
+    state.counters["bytes_per_host"] = static_cast<double>(reputation.MemoryUsage()) / static_cast<double>(endpoints.size());
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_ReputationWeight)->RangeMultiplier(16)->Range(1024, 1 << 20);
+
+// Samples a synthetic DHT of 20000 honest nodes, a third of whose hashes
+// resolve, and 200 poisoning nodes spread over two /24 subnets, none of
+// whose do, which send a third of the samples. Every fetch is fed back
+// right away. Reports the share of fetches which are wasted without and
+// with the filter, and the share of resolving fetches the filter skips.
+static void BM_ReputationFilter(benchmark::State& state)
+{
+    static const std::size_t numHonest = 20000;
+    static const std::size_t numPoisoners = 200;
+    static const double honestResolveRatio = 1.0 / 3;
+
+    auto const honest = MakeEndpoints(numHonest, 1);
+    std::vector<boost::asio::ip::address> poisoners;
+
+    for (std::size_t i = 0; i < numPoisoners; i++)
+    {
+        auto const subnet = i % 2 == 0 ? 0xc6336400u : 0xcb007100u;
+        poisoners.push_back(boost::asio::ip::address_v4(subnet | static_cast<std::uint32_t>(i / 2 + 1)));
+    }
+
+    auto const samples = static_cast<std::size_t>(state.range(0));
+
+    double wastedBefore = 0;
+    double wastedAfter = 0;
+    double resolvingSkipped = 0;
+
+    for (auto _ : state)
+    {
+        std::mt19937_64 rng(state.iterations());
+        std::uniform_real_distribution<double> uniform(0, 1);
+
+        NodeReputation reputation;
+
+        std::uint64_t fetches[2] = { 0, 0 };
+        std::uint64_t wasted[2] = { 0, 0 };
+        std::uint64_t resolving = 0;
+        std::uint64_t skipped = 0;
+
+        for (std::size_t i = 0; i < samples; i++)
+        {
+            auto const poisoned = rng() % 3 == 0;
+            auto const& source = poisoned ? poisoners[rng() % poisoners.size()] : honest[rng() % honest.size()].address();
+            auto const resolves = !poisoned && uniform(rng) < honestResolveRatio;
+
+            fetches[0] += 1;
+            wasted[0] += resolves ? 0 : 1;
+            resolving += resolves ? 1 : 0;
+
+            if (uniform(rng) >= reputation.Weight(source))
+            {
+                skipped += resolves ? 1 : 0;
+                continue;
+            }
+
+            fetches[1] += 1;
+            wasted[1] += resolves ? 0 : 1;
+
+            if (resolves) { reputation.Resolved(source); }
+            else { reputation.Failed(source); }
+        }
+
+        wastedBefore += static_cast<double>(wasted[0]) / static_cast<double>(fetches[0]);
+        wastedAfter += static_cast<double>(wasted[1]) / static_cast<double>(fetches[1]);
+        resolvingSkipped += static_cast<double>(skipped) / static_cast<double>(resolving);
+    }
+
+    state.counters["wasted_before"] = benchmark::Counter(wastedBefore, benchmark::Counter::kAvgIterations);
+    state.counters["wasted_after"] = benchmark::Counter(wastedAfter, benchmark::Counter::kAvgIterations);
+    state.counters["resolving_skipped"] = benchmark::Counter(resolvingSkipped, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_ReputationFilter)->Arg(1 << 20)->Unit(benchmark::kMillisecond)->Iterations(3);
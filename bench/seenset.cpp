@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "seenset.hpp"
+#include "synthetic.hpp"
+
+using hamster::Bench::MakeInfoHashes;
+using hamster::SharedSeenSet;
+
+static std::string ScratchName()
+{
+    return "/hamster-bench-seen-" + std::to_string(::getpid());
+}
+
+// Claims fresh hashes on a table which has long been full of fetched ones,
+// the steady state of a busy host. Each claim evicts the oldest hash in its
+// probe window.
+static void BM_SeenSetClaimSaturated(benchmark::State& state)
+{
+    static const std::uint32_t capacity = 1 << 20;
+
+    auto const name = ScratchName();
+    auto const hashes = MakeInfoHashes(2 * capacity, 1);
+
+    {
+        auto seen = SharedSeenSet::Open(name, capacity, std::chrono::minutes(10));
+
+        for (std::uint32_t i = 0; i < capacity; i++)
+        {
+            seen->Claim(hashes[i]);
+            seen->MarkDone(hashes[i]);
+        }
+
+        std::size_t next = capacity;
+        std::uint64_t full = 0;
+
+        for (auto _ : state)
+        {
+            auto const& hash = hashes[next++ % hashes.size()];
+
+            if (seen->Claim(hash) == SharedSeenSet::ClaimResult::Full) { full += 1; }
+            seen->MarkDone(hash);
+        }
+
+        state.counters["full"] = static_cast<double>(full);
+    }
+
+    ::shm_unlink(name.c_str());
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_SeenSetClaimSaturated);
+
+// Forks the given number of processes which all claim the same hashes, each
+// in an order of its own, the way hamster processes sharing a segment see
+// the same popular hashes. Every hash must be fetched exactly once, counting
+// the claims which found the table full, as the indexer fetches those too.
+// Fails on any hash fetched by more than one process.
+static void BM_SeenSetProcesses(benchmark::State& state)
+{
+    static const std::size_t numHashes = 100000;
+
+    auto const processes = static_cast<int>(state.range(0));
+    auto const name = ScratchName();
+    auto const hashes = MakeInfoHashes(numHashes, 2);
+
+    // How many times each hash was claimed, shared with the children
+    auto const claims = static_cast<std::atomic<std::uint32_t>*>(::mmap(
+        nullptr,
+        numHashes * sizeof(std::atomic<std::uint32_t>),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0));
+
+    if (claims == MAP_FAILED)
+    {
+        state.SkipWithError("mmap failed");
+        return;
+    }
+
+    std::uint64_t duplicates = 0;
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+
+        ::shm_unlink(name.c_str());
+        std::fill(claims, claims + numHashes, 0u);
+
+        // Created up front, so the children only attach
+        auto const created = SharedSeenSet::Open(name, 2 * numHashes, std::chrono::minutes(10));
+
+        state.ResumeTiming();
+
+        std::vector<pid_t> children;
+
+        for (int p = 0; p < processes; p++)
+        {
+            auto const pid = ::fork();
+
+            if (pid == 0)
+            {
+                std::vector<std::size_t> order(numHashes);
+                for (std::size_t i = 0; i < numHashes; i++) { order[i] = i; }
+                std::shuffle(order.begin(), order.end(), std::mt19937(p));
+
+                auto seen = SharedSeenSet::Open(name, 2 * numHashes, std::chrono::minutes(10));
+
+                for (auto const i : order)
+                {
+                    auto const result = seen->Claim(hashes[i]);
+
+                    if (result == SharedSeenSet::ClaimResult::Claimed || result == SharedSeenSet::ClaimResult::Full)
+                    {
+                        claims[i].fetch_add(1, std::memory_order_relaxed);
+                        seen->MarkDone(hashes[i]);
+                    }
+                }
+
+                ::_exit(0);
+            }
+
+            children.push_back(pid);
+        }
+
+        bool failed = false;
+
+        for (auto const pid : children)
+        {
+            int status = 0;
+            ::waitpid(pid, &status, 0);
+            failed = failed || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        }
+
+        if (failed)
+        {
+            state.SkipWithError("A claiming process failed");
+            break;
+        }
+
+        for (std::size_t i = 0; i < numHashes; i++)
+        {
+            auto const count = claims[i].load();
+
+            if (count == 0)
+            {
+                state.SkipWithError("A hash was never claimed");
+                break;
+            }
+
+            duplicates += count - 1;
+        }
+
+        if (duplicates > 0)
+        {
+            state.SkipWithError("A hash was claimed by more than one process");
+            break;
+        }
+    }
+
+    ::shm_unlink(name.c_str());
+    ::munmap(claims, numHashes * sizeof(std::atomic<std::uint32_t>));
+
+    state.SetItemsProcessed(state.iterations() * processes * numHashes);
+    state.counters["duplicate_claims"] = benchmark::Counter(static_cast<double>(duplicates), benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_SeenSetProcesses)->Arg(2)->Arg(8)->Arg(32)->Unit(benchmark::kMillisecond)->UseRealTime();
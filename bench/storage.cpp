@@ -0,0 +1,197 @@
+#include <filesystem>
+#include <memory>
+#include <string>
+
+#include <benchmark/benchmark.h>
+#include <sqlite3.h>
+#include <unistd.h>
+
+#include "database.hpp"
+#include "logstorage.hpp"
+#include "migrator.hpp"
+#include "sqlitestorage.hpp"
+#include "synthetic.hpp"
+
+namespace fs = std::filesystem;
+using hamster::Bench::MakeInfoHashes;
+using hamster::Bench::MakeTorrentInfo;
+
+static const int commitInterval = 1000;
+
+// A storage engine opened on a scratch path, removed again once done with.
+// Both engines write to disk so they pay for their syncs alike.
+class ScratchStorage
+{
+public:
+    explicit ScratchStorage(std::string engine)
+        : m_engine(std::move(engine)),
+          m_path(fs::temp_directory_path() / ("hamster-bench-" + std::to_string(::getpid())))
+    {
+        Reopen();
+    }
+
+    ~ScratchStorage()
+    {
+        Remove();
+    }
+
+    hamster::Storage& Get() { return *m_storage; }
+
+    // Starts over with an empty store
+    void Reopen()
+    {
+        Remove();
+
+        if (m_engine == "log")
+        {
+            m_storage = std::make_unique<hamster::LogStorage>(m_path.string());
+        }
+        else
+        {
+            sqlite3* db = hamster::OpenDatabase(m_path.string());
+            hamster::MigrateDatabase(db);
+            m_storage = std::make_unique<hamster::SqliteStorage>(db);
+        }
+    }
+
+private:
+    void Remove()
+    {
+        m_storage.reset();
+
+        fs::remove_all(m_path);
+        fs::remove(m_path.string() + "-wal");
+        fs::remove(m_path.string() + "-shm");
+    }
+
+    std::string m_engine;
+    fs::path m_path;
+    std::unique_ptr<hamster::Storage> m_storage;
+};
+
+// Inserts torrents in batches the way the importer does
+static void BM_StorageIngest(benchmark::State& state, const std::string& engine)
+{
+    static const int poolSize = 4 * commitInterval;
+
+    std::vector<std::shared_ptr<lt::torrent_info>> pool;
+
+    for (int i = 0; i < poolSize; i++)
+    {
+        pool.push_back(MakeTorrentInfo(8, i));
+    }
+
+    ScratchStorage scratch(engine);
+    std::size_t next = 0;
+
+    scratch.Get().Begin();
+
+    for (auto _ : state)
+    {
+        // Start over with an empty store once every torrent is inserted to
+        // keep the duplicate check from short circuiting the insert.
+        if (next == pool.size())
+        {
+            state.PauseTiming();
+            scratch.Get().Commit();
+            scratch.Reopen();
+            scratch.Get().Begin();
+            next = 0;
+            state.ResumeTiming();
+        }
+
+        scratch.Get().InsertTorrent(*pool[next++]);
+
+        if (next % commitInterval == 0)
+        {
+            scratch.Get().Commit();
+            scratch.Get().Begin();
+        }
+    }
+
+    scratch.Get().Commit();
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_CAPTURE(BM_StorageIngest, sqlite, std::string("sqlite"))->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_StorageIngest, log, std::string("log"))->Unit(benchmark::kMicrosecond);
+
+// Looks up a mix of indexed and unknown info hashes, like the lookups made
+// for sampled hashes and resolve requests.
+static void BM_StorageLookup(benchmark::State& state, const std::string& engine)
+{
+    static const int numTorrents = 10000;
+
+    ScratchStorage scratch(engine);
+    std::vector<lt::info_hash_t> hashes = MakeInfoHashes(numTorrents, 1);
+
+    scratch.Get().Begin();
+
+    for (int i = 0; i < numTorrents; i++)
+    {
+        auto const ti = MakeTorrentInfo(8, i);
+        scratch.Get().InsertTorrent(*ti);
+        hashes.push_back(ti->info_hashes());
+    }
+
+    scratch.Get().Commit();
+
+    std::size_t next = 0;
+    std::size_t found = 0;
+
+    for (auto _ : state)
+    {
+        // Alternate between the unknown and the indexed hashes
+        auto const& hash = hashes[(next % 2) * numTorrents + (next / 2) % numTorrents];
+        next += 1;
+
+        found += scratch.Get().GetTorrent(hash) ? 1 : 0;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["hit_rate"] = benchmark::Counter(static_cast<double>(found), benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK_CAPTURE(BM_StorageLookup, sqlite, std::string("sqlite"));
+BENCHMARK_CAPTURE(BM_StorageLookup, log, std::string("log"));
+
+// Finds the re-packs of indexed torrents. The cost should follow the number
+// of candidates sharing a band bucket, not the size of the index.
+static void BM_StorageFindSimilar(benchmark::State& state, const std::string& engine)
+{
+    auto const numTorrents = static_cast<int>(state.range(0));
+
+    ScratchStorage scratch(engine);
+    std::vector<lt::info_hash_t> hashes;
+
+    scratch.Get().Begin();
+
+    // Torrents built from the same seed share their leading files, so every
+    // torrent has one re-pack with a Jaccard similarity of 0.8.
+    for (int i = 0; i < numTorrents / 2; i++)
+    {
+        auto const ti = MakeTorrentInfo(16, i);
+        scratch.Get().InsertTorrent(*ti);
+        scratch.Get().InsertTorrent(*MakeTorrentInfo(20, i));
+
+        hashes.push_back(ti->info_hashes());
+    }
+
+    scratch.Get().Commit();
+
+    std::size_t next = 0;
+    std::size_t matches = 0;
+
+    for (auto _ : state)
+    {
+        matches += scratch.Get().FindSimilar(hashes[next++ % hashes.size()], 20).size();
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["matches"] = benchmark::Counter(static_cast<double>(matches), benchmark::Counter::kAvgIterations);
+    state.counters["bytes_per_torrent"] = static_cast<double>(scratch.Get().MemoryUsage()) / numTorrents;
+}
+
+BENCHMARK_CAPTURE(BM_StorageFindSimilar, sqlite, std::string("sqlite"))->RangeMultiplier(10)->Range(1000, 100000)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_StorageFindSimilar, log, std::string("log"))->RangeMultiplier(10)->Range(1000, 100000)->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,164 @@
+#include <array>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <boost/asio.hpp>
+#include <libtorrent/session.hpp>
+#include <libtorrent/session_params.hpp>
+#include <libtorrent/settings_pack.hpp>
+#include <libtorrent/sha1_hash.hpp>
+#include <unistd.h>
+
+#include "database.hpp"
+#include "indexer.hpp"
+#include "migrator.hpp"
+#include "options.hpp"
+#include "sqlitestorage.hpp"
+
+using namespace std::chrono_literals;
+
+static const int hashesPerNode = 8;
+static const std::chrono::seconds announceInterval = 15s;
+static const std::chrono::seconds swarmTimeout = 120s;
+
+// A DHT node listening on the IPv4 and the IPv6 loopback address, which
+// announces a few info hashes of its own for the indexer to sample
+static std::unique_ptr<lt::session> StartNode(int port, const std::string& bootstrap)
+{
+    auto const listenPort = std::to_string(port);
+
+    lt::settings_pack pack;
+    pack.set_int(lt::settings_pack::alert_mask, 0);
+    pack.set_str(lt::settings_pack::listen_interfaces, "127.0.0.1:" + listenPort + ",[::1]:" + listenPort);
+    pack.set_str(lt::settings_pack::dht_bootstrap_nodes, bootstrap);
+    pack.set_bool(lt::settings_pack::enable_dht, true);
+    pack.set_bool(lt::settings_pack::enable_lsd, false);
+    pack.set_bool(lt::settings_pack::enable_natpmp, false);
+    pack.set_bool(lt::settings_pack::enable_upnp, false);
+
+    // The same settings --dht-local-swarm applies to the indexer
+    pack.set_bool(lt::settings_pack::dht_restrict_routing_ips, false);
+    pack.set_bool(lt::settings_pack::dht_restrict_search_ips, false);
+
+    return std::make_unique<lt::session>(lt::session_params(pack));
+}
+
+// Starts a swarm of the given number of libtorrent sessions on [::1] and
+// 127.0.0.1, and an indexer bootstrapping from it with --dht-local-swarm,
+// and runs until the indexer has sampled info hashes over both families.
+// Fails if either family has no samples within two minutes. Reports the
+// time it took and what each family found.
+static void BM_LocalSwarm(benchmark::State& state)
+{
+    auto const numNodes = static_cast<int>(state.range(0));
+
+    // Keep clear of other runs on the host
+    int const basePort = 30000 + static_cast<int>(::getpid() % 20000);
+    auto const bootstrap = "127.0.0.1:" + std::to_string(basePort) + ",[::1]:" + std::to_string(basePort);
+
+    for (auto _ : state)
+    {
+        std::vector<std::unique_ptr<lt::session>> nodes;
+
+        for (int i = 0; i < numNodes; i++)
+        {
+            nodes.push_back(StartNode(basePort + i, bootstrap));
+        }
+
+        std::vector<std::string> args {
+            "hamster",
+            "--db-file", ":memory:",
+            "--dht-bootstrap-nodes", bootstrap,
+            "--dht-local-swarm",
+            "--listen-interfaces", "127.0.0.1:" + std::to_string(basePort + numNodes) + ",[::1]:" + std::to_string(basePort + numNodes),
+            "--log-level", "warning"
+        };
+
+        std::vector<char*> argv;
+        for (auto& arg : args) { argv.push_back(arg.data()); }
+
+        auto const opts = hamster::Options::Parse(static_cast<int>(argv.size()), argv.data());
+
+        sqlite3* db = hamster::OpenDatabase(":memory:");
+        hamster::MigrateDatabase(db);
+        hamster::SqliteStorage storage(db);
+
+        boost::asio::io_context io;
+        auto indexer = std::make_unique<hamster::LibtorrentIndexer>(io, storage, opts);
+
+        std::mt19937 rng(1);
+        std::vector<lt::sha1_hash> hashes(static_cast<std::size_t>(numNodes * hashesPerNode));
+
+        for (auto& hash : hashes)
+        {
+            for (auto& byte : hash) { byte = static_cast<std::uint8_t>(rng()); }
+        }
+
+        auto const started = std::chrono::steady_clock::now();
+        auto lastAnnounce = started - announceInterval;
+        std::array<hamster::LibtorrentIndexer::FamilyTotals, 2> families{};
+
+        while (std::chrono::steady_clock::now() - started < swarmTimeout)
+        {
+            // Announce again until the routing tables have filled in, which
+            // the first announces find empty
+            if (std::chrono::steady_clock::now() - lastAnnounce >= announceInterval)
+            {
+                for (std::size_t i = 0; i < hashes.size(); i++)
+                {
+                    nodes[i % nodes.size()]->dht_announce(hashes[i], basePort + static_cast<int>(i % nodes.size()));
+                }
+
+                lastAnnounce = std::chrono::steady_clock::now();
+            }
+
+            io.run_for(100ms);
+            if (io.stopped()) { io.restart(); }
+
+            families = indexer->Families();
+            if (families[0].samples > 0 && families[1].samples > 0) { break; }
+        }
+
+        state.SetIterationTime(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+
+        state.counters["ipv4_nodes"] = static_cast<double>(families[0].nodes);
+        state.counters["ipv4_samples"] = static_cast<double>(families[0].samples);
+        state.counters["ipv6_nodes"] = static_cast<double>(families[1].nodes);
+        state.counters["ipv6_samples"] = static_cast<double>(families[1].samples);
+
+        if (families[0].samples == 0 || families[1].samples == 0)
+        {
+            state.SkipWithError(families[1].samples == 0 ? "No IPv6 samples" : "No IPv4 samples");
+        }
+
+        bool drained = false;
+
+        boost::asio::co_spawn(
+            io,
+            [&]() -> boost::asio::awaitable<void>
+            {
+                co_await indexer->Drain(5s);
+                drained = true;
+            },
+            boost::asio::detached);
+
+        while (!drained)
+        {
+            io.run_for(100ms);
+            if (io.stopped()) { io.restart(); }
+        }
+
+        if (indexer->SessionShuttingDown())
+        {
+            state.SkipWithError("The session did not shut down within the drain timeout");
+        }
+
+        indexer.reset();
+    }
+}
+
+BENCHMARK(BM_LocalSwarm)->Arg(16)->Arg(64)->Iterations(1)->UseManualTime()->Unit(benchmark::kSecond);
@@ -0,0 +1,75 @@
+#include "synthetic.hpp"
+
+#include <iterator>
+#include <random>
+#include <string>
+
+#include <libtorrent/bencode.hpp>
+#include <libtorrent/create_torrent.hpp>
+
+namespace lt = libtorrent;
+
+std::shared_ptr<lt::torrent_info> hamster::Bench::MakeTorrentInfo(int numFiles, std::uint32_t seed)
+{
+    static const int pieceSize = 16 * 1024;
+
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<std::int64_t> sizes(1, 64 * pieceSize);
+
+    auto const root = "synthetic-" + std::to_string(seed);
+
+    lt::file_storage fs;
+
+    for (int i = 0; i < numFiles; i++)
+    {
+        fs.add_file(root + "/file-" + std::to_string(i) + ".bin", sizes(rng));
+    }
+
+    lt::create_torrent ct(fs, pieceSize, lt::create_torrent::v1_only);
+
+    // The piece hashes are never verified, so leave them zeroed
+    for (int i = 0; i < ct.num_pieces(); i++)
+    {
+        ct.set_hash(lt::piece_index_t{i}, lt::sha1_hash{});
+    }
+
+    std::vector<char> buffer;
+    lt::bencode(std::back_inserter(buffer), ct.generate());
+
+    return std::make_shared<lt::torrent_info>(buffer, lt::from_span);
+}
+
+std::vector<lt::info_hash_t> hamster::Bench::MakeInfoHashes(std::size_t count, std::uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> dist(0, 255);
+
+    std::vector<lt::info_hash_t> hashes;
+    hashes.reserve(count);
+
+    for (std::size_t i = 0; i < count; i++)
+    {
+        lt::sha1_hash hash;
+        for (auto& b : hash) { b = static_cast<std::uint8_t>(dist(rng)); }
+        hashes.emplace_back(hash);
+    }
+
+    return hashes;
+}
+
+std::vector<boost::asio::ip::udp::endpoint> hamster::Bench::MakeEndpoints(std::size_t count, std::uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<std::uint32_t> addrs;
+    std::uniform_int_distribution<std::uint16_t> ports(1024, 65535);
+
+    std::vector<boost::asio::ip::udp::endpoint> endpoints;
+    endpoints.reserve(count);
+
+    for (std::size_t i = 0; i < count; i++)
+    {
+        endpoints.emplace_back(boost::asio::ip::address_v4(addrs(rng)), ports(rng));
+    }
+
+    return endpoints;
+}
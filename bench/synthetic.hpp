@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <libtorrent/info_hash.hpp>
+#include <libtorrent/torrent_info.hpp>
+
+namespace hamster::Bench
+{
+    // Builds a v1 torrent with the given number of files entirely in memory.
+    // Different seeds produce different info hashes.
+    std::shared_ptr<lt::torrent_info> MakeTorrentInfo(int numFiles, std::uint32_t seed);
+
+    std::vector<lt::info_hash_t> MakeInfoHashes(std::size_t count, std::uint32_t seed);
+
+    std::vector<boost::asio::ip::udp::endpoint> MakeEndpoints(std::size_t count, std::uint32_t seed);
+}
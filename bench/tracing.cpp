@@ -0,0 +1,47 @@
+#include <ostream>
+
+#include <benchmark/benchmark.h>
+
+#include "nullbuffer.hpp"
+#include "tracing.hpp"
+
+using hamster::Bench::NullBuffer;
+
+// The cost of a span, which is paid for every alert and every statement.
+// Compare BM_StorageIngest built with and without HAMSTER_TRACING for the
+// overhead on ingest as a whole.
+static void BM_TraceSpan(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        HAMSTER_TRACE_SPAN("BM_TraceSpan");
+        benchmark::ClobberMemory();
+    }
+
+    state.counters["compiled"] = hamster::Tracing::Compiled ? 1 : 0;
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_TraceSpan);
+
+// Dumps a full buffer, which the trace command does on the io thread
+static void BM_TraceDump(benchmark::State& state)
+{
+    for (std::size_t i = 0; i < hamster::Tracing::BufferSize; i++)
+    {
+        HAMSTER_TRACE_SPAN("BM_TraceDump");
+    }
+
+    NullBuffer buffer;
+    std::ostream stream(&buffer);
+    std::size_t events = 0;
+
+    for (auto _ : state)
+    {
+        events = hamster::Tracing::Dump(stream);
+    }
+
+    state.counters["events"] = static_cast<double>(events);
+}
+
+BENCHMARK(BM_TraceDump)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,317 @@
+#include "census.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include <boost/crc.hpp>
+#include <boost/log/trivial.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+
+using hamster::DhtCensus;
+using hamster::HyperLogLog;
+
+// 1 KiB and about 3% error per bucket, which sums to about 1% over the
+// keyspace. Nodes are not bucketed.
+static const int bucketPrecision = 10;
+static const int nodePrecision = 12;
+
+static const std::chrono::hours generationLength = std::chrono::hours(24);
+
+// Each info hash is stored on the 8 nodes closest to it (BEP 5)
+static const double storageReplication = 8;
+
+// Below this share of overlap, the HyperLogLog error swamps the recapture
+static const double minOverlap = 0.1;
+
+static const char fileMagic[8] = { 'H', 'A', 'M', 'C', 'E', 'N', 'S', '1' };
+
+static std::int64_t ToSeconds(std::chrono::system_clock::time_point time)
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(time.time_since_epoch()).count();
+}
+
+// The top bits pick the bucket, so the sketch is fed the bits after them
+static std::uint64_t SketchHash(const lt::sha1_hash& hash)
+{
+    std::uint64_t value;
+    std::memcpy(&value, hash.data() + 1, sizeof(value));
+
+    return value;
+}
+
+static int HalfOf(const boost::asio::ip::udp::endpoint& endpoint)
+{
+    // FNV-1a over the address and port
+    std::uint64_t hash = 0xcbf29ce484222325;
+
+    auto const mix = [&](const auto& bytes)
+    {
+        for (auto const b : bytes)
+        {
+            hash ^= static_cast<std::uint8_t>(b);
+            hash *= 0x100000001b3;
+        }
+    };
+
+    auto const address = endpoint.address();
+
+    if (address.is_v4()) { mix(address.to_v4().to_bytes()); }
+    else { mix(address.to_v6().to_bytes()); }
+
+    std::uint16_t const port = endpoint.port();
+    mix(std::array<std::uint8_t, 2>{ static_cast<std::uint8_t>(port >> 8), static_cast<std::uint8_t>(port) });
+
+    return static_cast<int>((hash >> 32) & 1);
+}
+
+// Chapman's form of the Lincoln-Petersen estimator, from two sketches of
+// (roughly) independent captures of the same population
+static double Recapture(const HyperLogLog& first, const HyperLogLog& second)
+{
+    auto both = first;
+    both.Merge(second);
+
+    double const a = first.Estimate();
+    double const b = second.Estimate();
+    double const all = both.Estimate();
+    double const overlap = a + b - all;
+
+    if (all == 0 || overlap < minOverlap * all)
+    {
+        return 0;
+    }
+
+    return (a + 1) * (b + 1) / (overlap + 1) - 1;
+}
+
+DhtCensus::Generation::Generation()
+    : started(0),
+      sampled{
+          std::vector<HyperLogLog>(NumBuckets, HyperLogLog(bucketPrecision)),
+          std::vector<HyperLogLog>(NumBuckets, HyperLogLog(bucketPrecision)) },
+      indexed(NumBuckets, HyperLogLog(bucketPrecision)),
+      nodes(2, HyperLogLog(nodePrecision)),
+      reports(0),
+      reported(0)
+{
+}
+
+DhtCensus::DhtCensus()
+{
+    m_generations[0].started = ToSeconds(std::chrono::system_clock::now());
+}
+
+void DhtCensus::AddSample(const lt::sha1_hash& hash, const boost::asio::ip::udp::endpoint& source)
+{
+    m_generations[0].sampled[HalfOf(source)][hash[0] >> (8 - BucketBits)].Add(SketchHash(hash));
+}
+
+void DhtCensus::AddNode(const lt::sha1_hash& id, const boost::asio::ip::udp::endpoint& source)
+{
+    m_generations[0].nodes[HalfOf(source)].Add(SketchHash(id));
+}
+
+void DhtCensus::AddReport(int numInfohashes)
+{
+    if (numInfohashes < 0) { return; }
+
+    m_generations[0].reports += 1;
+    m_generations[0].reported += static_cast<std::uint64_t>(numInfohashes);
+}
+
+void DhtCensus::AddIndexed(const lt::sha1_hash& hash)
+{
+    m_generations[0].indexed[hash[0] >> (8 - BucketBits)].Add(SketchHash(hash));
+}
+
+DhtCensus::Estimates DhtCensus::Estimate() const
+{
+    auto const& current = m_generations[0];
+    auto const& previous = m_generations[1];
+
+    auto const merged = [](const HyperLogLog& lhs, const HyperLogLog& rhs)
+    {
+        auto sketch = lhs;
+        sketch.Merge(rhs);
+        return sketch;
+    };
+
+    Estimates estimates{};
+    bool recaptured = true;
+
+    for (int bucket = 0; bucket < NumBuckets; bucket++)
+    {
+        auto const first = merged(current.sampled[0][bucket], previous.sampled[0][bucket]);
+        auto const second = merged(current.sampled[1][bucket], previous.sampled[1][bucket]);
+
+        auto& b = estimates.buckets[bucket];
+        b.population = Recapture(first, second);
+        b.sampled = merged(first, second).Estimate();
+        b.indexed = merged(current.indexed[bucket], previous.indexed[bucket]).Estimate();
+
+        // The population is the sum of the buckets, so it needs them all
+        recaptured = recaptured && b.population > 0;
+
+        estimates.population += b.population;
+        estimates.sampled += b.sampled;
+        estimates.indexed += b.indexed;
+    }
+
+    if (!recaptured) { estimates.population = 0; }
+
+    auto const firstNodes = merged(current.nodes[0], previous.nodes[0]);
+    auto const secondNodes = merged(current.nodes[1], previous.nodes[1]);
+
+    estimates.nodes = Recapture(firstNodes, secondNodes);
+
+    auto const reports = current.reports + previous.reports;
+
+    if (reports > 0 && estimates.nodes > 0)
+    {
+        double const mean = static_cast<double>(current.reported + previous.reported) / static_cast<double>(reports);
+        estimates.reportedPopulation = mean * estimates.nodes / storageReplication;
+    }
+
+    auto const since = previous.started != 0 ? previous.started : current.started;
+    estimates.since = std::chrono::system_clock::time_point(std::chrono::seconds(since));
+
+    return estimates;
+}
+
+void DhtCensus::Rotate(std::chrono::system_clock::time_point now)
+{
+    if (ToSeconds(now) - m_generations[0].started < std::chrono::duration_cast<std::chrono::seconds>(generationLength).count())
+    {
+        return;
+    }
+
+    m_generations[1] = std::move(m_generations[0]);
+    m_generations[0] = Generation();
+    m_generations[0].started = ToSeconds(now);
+}
+
+bool DhtCensus::Load(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file)
+    {
+        return false;
+    }
+
+    std::string const data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::array<Generation, 2> generations;
+
+    std::size_t expected = sizeof(fileMagic) + sizeof(std::uint32_t);
+
+    for (auto& generation : generations)
+    {
+        expected += sizeof(generation.started) + sizeof(generation.reports) + sizeof(generation.reported);
+        expected += (3 * NumBuckets << bucketPrecision) + (2 << nodePrecision);
+    }
+
+    std::uint32_t checksum = 0;
+
+    if (data.size() == expected)
+    {
+        std::memcpy(&checksum, data.data() + data.size() - sizeof(checksum), sizeof(checksum));
+    }
+
+    boost::crc_32_type crc;
+    crc.process_bytes(data.data(), data.size() - std::min(data.size(), sizeof(checksum)));
+
+    if (data.size() != expected
+        || std::memcmp(data.data(), fileMagic, sizeof(fileMagic)) != 0
+        || crc.checksum() != checksum)
+    {
+        BOOST_LOG_TRIVIAL(warning) << "Ignoring the unreadable DHT census in " << path;
+        return false;
+    }
+
+    const char* in = data.data() + sizeof(fileMagic);
+
+    auto const read = [&](void* out, std::size_t size)
+    {
+        std::memcpy(out, in, size);
+        in += size;
+    };
+
+    for (auto& generation : generations)
+    {
+        read(&generation.started, sizeof(generation.started));
+        read(&generation.reports, sizeof(generation.reports));
+        read(&generation.reported, sizeof(generation.reported));
+
+        for (auto& half : generation.sampled)
+        {
+            for (auto& sketch : half) { read(sketch.Registers().data(), sketch.Registers().size()); }
+        }
+
+        for (auto& sketch : generation.indexed) { read(sketch.Registers().data(), sketch.Registers().size()); }
+        for (auto& sketch : generation.nodes) { read(sketch.Registers().data(), sketch.Registers().size()); }
+    }
+
+    m_generations = std::move(generations);
+
+    return true;
+}
+
+void DhtCensus::Save(const std::string& path) const
+{
+    std::string out(fileMagic, sizeof(fileMagic));
+
+    auto const write = [&](const void* data, std::size_t size)
+    {
+        out.append(static_cast<const char*>(data), size);
+    };
+
+    for (auto const& generation : m_generations)
+    {
+        write(&generation.started, sizeof(generation.started));
+        write(&generation.reports, sizeof(generation.reports));
+        write(&generation.reported, sizeof(generation.reported));
+
+        for (auto const& half : generation.sampled)
+        {
+            for (auto const& sketch : half) { write(sketch.Registers().data(), sketch.Registers().size()); }
+        }
+
+        for (auto const& sketch : generation.indexed) { write(sketch.Registers().data(), sketch.Registers().size()); }
+        for (auto const& sketch : generation.nodes) { write(sketch.Registers().data(), sketch.Registers().size()); }
+    }
+
+    boost::crc_32_type crc;
+    crc.process_bytes(out.data(), out.size());
+
+    std::uint32_t const checksum = crc.checksum();
+    write(&checksum, sizeof(checksum));
+
+    auto const temp = path + ".tmp";
+    int const fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    bool written = fd >= 0;
+    std::size_t offset = 0;
+
+    while (written && offset < out.size())
+    {
+        auto const res = ::write(fd, out.data() + offset, out.size() - offset);
+
+        if (res < 0 && errno == EINTR) { continue; }
+        if (res <= 0) { written = false; break; }
+
+        offset += static_cast<std::size_t>(res);
+    }
+
+    written = written && ::fdatasync(fd) == 0;
+
+    if (fd >= 0) { ::close(fd); }
+
+    if (!written || ::rename(temp.c_str(), path.c_str()) != 0)
+    {
+        BOOST_LOG_TRIVIAL(warning) << "Failed to save the DHT census to " << path << ": " << std::strerror(errno);
+        ::unlink(temp.c_str());
+    }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+#include <libtorrent/sha1_hash.hpp>
+
+#include "hyperloglog.hpp"
+
+namespace hamster
+{
+    // Estimates how many info hashes there are on the DHT, and how many of
+    // them the indexer has sampled and indexed, from HyperLogLog sketches
+    // fed with every sample.
+    //
+    // The keyspace is split into buckets by the top bits of the info hash,
+    // each with sketches of its own. The samples from two halves of the
+    // nodes, split by endpoint, go to separate sketches, and the population
+    // is recaptured from how much the two overlap. A second estimate is
+    // made from the number of info hashes nodes report to store, and the
+    // number of nodes, recaptured the same way from the nodes they return.
+    //
+    // Sketches cover the current and the previous day, so info hashes which
+    // left the DHT age out.
+    class DhtCensus
+    {
+    public:
+        static constexpr int BucketBits = 4;
+        static constexpr int NumBuckets = 1 << BucketBits;
+
+        struct Estimates
+        {
+            struct Bucket
+            {
+                double population;
+                double sampled;
+                double indexed;
+            };
+
+            // Recaptured from the samples, or 0 until the two halves
+            // overlap enough to tell
+            double population;
+
+            // From the counts reported by nodes, or 0 until there are enough
+            double reportedPopulation;
+
+            double sampled;
+            double indexed;
+            double nodes;
+
+            std::array<Bucket, NumBuckets> buckets;
+
+            // The start of the oldest sketches
+            std::chrono::system_clock::time_point since;
+        };
+
+        DhtCensus();
+
+        // Feeds the info hash the node at the endpoint sampled
+        void AddSample(const lt::sha1_hash& hash, const boost::asio::ip::udp::endpoint& source);
+
+        // Feeds a node returned by the node at the endpoint
+        void AddNode(const lt::sha1_hash& id, const boost::asio::ip::udp::endpoint& source);
+
+        // Feeds the number of info hashes a node reported to store
+        void AddReport(int numInfohashes);
+
+        // Feeds an info hash which is known to be indexed
+        void AddIndexed(const lt::sha1_hash& hash);
+
+        Estimates Estimate() const;
+
+        // Starts new sketches once the current ones are a day old
+        void Rotate(std::chrono::system_clock::time_point now);
+
+        // Reads the sketches saved by Save. Returns false if there are none,
+        // or they are unreadable.
+        bool Load(const std::string& path);
+
+        // Writes the sketches to a file next to the path and renames it over
+        // the path. Failures are logged.
+        void Save(const std::string& path) const;
+
+    private:
+        struct Generation
+        {
+            Generation();
+
+            // Seconds since the epoch, or 0 for none
+            std::int64_t started;
+
+            // By half, then by bucket
+            std::array<std::vector<HyperLogLog>, 2> sampled;
+
+            // By bucket
+            std::vector<HyperLogLog> indexed;
+
+            // By half
+            std::vector<HyperLogLog> nodes;
+
+            std::uint64_t reports;
+            std::uint64_t reported;
+        };
+
+        // Indexed by age
+        std::array<Generation, 2> m_generations;
+    };
+}
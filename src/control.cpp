@@ -0,0 +1,371 @@
+#include "control.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/log/trivial.hpp>
+#include <nlohmann/json.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "indexer.hpp"
+#include "models/infohash.hpp"
+#include "tracing.hpp"
+
+namespace local = boost::asio::local;
+using hamster::ControlClient;
+using hamster::ControlServer;
+using json = nlohmann::json;
+
+static const std::chrono::seconds defaultResolveTimeout = std::chrono::seconds(60);
+static const std::size_t maxLineLength = 64 * 1024;
+
+static json InfoHashesJson(const lt::info_hash_t& hashes)
+{
+    return {
+        { "info_hash_v1", hashes.has_v1() ? json(hamster::Models::InfoHashString(hashes.v1)) : json(nullptr) },
+        { "info_hash_v2", hashes.has_v2() ? json(hamster::Models::InfoHashString(hashes.v2)) : json(nullptr) }
+    };
+}
+
+static json ToJson(const hamster::Models::Torrent& torrent)
+{
+    json files = json::array();
+
+    for (auto const& file : torrent.files)
+    {
+        files.push_back({
+            { "path", file.path },
+            { "size", file.size }
+        });
+    }
+
+    json result = InfoHashesJson(torrent.infoHashes);
+    result["name"] = torrent.name;
+    result["size"] = torrent.size;
+    result["files"] = files;
+
+    return result;
+}
+
+static json Error(const std::string& message)
+{
+    return {
+        { "status", "error" },
+        { "message", message }
+    };
+}
+
+class ControlServer::Connection : public std::enable_shared_from_this<Connection>
+{
+public:
+    Connection(local::stream_protocol::socket socket, LibtorrentIndexer& indexer)
+        : m_socket(std::move(socket)),
+          m_buffer(maxLineLength),
+          m_indexer(indexer)
+    {
+    }
+
+    void Read()
+    {
+        boost::asio::async_read_until(
+            m_socket,
+            m_buffer,
+            '\n',
+            [self = shared_from_this()](boost::system::error_code ec, std::size_t)
+            {
+                if (ec) { return; }
+
+                std::istream stream(&self->m_buffer);
+                std::string line;
+                std::getline(stream, line);
+
+                self->Handle(line);
+            });
+    }
+
+private:
+    void Handle(const std::string& line)
+    {
+        std::istringstream stream(line);
+        std::string command;
+        stream >> command;
+
+        if (command == "resolve")
+        {
+            std::string hash;
+            int timeout = static_cast<int>(defaultResolveTimeout.count());
+            stream >> hash >> timeout;
+
+            auto const ih = Models::ParseInfoHash(hash);
+
+            if (!ih)
+            {
+                Write(Error("Invalid info hash: " + hash));
+                return;
+            }
+
+            auto const started = std::chrono::steady_clock::now();
+
+            m_indexer.Resolve(
+                *ih,
+                std::chrono::seconds(std::max(timeout, 1)),
+                [self = shared_from_this(), started](const std::optional<Models::Torrent>& torrent)
+                {
+                    auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - started);
+
+                    json response = {
+                        { "status", torrent ? "ok" : "timeout" },
+                        { "elapsed_ms", elapsed.count() }
+                    };
+
+                    if (torrent) { response["torrent"] = ToJson(*torrent); }
+
+                    self->Write(response);
+                });
+
+            return;
+        }
+
+        if (command == "fetch")
+        {
+            std::vector<lt::info_hash_t> hashes;
+            std::string hash;
+
+            while (stream >> hash)
+            {
+                auto const ih = Models::ParseInfoHash(hash);
+
+                if (!ih)
+                {
+                    Write(Error("Invalid info hash: " + hash));
+                    return;
+                }
+
+                hashes.push_back(*ih);
+            }
+
+            auto const queued = m_indexer.Enqueue(hashes);
+
+            Write({
+                { "status", "ok" },
+                { "queued", queued }
+            });
+
+            return;
+        }
+
+        if (command == "similar")
+        {
+            std::string hash;
+            int limit = 20;
+            stream >> hash >> limit;
+
+            auto const ih = Models::ParseInfoHash(hash);
+
+            if (!ih)
+            {
+                Write(Error("Invalid info hash: " + hash));
+                return;
+            }
+
+            json torrents = json::array();
+
+            for (auto const& match : m_indexer.Similar(*ih, static_cast<std::size_t>(std::max(limit, 1))))
+            {
+                json torrent = InfoHashesJson(match.infoHashes);
+                torrent["name"] = match.name;
+                torrent["size"] = match.size;
+                torrent["similarity"] = match.similarity;
+
+                torrents.push_back(torrent);
+            }
+
+            Write({
+                { "status", "ok" },
+                { "torrents", torrents }
+            });
+
+            return;
+        }
+
+        if (command == "stats")
+        {
+            auto const census = m_indexer.Census();
+            json buckets = json::array();
+
+            for (int bucket = 0; bucket < DhtCensus::NumBuckets; bucket++)
+            {
+                auto const& b = census.buckets[bucket];
+
+                buckets.push_back({
+                    { "bucket", bucket },
+                    { "population", static_cast<std::uint64_t>(b.population) },
+                    { "sampled", static_cast<std::uint64_t>(b.sampled) },
+                    { "indexed", static_cast<std::uint64_t>(b.indexed) }
+                });
+            }
+
+            Write({
+                { "status", "ok" },
+                { "census", {
+                    { "since", std::chrono::duration_cast<std::chrono::seconds>(census.since.time_since_epoch()).count() },
+                    { "population", static_cast<std::uint64_t>(census.population) },
+                    { "reported_population", static_cast<std::uint64_t>(census.reportedPopulation) },
+                    { "nodes", static_cast<std::uint64_t>(census.nodes) },
+                    { "sampled", static_cast<std::uint64_t>(census.sampled) },
+                    { "indexed", static_cast<std::uint64_t>(census.indexed) },
+                    { "coverage", census.population > 0 ? census.indexed / census.population : 0.0 },
+                    { "buckets", buckets }
+                }}
+            });
+
+            return;
+        }
+
+        if (command == "trace")
+        {
+            std::string path;
+            std::getline(stream >> std::ws, path);
+
+            if (path.empty())
+            {
+                Write(Error("Missing path"));
+                return;
+            }
+
+            if (!Tracing::Compiled)
+            {
+                Write(Error("Tracing is not built in, configure with -DHAMSTER_TRACING=ON"));
+                return;
+            }
+
+            try
+            {
+                auto const events = Tracing::Dump(path);
+
+                Write({
+                    { "status", "ok" },
+                    { "path", path },
+                    { "events", events }
+                });
+            }
+            catch (const std::exception& ex)
+            {
+                Write(Error(ex.what()));
+            }
+
+            return;
+        }
+
+        Write(Error("Unknown command: " + command));
+    }
+
+    void Write(const json& response)
+    {
+        auto data = std::make_shared<std::string>(response.dump() + "\n");
+
+        boost::asio::async_write(
+            m_socket,
+            boost::asio::buffer(*data),
+            [self = shared_from_this(), data](boost::system::error_code ec, std::size_t)
+            {
+                if (ec) { return; }
+                self->Read();
+            });
+    }
+
+    local::stream_protocol::socket m_socket;
+    boost::asio::streambuf m_buffer;
+    LibtorrentIndexer& m_indexer;
+};
+
+ControlServer::ControlServer(
+    boost::asio::io_context& io,
+    const std::string& path,
+    LibtorrentIndexer& indexer)
+    : m_acceptor(io),
+      m_path(path),
+      m_indexer(indexer)
+{
+    local::stream_protocol::endpoint endpoint(m_path);
+
+    // Remove a socket left behind by a process which did not shut down
+    // cleanly, but not one another process is still listening on
+    local::stream_protocol::socket probe(io);
+    boost::system::error_code ec;
+    probe.connect(endpoint, ec);
+
+    if (!ec)
+    {
+        throw std::runtime_error("Another process is listening on " + m_path);
+    }
+
+    if (ec == boost::asio::error::connection_refused)
+    {
+        ::unlink(m_path.c_str());
+    }
+
+    m_acceptor.open(endpoint.protocol());
+    m_acceptor.bind(endpoint);
+
+    // Whoever can connect can fetch, dump traces and so on. Restrict it to
+    // the owner regardless of the umask, before anyone can connect.
+    if (::chmod(m_path.c_str(), 0600) != 0)
+    {
+        throw std::runtime_error("Failed to set the permissions of " + m_path);
+    }
+
+    m_acceptor.listen();
+
+    Accept();
+}
+
+ControlServer::~ControlServer() noexcept
+{
+    boost::system::error_code ec;
+    m_acceptor.close(ec);
+
+    ::unlink(m_path.c_str());
+}
+
+void ControlServer::Accept()
+{
+    m_acceptor.async_accept(
+        [this](boost::system::error_code ec, local::stream_protocol::socket socket)
+        {
+            if (ec == boost::asio::error::operation_aborted) { return; }
+
+            if (ec)
+            {
+                BOOST_LOG_TRIVIAL(warning) << "Failed to accept control connection: " << ec.message();
+            }
+            else
+            {
+                std::make_shared<Connection>(std::move(socket), m_indexer)->Read();
+            }
+
+            Accept();
+        });
+}
+
+std::string ControlClient::Send(const std::string& path, const std::string& command)
+{
+    boost::asio::io_context io;
+    local::stream_protocol::socket socket(io);
+    socket.connect(local::stream_protocol::endpoint(path));
+
+    boost::asio::write(socket, boost::asio::buffer(command + "\n"));
+
+    boost::asio::streambuf buffer;
+    boost::asio::read_until(socket, buffer, '\n');
+
+    std::istream stream(&buffer);
+    std::string line;
+    std::getline(stream, line);
+
+    return line;
+}
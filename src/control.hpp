@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+
+#include <boost/asio.hpp>
+
+namespace hamster
+{
+    class LibtorrentIndexer;
+
+    // Serves line based commands on a local socket. Each command gets a
+    // single line JSON response.
+    //
+    //   resolve <info hash or magnet link> [timeout in seconds]
+    //   fetch <info hash or magnet link> [...]
+    //   similar <info hash or magnet link> [limit]
+    //   stats
+    //   trace <path>
+    class ControlServer
+    {
+    public:
+        ControlServer(
+            boost::asio::io_context& io,
+            const std::string& path,
+            LibtorrentIndexer& indexer);
+        ~ControlServer() noexcept;
+
+    private:
+        class Connection;
+
+        void Accept();
+
+        boost::asio::local::stream_protocol::acceptor m_acceptor;
+        std::string m_path;
+        LibtorrentIndexer& m_indexer;
+    };
+
+    class ControlClient
+    {
+    public:
+        // Sends a single command to the control socket at the given path and
+        // returns the response line.
+        static std::string Send(const std::string& path, const std::string& command);
+    };
+}
@@ -1,11 +1,24 @@
 #include "database.hpp"
 
+#include "tracing.hpp"
+
 sqlite3* hamster::OpenDatabase(const std::string& file)
 {
     sqlite3* db;
     int res = sqlite3_open(file.c_str(), &db);
     if (res != SQLITE_OK) throw hamster::DatabaseException(db);
 
+    // Only takes effect on a database which is still empty, so it has to
+    // come before switching to WAL, which writes the first page
+    res = sqlite3_exec(
+        db,
+        "PRAGMA auto_vacuum=INCREMENTAL;",
+        nullptr,
+        nullptr,
+        nullptr);
+
+    if (res != SQLITE_OK) throw hamster::DatabaseException(db);
+
     res = sqlite3_exec(
         db,
         "PRAGMA journal_mode=wal;",
@@ -15,6 +28,11 @@ sqlite3* hamster::OpenDatabase(const std::string& file)
 
     if (res != SQLITE_OK) throw hamster::DatabaseException(db);
 
+    // Wait for checkpoints run by other connections instead of failing
+    res = sqlite3_busy_timeout(db, 5000);
+
+    if (res != SQLITE_OK) throw hamster::DatabaseException(db);
+
     res = sqlite3_exec(
         db,
         "PRAGMA foreign_keys=ON;",
@@ -24,5 +42,7 @@ sqlite3* hamster::OpenDatabase(const std::string& file)
 
     if (res != SQLITE_OK) throw hamster::DatabaseException(db);
 
+    Tracing::TraceDatabase(db);
+
     return db;
 }
@@ -0,0 +1,624 @@
+#include "fetchjournal.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <string_view>
+#include <unordered_map>
+
+#include <boost/crc.hpp>
+#include <boost/log/trivial.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "database.hpp"
+
+namespace fs = std::filesystem;
+using hamster::FetchJournal;
+
+static const std::size_t replayBatchSize = 10000;
+
+enum RecordType : std::uint8_t
+{
+    AddRecord     = 1,
+    AttemptRecord = 2,
+    RemoveRecord  = 3
+};
+
+// Every record starts with a CRC-32 over the rest of the record and the
+// length of the rest, followed by the type and the info hash. Add records go
+// on with the first-seen time, the attempts and the source node. Integers are
+// stored in host byte order.
+static const std::size_t headerSize = 4 + 1;
+
+template<typename T>
+static void Put(std::string& out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void AppendRecord(
+    std::string& out,
+    RecordType type,
+    const lt::info_hash_t& hash,
+    const FetchJournal::Entry* entry = nullptr)
+{
+    auto const start = out.size();
+    out.append(headerSize, '\0');
+
+    Put<std::uint8_t>(out, type);
+    Put<std::uint8_t>(out, (hash.has_v1() ? 1 : 0) | (hash.has_v2() ? 2 : 0));
+    if (hash.has_v1()) { out.append(reinterpret_cast<const char*>(hash.v1.data()), lt::sha1_hash::size()); }
+    if (hash.has_v2()) { out.append(reinterpret_cast<const char*>(hash.v2.data()), lt::sha256_hash::size()); }
+
+    if (entry != nullptr)
+    {
+        auto const firstSeen = std::chrono::duration_cast<std::chrono::seconds>(
+            entry->firstSeen.time_since_epoch());
+        auto const& source = entry->source;
+
+        Put<std::int64_t>(out, firstSeen.count());
+        Put<std::uint16_t>(out, entry->attempts);
+
+        if (source.port() == 0)
+        {
+            Put<std::uint8_t>(out, 0);
+        }
+        else if (source.address().is_v4())
+        {
+            auto const bytes = source.address().to_v4().to_bytes();
+            Put<std::uint8_t>(out, 4);
+            out.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+            Put<std::uint16_t>(out, source.port());
+        }
+        else
+        {
+            auto const bytes = source.address().to_v6().to_bytes();
+            Put<std::uint8_t>(out, 6);
+            out.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+            Put<std::uint16_t>(out, source.port());
+        }
+    }
+
+    out[start + 4] = static_cast<char>(out.size() - start - headerSize);
+
+    boost::crc_32_type crc;
+    crc.process_bytes(out.data() + start + 4, out.size() - start - 4);
+
+    std::uint32_t const checksum = crc.checksum();
+    std::memcpy(&out[start], &checksum, sizeof(checksum));
+}
+
+// Decodes the record at the start of data. Returns its length, or 0 if it is
+// torn or corrupt.
+static std::size_t DecodeRecord(std::string_view data, RecordType& type, FetchJournal::Entry& entry)
+{
+    if (data.size() < headerSize) { return 0; }
+
+    std::uint32_t checksum;
+    std::memcpy(&checksum, data.data(), sizeof(checksum));
+    auto const length = static_cast<std::uint8_t>(data[4]);
+
+    if (data.size() - headerSize < length) { return 0; }
+
+    boost::crc_32_type crc;
+    crc.process_bytes(data.data() + 4, 1 + length);
+
+    if (crc.checksum() != checksum) { return 0; }
+
+    auto record = data.substr(headerSize, length);
+    bool ok = true;
+
+    auto const take = [&](void* out, std::size_t size)
+    {
+        if (!ok || record.size() < size) { ok = false; return; }
+        std::memcpy(out, record.data(), size);
+        record.remove_prefix(size);
+    };
+
+    std::uint8_t typeByte = 0;
+    std::uint8_t flags = 0;
+    take(&typeByte, sizeof(typeByte));
+    take(&flags, sizeof(flags));
+
+    type = static_cast<RecordType>(typeByte);
+    entry.hash = lt::info_hash_t();
+    if (flags & 1) { take(entry.hash.v1.data(), lt::sha1_hash::size()); }
+    if (flags & 2) { take(entry.hash.v2.data(), lt::sha256_hash::size()); }
+
+    if (type == AddRecord)
+    {
+        std::int64_t firstSeen = 0;
+        std::uint8_t family = 0;
+        std::uint16_t port = 0;
+
+        take(&firstSeen, sizeof(firstSeen));
+        take(&entry.attempts, sizeof(entry.attempts));
+        take(&family, sizeof(family));
+
+        entry.firstSeen = std::chrono::system_clock::time_point(std::chrono::seconds(firstSeen));
+        entry.source = boost::asio::ip::udp::endpoint();
+
+        if (family == 4)
+        {
+            boost::asio::ip::address_v4::bytes_type bytes;
+            take(bytes.data(), bytes.size());
+            take(&port, sizeof(port));
+            entry.source = { boost::asio::ip::address_v4(bytes), port };
+        }
+        else if (family == 6)
+        {
+            boost::asio::ip::address_v6::bytes_type bytes;
+            take(bytes.data(), bytes.size());
+            take(&port, sizeof(port));
+            entry.source = { boost::asio::ip::address_v6(bytes), port };
+        }
+    }
+
+    return ok ? headerSize + length : 0;
+}
+
+static bool WriteAll(int fd, std::string_view data)
+{
+    while (!data.empty())
+    {
+        auto const res = ::write(fd, data.data(), data.size());
+
+        if (res < 0 && errno == EINTR) { continue; }
+        if (res <= 0) { return false; }
+
+        data.remove_prefix(static_cast<std::size_t>(res));
+    }
+
+    return true;
+}
+
+// Calls the callback with every record of the file, up to a torn or corrupt
+// tail left by a crash.
+template<typename Callback>
+static void ForEachRecord(const std::string& path, Callback&& callback)
+{
+    int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        BOOST_LOG_TRIVIAL(warning) << "Failed to open " << path << ": " << std::strerror(errno);
+        return;
+    }
+
+    struct stat st {};
+    void* data = MAP_FAILED;
+
+    if (::fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        data = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    ::close(fd);
+
+    if (data == MAP_FAILED) { return; }
+
+    ::madvise(data, static_cast<std::size_t>(st.st_size), MADV_SEQUENTIAL);
+
+    std::string_view rest(static_cast<const char*>(data), static_cast<std::size_t>(st.st_size));
+    RecordType type;
+    FetchJournal::Entry entry{};
+
+    while (!rest.empty())
+    {
+        auto const length = DecodeRecord(rest, type, entry);
+
+        if (length == 0)
+        {
+            BOOST_LOG_TRIVIAL(warning)
+                << "Ignoring " << rest.size() << " torn or corrupt byte(s) at the end of " << path;
+            break;
+        }
+
+        callback(type, entry);
+        rest.remove_prefix(length);
+    }
+
+    ::munmap(data, static_cast<std::size_t>(st.st_size));
+}
+
+// Returns the entries left pending by the records of the given files, in the
+// order they were first journaled.
+static std::vector<FetchJournal::Entry> Fold(const std::vector<std::string>& paths, const std::atomic<bool>& stop)
+{
+    std::vector<FetchJournal::Entry> entries;
+    std::unordered_map<lt::info_hash_t, std::size_t> pending;
+
+    // Sized for files holding little but the add records of v1 hashes
+    std::uint64_t size = 0;
+    std::error_code ec;
+    for (auto const& path : paths) { size += fs::file_size(path, ec); }
+
+    if (!ec)
+    {
+        auto const expected = size / (headerSize + 2 + lt::sha1_hash::size() + 8 + 2 + 1 + 4 + 2);
+        entries.reserve(expected);
+        pending.reserve(expected);
+    }
+
+    for (auto const& path : paths)
+    {
+        if (stop) { return {}; }
+
+        ForEachRecord(
+            path,
+            [&](RecordType type, const FetchJournal::Entry& entry)
+            {
+                switch (type)
+                {
+                    case AddRecord:
+                    {
+                        // Replayed hashes are added again on top of their
+                        // original records
+                        auto const [it, inserted] = pending.insert({ entry.hash, entries.size() });
+
+                        if (inserted)
+                        {
+                            entries.push_back(entry);
+                            break;
+                        }
+
+                        auto& existing = entries[it->second];
+                        existing.firstSeen = std::min(existing.firstSeen, entry.firstSeen);
+                        existing.attempts = std::max(existing.attempts, entry.attempts);
+                    } break;
+
+                    case AttemptRecord:
+                    {
+                        auto const it = pending.find(entry.hash);
+                        if (it != pending.end()) { entries[it->second].attempts += 1; }
+                    } break;
+
+                    case RemoveRecord:
+                    {
+                        auto const it = pending.find(entry.hash);
+                        if (it == pending.end()) { break; }
+
+                        entries[it->second].attempts = FetchJournal::MaxAttempts;
+                        pending.erase(it);
+                    } break;
+                }
+            });
+    }
+
+    // Removed entries are marked as given up on
+    entries.erase(
+        std::remove_if(
+            entries.begin(),
+            entries.end(),
+            [](auto const& entry) { return entry.attempts >= FetchJournal::MaxAttempts; }),
+        entries.end());
+
+    return entries;
+}
+
+FetchJournal::FetchJournal(std::string path, std::uint64_t fileSize)
+    : m_path(std::move(path)),
+      m_fileSize(fileSize),
+      m_fd(-1),
+      m_active(1),
+      m_activeSize(0),
+      m_sealedSize(0),
+      m_compactedSize(0),
+      m_replayNext(false),
+      m_busy(false),
+      m_stop(false)
+{
+    auto directory = fs::path(m_path).parent_path();
+    if (directory.empty()) { directory = fs::current_path(); }
+
+    auto const prefix = fs::path(m_path).filename().string() + ".";
+
+    for (auto const& file : fs::directory_iterator(directory))
+    {
+        auto const name = file.path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) != 0) { continue; }
+
+        auto const suffix = name.substr(prefix.size());
+
+        // Left by an interrupted compaction, whose input files are intact
+        if (suffix.size() > 4 && suffix.compare(suffix.size() - 4, 4, ".tmp") == 0)
+        {
+            fs::remove(file.path());
+            continue;
+        }
+
+        if (suffix.empty() || !std::all_of(suffix.begin(), suffix.end(), [](char c) { return c >= '0' && c <= '9'; })) { continue; }
+
+        m_replay.push_back(std::stoull(suffix));
+    }
+
+    std::sort(m_replay.begin(), m_replay.end());
+
+    if (!m_replay.empty()) { m_active = m_replay.back() + 1; }
+
+    OpenActive();
+
+    if (m_fd < 0)
+    {
+        throw DatabaseException("Failed to open the fetch journal " + PathOf(m_active) + ": " + std::strerror(errno));
+    }
+}
+
+FetchJournal::~FetchJournal() noexcept
+{
+    {
+        // Under the lock, so a replay about to wait for Next sees it
+        std::lock_guard lock(m_mutex);
+        m_stop = true;
+    }
+
+    m_replayCv.notify_all();
+    if (m_worker.joinable()) { m_worker.join(); }
+
+    Flush();
+
+    if (m_fd >= 0) { ::close(m_fd); }
+}
+
+void FetchJournal::Add(const Entry& entry)
+{
+    AppendRecord(m_buffer, AddRecord, entry.hash, &entry);
+}
+
+void FetchJournal::Attempt(const lt::info_hash_t& hash)
+{
+    AppendRecord(m_buffer, AttemptRecord, hash);
+}
+
+void FetchJournal::Remove(const lt::info_hash_t& hash)
+{
+    AppendRecord(m_buffer, RemoveRecord, hash);
+}
+
+void FetchJournal::Flush()
+{
+    if (m_buffer.empty()) { return; }
+
+    // Try again if the file could not be opened when the last one was sealed
+    if (m_fd < 0) { OpenActive(); }
+
+    if (m_fd < 0 || !WriteAll(m_fd, m_buffer) || ::fdatasync(m_fd) != 0)
+    {
+        BOOST_LOG_TRIVIAL(warning) << "Failed to write the fetch journal: " << std::strerror(errno);
+
+        // Drop what made it, so the retry does not leave a torn record behind
+        if (m_fd >= 0 && ::ftruncate(m_fd, static_cast<off_t>(m_activeSize)) != 0)
+        {
+            BOOST_LOG_TRIVIAL(warning) << "Failed to truncate the fetch journal: " << std::strerror(errno);
+        }
+
+        return;
+    }
+
+    m_activeSize += m_buffer.size();
+    m_buffer.clear();
+
+    if (m_activeSize >= m_fileSize)
+    {
+        Seal();
+    }
+}
+
+void FetchJournal::Replay(BatchCallback onBatch, std::function<void()> onDone)
+{
+    std::vector<std::uint64_t> files;
+
+    {
+        std::lock_guard lock(m_mutex);
+        files = m_replay;
+        m_replayNext = false;
+    }
+
+    StartWorker(
+        [this, files, onBatch = std::move(onBatch), onDone = std::move(onDone)]
+        {
+            auto const started = std::chrono::steady_clock::now();
+
+            std::vector<std::string> paths;
+            for (auto const file : files) { paths.push_back(PathOf(file)); }
+
+            auto entries = Fold(paths, m_stop);
+
+            for (std::size_t i = 0; i < entries.size() && !m_stop; i += replayBatchSize)
+            {
+                if (i > 0)
+                {
+                    std::unique_lock lock(m_mutex);
+                    m_replayCv.wait(lock, [this] { return m_replayNext || m_stop; });
+                    m_replayNext = false;
+
+                    if (m_stop) { break; }
+                }
+
+                auto const end = std::min(entries.size(), i + replayBatchSize);
+
+                onBatch(std::vector<Entry>(
+                    std::make_move_iterator(entries.begin() + i),
+                    std::make_move_iterator(entries.begin() + end)));
+            }
+
+            if (m_stop) { return; }
+
+            if (!files.empty())
+            {
+                auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - started);
+
+                BOOST_LOG_TRIVIAL(info)
+                    << "Replayed " << entries.size() << " pending info hash(es) from the fetch journal in "
+                    << elapsed.count() << " ms ("
+                    << entries.size() * 1000 / std::max<std::int64_t>(elapsed.count(), 1) << "/s)";
+            }
+
+            onDone();
+        });
+}
+
+void FetchJournal::Next()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_replayNext = true;
+    }
+
+    m_replayCv.notify_one();
+}
+
+void FetchJournal::Replayed()
+{
+    Flush();
+
+    // Keep the old files until the entries added again are on disk
+    if (!m_buffer.empty()) { return; }
+
+    std::vector<std::uint64_t> files;
+
+    {
+        std::lock_guard lock(m_mutex);
+        files.swap(m_replay);
+    }
+
+    for (auto const file : files)
+    {
+        ::unlink(PathOf(file).c_str());
+    }
+}
+
+void FetchJournal::Compact(std::vector<std::uint64_t> files)
+{
+    auto const started = std::chrono::steady_clock::now();
+
+    std::vector<std::string> paths;
+    for (auto const file : files) { paths.push_back(PathOf(file)); }
+
+    auto const entries = Fold(paths, m_stop);
+    if (m_stop) { return; }
+
+    std::string out;
+
+    for (auto const& entry : entries)
+    {
+        AppendRecord(out, AddRecord, entry.hash, &entry);
+    }
+
+    // Written next to the newest of the files and renamed over it, so the
+    // files are replaced in one step. A crash before the older ones are
+    // removed only brings back hashes which were since resolved, and those
+    // are skipped when queued again.
+    auto const target = PathOf(files.back());
+    auto const temp = target + ".tmp";
+
+    int const fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool const written = fd >= 0 && WriteAll(fd, out) && ::fdatasync(fd) == 0;
+
+    if (fd >= 0) { ::close(fd); }
+
+    if (!written || ::rename(temp.c_str(), target.c_str()) != 0)
+    {
+        BOOST_LOG_TRIVIAL(warning) << "Failed to compact the fetch journal: " << std::strerror(errno);
+        ::unlink(temp.c_str());
+        return;
+    }
+
+    files.pop_back();
+
+    for (auto const file : files)
+    {
+        ::unlink(PathOf(file).c_str());
+    }
+
+    {
+        std::lock_guard lock(m_mutex);
+
+        m_sealed.erase(
+            std::remove_if(
+                m_sealed.begin(),
+                m_sealed.end(),
+                [&](auto const file) { return std::find(files.begin(), files.end(), file) != files.end(); }),
+            m_sealed.end());
+
+        // Files sealed while compacting are counted on top
+        std::error_code ec;
+        m_sealedSize = 0;
+        for (auto const file : m_sealed) { m_sealedSize += fs::file_size(PathOf(file), ec); }
+        m_compactedSize = out.size();
+    }
+
+    auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started);
+
+    BOOST_LOG_TRIVIAL(info)
+        << "Compacted the fetch journal to " << entries.size() << " pending info hash(es) in "
+        << elapsed.count() << " ms";
+}
+
+void FetchJournal::OpenActive()
+{
+    m_fd = ::open(PathOf(m_active).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    m_activeSize = 0;
+}
+
+std::string FetchJournal::PathOf(std::uint64_t file) const
+{
+    return m_path + "." + std::to_string(file);
+}
+
+void FetchJournal::Seal()
+{
+    ::close(m_fd);
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_sealed.push_back(m_active);
+        m_sealedSize += m_activeSize;
+    }
+
+    m_active += 1;
+    OpenActive();
+
+    if (m_fd < 0)
+    {
+        BOOST_LOG_TRIVIAL(warning) << "Failed to open " << PathOf(m_active) << ": " << std::strerror(errno);
+    }
+
+    std::vector<std::uint64_t> files;
+
+    {
+        std::lock_guard lock(m_mutex);
+
+        // Merge once the sealed files hold twice what the last merge left, so
+        // a pending hash is only rewritten a few times. Files left by the last
+        // run are not merged until they are replayed.
+        if (m_stop || !m_replay.empty() || m_busy || m_sealedSize < 2 * m_compactedSize)
+        {
+            return;
+        }
+
+        files = m_sealed;
+    }
+
+    StartWorker([this, files] { Compact(files); });
+}
+
+void FetchJournal::StartWorker(std::function<void()> work)
+{
+    // The previous worker is done, but still has to be joined
+    if (m_worker.joinable()) { m_worker.join(); }
+
+    m_busy = true;
+    m_worker = std::thread(
+        [this, work = std::move(work)]
+        {
+            work();
+            m_busy = false;
+        });
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+#include <libtorrent/info_hash.hpp>
+
+namespace hamster
+{
+    // A journal of the info hashes queued for a metadata fetch which have not
+    // been resolved yet, so a restart picks up the sampling work of the last
+    // run instead of throwing it away.
+    //
+    // Records are appended to the newest of a series of numbered files
+    // (<path>.1, <path>.2, ...), and written out on Flush. Once the newest
+    // file is full it is sealed and a new one is started, and a background
+    // thread merges the sealed files into one holding only pending hashes.
+    //
+    // On startup the files left by the last run are read on a background
+    // thread and their pending hashes handed to the indexer, which queues them
+    // again and so journals them anew. The old files are removed once it has.
+    class FetchJournal
+    {
+    public:
+        // Pending hashes which failed this many fetches are given up on
+        static constexpr std::uint16_t MaxAttempts = 3;
+
+        struct Entry
+        {
+            lt::info_hash_t hash;
+            std::chrono::system_clock::time_point firstSeen;
+            std::uint16_t attempts;
+
+            // The node the hash was sampled from, or an unspecified endpoint
+            // if it was queued through the control socket
+            boost::asio::ip::udp::endpoint source;
+        };
+
+        using BatchCallback = std::function<void(std::vector<Entry>)>;
+
+        explicit FetchJournal(
+            std::string path,
+            std::uint64_t fileSize = 64 * 1024 * 1024);
+        ~FetchJournal() noexcept;
+
+        void Add(const Entry& entry);
+
+        // Records a fetch attempt. Hashes are given up on after a few.
+        void Attempt(const lt::info_hash_t& hash);
+
+        // Records that the hash no longer needs fetching
+        void Remove(const lt::info_hash_t& hash);
+
+        // Writes the records added since the last flush to disk and syncs
+        // them. Failures are logged, and the records kept for the next flush.
+        void Flush();
+
+        // The size of the records waiting for the next flush, in bytes
+        std::uint64_t Pending() const { return m_buffer.size(); }
+
+        // Reads the pending hashes left by the last run on a background thread
+        // and calls onBatch with them, in journal order, and then onDone. Both
+        // are called on the background thread. After each batch, the next one
+        // waits for a call to Next, so the caller sets the pace. Call Replayed
+        // once the hashes have been added again.
+        void Replay(BatchCallback onBatch, std::function<void()> onDone);
+
+        // Lets Replay hand over its next batch
+        void Next();
+
+        // Flushes, and removes the files read by Replay.
+        void Replayed();
+
+    private:
+        void Compact(std::vector<std::uint64_t> files);
+        void OpenActive();
+        std::string PathOf(std::uint64_t file) const;
+        void Seal();
+        void StartWorker(std::function<void()> work);
+
+        std::string m_path;
+        std::uint64_t m_fileSize;
+
+        int m_fd;
+        std::uint64_t m_active;
+        std::uint64_t m_activeSize;
+        std::string m_buffer;
+
+        std::mutex m_mutex;
+        std::condition_variable m_replayCv;
+        bool m_replayNext;
+        std::vector<std::uint64_t> m_replay;
+        std::vector<std::uint64_t> m_sealed;
+        std::uint64_t m_sealedSize;
+        std::uint64_t m_compactedSize;
+
+        // Replays and compactions take turns on the worker
+        std::thread m_worker;
+        std::atomic<bool> m_busy;
+        std::atomic<bool> m_stop;
+    };
+}
@@ -0,0 +1,91 @@
+#include "fetchqueue.hpp"
+
+#include <algorithm>
+#include <filesystem>
+
+using hamster::FetchQueue;
+
+bool FetchQueue::Contains(const lt::info_hash_t& hash) const
+{
+    return m_queued.find(hash) != m_queued.end();
+}
+
+bool FetchQueue::Empty(Priority priority) const
+{
+    return Size(priority) == 0;
+}
+
+std::size_t FetchQueue::Size(Priority priority) const
+{
+    return priority == Priority::High
+        ? m_high.size()
+        : m_background.size();
+}
+
+void FetchQueue::Push(const lt::info_hash_t& hash, Priority priority)
+{
+    if (!m_queued.insert(hash).second) { return; }
+    Queue(priority).push_back(hash);
+}
+
+std::optional<lt::info_hash_t> FetchQueue::Pop(Priority priority)
+{
+    auto& queue = Queue(priority);
+    if (queue.empty()) { return std::nullopt; }
+
+    auto const hash = queue.front();
+    queue.pop_front();
+    m_queued.erase(hash);
+
+    return hash;
+}
+
+bool FetchQueue::Promote(const lt::info_hash_t& hash)
+{
+    auto it = std::find(m_background.begin(), m_background.end(), hash);
+    if (it == m_background.end()) { return false; }
+
+    m_background.erase(it);
+    m_high.push_back(hash);
+
+    return true;
+}
+
+void FetchQueue::Trim(
+    Priority priority,
+    std::size_t size,
+    const std::function<void(const lt::info_hash_t&)>& onDropped)
+{
+    auto& queue = Queue(priority);
+
+    while (queue.size() > size)
+    {
+        onDropped(queue.back());
+        m_queued.erase(queue.back());
+        queue.pop_back();
+    }
+
+    // Give the memory of the dropped entries back
+    queue.shrink_to_fit();
+}
+
+std::deque<lt::info_hash_t>& FetchQueue::Queue(Priority priority)
+{
+    return priority == Priority::High
+        ? m_high
+        : m_background;
+}
+
+lt::add_torrent_params hamster::FetchParams(const lt::info_hash_t& hash)
+{
+    lt::add_torrent_params params;
+    params.flags &= ~lt::torrent_flags::auto_managed;
+    params.flags &= ~lt::torrent_flags::need_save_resume;
+    params.flags &= ~lt::torrent_flags::paused;
+    params.flags &= ~lt::torrent_flags::update_subscribe;
+    params.flags |= lt::torrent_flags::upload_mode;
+    params.info_hashes = hash;
+    params.save_path = std::filesystem::temp_directory_path();
+
+    return params;
+}
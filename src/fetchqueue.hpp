@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <unordered_set>
+
+#include <libtorrent/add_torrent_params.hpp>
+#include <libtorrent/info_hash.hpp>
+
+namespace hamster
+{
+    // Info hashes waiting for a metadata fetch slot. Hashes requested by a
+    // user are kept apart from the ones found by sampling so they can be
+    // scheduled ahead of them.
+    class FetchQueue
+    {
+    public:
+        enum class Priority
+        {
+            Background,
+            High
+        };
+
+        bool Contains(const lt::info_hash_t& hash) const;
+        bool Empty(Priority priority) const;
+        std::size_t Size(Priority priority) const;
+
+        void Push(const lt::info_hash_t& hash, Priority priority);
+        std::optional<lt::info_hash_t> Pop(Priority priority);
+
+        // Moves a queued background hash to the back of the high priority
+        // queue. Returns false if the hash was not queued.
+        bool Promote(const lt::info_hash_t& hash);
+
+        // Drops the most recently queued hashes until at most size are left,
+        // calling onDropped with each of them.
+        void Trim(
+            Priority priority,
+            std::size_t size,
+            const std::function<void(const lt::info_hash_t&)>& onDropped);
+
+    private:
+        std::deque<lt::info_hash_t>& Queue(Priority priority);
+
+        std::deque<lt::info_hash_t> m_background;
+        std::deque<lt::info_hash_t> m_high;
+        std::unordered_set<lt::info_hash_t> m_queued;
+    };
+
+    // The parameters a metadata fetch is added to the session with. The
+    // torrent only ever downloads metadata, into the temporary directory.
+    lt::add_torrent_params FetchParams(const lt::info_hash_t& hash);
+}
@@ -0,0 +1,58 @@
+#include "hyperloglog.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+using hamster::HyperLogLog;
+
+HyperLogLog::HyperLogLog(int precision)
+    : m_precision(precision),
+      m_registers(std::size_t(1) << precision, 0)
+{
+}
+
+void HyperLogLog::Add(std::uint64_t hash)
+{
+    // The top bits pick the register, the rest are ranked by their leading
+    // zeros. The sentinel bit caps the rank for an all zero remainder.
+    auto const index = hash >> (64 - m_precision);
+    auto const rest = (hash << m_precision) | (std::uint64_t(1) << (m_precision - 1));
+    auto const rank = static_cast<std::uint8_t>(std::countl_zero(rest) + 1);
+
+    m_registers[index] = std::max(m_registers[index], rank);
+}
+
+double HyperLogLog::Estimate() const
+{
+    double const m = static_cast<double>(m_registers.size());
+    double const alpha = 0.7213 / (1 + 1.079 / m);
+
+    double sum = 0;
+    std::size_t zeros = 0;
+
+    for (auto const r : m_registers)
+    {
+        sum += std::ldexp(1.0, -r);
+        if (r == 0) { zeros += 1; }
+    }
+
+    double const estimate = alpha * m * m / sum;
+
+    // Small sets are counted more accurately by the registers left empty.
+    // With 64 bit hashes there is no need for a large range correction.
+    if (estimate <= 2.5 * m && zeros > 0)
+    {
+        return m * std::log(m / static_cast<double>(zeros));
+    }
+
+    return estimate;
+}
+
+void HyperLogLog::Merge(const HyperLogLog& other)
+{
+    for (std::size_t i = 0; i < m_registers.size() && i < other.m_registers.size(); i++)
+    {
+        m_registers[i] = std::max(m_registers[i], other.m_registers[i]);
+    }
+}
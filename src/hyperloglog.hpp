@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace hamster
+{
+    // A HyperLogLog sketch, estimating the number of distinct 64 bit hashes
+    // added to it in 2^precision bytes, with a standard error of about
+    // 1.04 / sqrt(2^precision). Sketches of the same precision merge into
+    // the sketch of the union of their sets.
+    class HyperLogLog
+    {
+    public:
+        explicit HyperLogLog(int precision);
+
+        // The hash must be uniformly distributed. Info hashes and node ids
+        // are already.
+        void Add(std::uint64_t hash);
+
+        double Estimate() const;
+        void Merge(const HyperLogLog& other);
+
+        int Precision() const { return m_precision; }
+
+        // The raw registers, for persisting the sketch
+        std::vector<std::uint8_t>& Registers() { return m_registers; }
+        const std::vector<std::uint8_t>& Registers() const { return m_registers; }
+
+    private:
+        int m_precision;
+        std::vector<std::uint8_t> m_registers;
+    };
+}
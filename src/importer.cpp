@@ -0,0 +1,304 @@
+#include "importer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <semaphore>
+#include <thread>
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/log/trivial.hpp>
+#include <libtorrent/torrent_info.hpp>
+
+#include "database.hpp"
+#include "models/infohash.hpp"
+#include "storage.hpp"
+
+namespace fs = std::filesystem;
+using hamster::Importer;
+
+static const std::size_t batchSize = 1000;
+static const std::ptrdiff_t maxPending = 4 * batchSize;
+static const std::size_t hashBatchSize = 500;
+static const std::chrono::seconds progressInterval = std::chrono::seconds(10);
+
+namespace
+{
+    class ParsedQueue
+    {
+    public:
+        void Close()
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_closed = true;
+            }
+
+            m_cv.notify_all();
+        }
+
+        void Push(std::shared_ptr<lt::torrent_info> ti)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_items.push_back(std::move(ti));
+            }
+
+            m_cv.notify_one();
+        }
+
+        // Blocks until there is at least one item, then takes up to max
+        // items. Returns false once the queue is closed and drained.
+        bool PopBatch(std::vector<std::shared_ptr<lt::torrent_info>>& batch, std::size_t max)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_closed || !m_items.empty(); });
+
+            while (!m_items.empty() && batch.size() < max)
+            {
+                batch.push_back(std::move(m_items.front()));
+                m_items.pop_front();
+            }
+
+            return !batch.empty();
+        }
+
+    private:
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::deque<std::shared_ptr<lt::torrent_info>> m_items;
+        bool m_closed = false;
+    };
+}
+
+static bool IsTorrentFile(const fs::path& path)
+{
+    return path.extension() == ".torrent";
+}
+
+Importer::Importer(Storage& storage, unsigned threads)
+    : m_storage(storage),
+      m_threads(std::max(threads, 1u))
+{
+}
+
+Importer::Stats Importer::Run(const std::vector<std::string>& paths, const HashesCallback& onHashes)
+{
+    Stats stats;
+
+    ParsedQueue parsed;
+    std::atomic<std::size_t> failed = 0;
+
+    // Set when the writer fails, so the walker stops posting files
+    std::atomic<bool> stopped = false;
+    std::exception_ptr walkerError;
+
+    // Bounds the torrents being parsed or waiting to be written. The walker
+    // takes a slot before posting a file and the writer returns it.
+    std::counting_semaphore<> pending(maxPending);
+
+    std::vector<lt::info_hash_t> hashes;
+
+    auto const flushHashes = [&]
+    {
+        if (hashes.empty()) { return; }
+
+        onHashes(hashes);
+        stats.hashes += hashes.size();
+        hashes.clear();
+    };
+
+    auto const readHashList = [&](const fs::path& path)
+    {
+        std::ifstream stream(path);
+        std::string line;
+
+        while (std::getline(stream, line))
+        {
+            if (line.empty() || line[0] == '#') { continue; }
+
+            if (auto const ih = Models::ParseInfoHash(line))
+            {
+                hashes.push_back(*ih);
+                if (hashes.size() >= hashBatchSize) { flushHashes(); }
+            }
+            else
+            {
+                failed += 1;
+            }
+        }
+    };
+
+    boost::asio::thread_pool pool(m_threads);
+
+    std::thread walker(
+        [&]
+        {
+            auto const parse = [&](const fs::path& path)
+            {
+                pending.acquire();
+
+                if (stopped)
+                {
+                    pending.release();
+                    return;
+                }
+
+                boost::asio::post(
+                    pool,
+                    [&, path]
+                    {
+                        lt::error_code ec;
+                        auto ti = std::make_shared<lt::torrent_info>(path.string(), ec);
+
+                        if (ec)
+                        {
+                            BOOST_LOG_TRIVIAL(warning) << "Failed to parse " << path << ": " << ec.message();
+                            failed += 1;
+                            pending.release();
+                            return;
+                        }
+
+                        parsed.Push(std::move(ti));
+                    });
+            };
+
+            try
+            {
+                for (auto const& p : paths)
+                {
+                    if (stopped) { break; }
+
+                    std::error_code ec;
+                    fs::path const path(p);
+
+                    if (fs::is_directory(path, ec))
+                    {
+                        for (auto it = fs::recursive_directory_iterator(path, ec); !ec && !stopped && it != fs::recursive_directory_iterator(); it.increment(ec))
+                        {
+                            if (it->is_regular_file(ec) && IsTorrentFile(it->path())) { parse(it->path()); }
+                        }
+                    }
+                    else if (IsTorrentFile(path))
+                    {
+                        parse(path);
+                    }
+                    else
+                    {
+                        readHashList(path);
+                    }
+
+                    if (ec)
+                    {
+                        BOOST_LOG_TRIVIAL(warning) << "Failed to read " << path << ": " << ec.message();
+                    }
+                }
+            }
+            catch (...)
+            {
+                walkerError = std::current_exception();
+            }
+
+            // The parse tasks refer to this frame, so they are waited for
+            // either way
+            pool.join();
+            parsed.Close();
+        });
+
+    auto const started = std::chrono::steady_clock::now();
+    auto lastProgress = started;
+
+    std::vector<std::shared_ptr<lt::torrent_info>> batch;
+
+    try
+    {
+        while (parsed.PopBatch(batch, batchSize))
+        {
+            std::size_t imported = 0;
+            std::size_t rejected = 0;
+
+            try
+            {
+                m_storage.Begin();
+
+                // A torrent which fails to insert is rolled back on its own, so
+                // it does not take the rest of the batch with it
+                for (auto const& ti : batch)
+                {
+                    try
+                    {
+                        if (m_storage.InsertTorrent(*ti)) { imported += 1; }
+                    }
+                    catch (const DatabaseException& ex)
+                    {
+                        BOOST_LOG_TRIVIAL(error) << "Failed to import " << ti->name() << ": " << ex.what();
+                        rejected += 1;
+                    }
+                }
+
+                m_storage.Commit();
+
+                stats.imported += imported;
+                stats.duplicates += batch.size() - imported - rejected;
+                failed += rejected;
+            }
+            catch (const DatabaseException& ex)
+            {
+                BOOST_LOG_TRIVIAL(error) << "Failed to commit import batch: " << ex.what();
+                failed += batch.size();
+            }
+
+            pending.release(static_cast<std::ptrdiff_t>(batch.size()));
+            batch.clear();
+
+            auto const now = std::chrono::steady_clock::now();
+
+            if (now - lastProgress >= progressInterval)
+            {
+                auto const seconds = std::chrono::duration<double>(now - started).count();
+
+                BOOST_LOG_TRIVIAL(info)
+                    << "Imported " << stats.imported << " torrent(s) "
+                    << "(" << static_cast<std::size_t>(stats.imported / seconds) << "/s)";
+
+                lastProgress = now;
+            }
+        }
+    }
+    catch (...)
+    {
+        // The walker refers to this frame. Stop it, unblock it if it waits
+        // for a slot, and let it finish before unwinding.
+        stopped = true;
+        pending.release(maxPending);
+        walker.join();
+        throw;
+    }
+
+    walker.join();
+
+    if (walkerError) { std::rethrow_exception(walkerError); }
+
+    flushHashes();
+
+    stats.failed = failed;
+
+    auto const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    BOOST_LOG_TRIVIAL(info)
+        << "Imported " << stats.imported << " torrent(s) in " << static_cast<std::size_t>(seconds) << " s "
+        << "(" << static_cast<std::size_t>(stats.imported / std::max(seconds, 0.001)) << "/s), "
+        << stats.duplicates << " duplicate(s), " << stats.failed << " failure(s), "
+        << stats.hashes << " info hash(es) queued for fetching";
+
+    return stats;
+}
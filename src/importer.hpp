@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <libtorrent/info_hash.hpp>
+
+namespace hamster
+{
+    class Storage;
+
+    // Imports .torrent files into the index. Files are parsed on a thread
+    // pool and written in batched transactions from the calling thread, with
+    // the number of parsed torrents waiting to be written bounded so memory
+    // stays flat regardless of the number of files.
+    class Importer
+    {
+    public:
+        using HashesCallback = std::function<void(const std::vector<lt::info_hash_t>&)>;
+
+        struct Stats
+        {
+            std::size_t imported = 0;
+            std::size_t duplicates = 0;
+            std::size_t failed = 0;
+            std::size_t hashes = 0;
+        };
+
+        Importer(Storage& storage, unsigned threads);
+
+        // Imports every .torrent file in the given paths, recursing into
+        // directories. Other files are read as lists of info hashes or magnet
+        // links, one per line, which are passed to onHashes in batches since
+        // their metadata has to be fetched.
+        Stats Run(const std::vector<std::string>& paths, const HashesCallback& onHashes);
+
+    private:
+        Storage& m_storage;
+        unsigned m_threads;
+    };
+}
@@ -1,63 +1,947 @@
 #include "indexer.hpp"
 
-#include <filesystem>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <random>
+#include <thread>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include <boost/asio.hpp>
 #include <boost/log/trivial.hpp>
 #include <libtorrent/alert_types.hpp>
 #include <libtorrent/session.hpp>
-#include <sqlite3.h>
 
+#include "database.hpp"
+#include "logging.hpp"
 #include "models/torrent.hpp"
+#include "options.hpp"
+#include "seenset.hpp"
+#include "storage.hpp"
+#include "tracing.hpp"
 
-namespace fs = std::filesystem;
 namespace lt = libtorrent;
 using hamster::LibtorrentIndexer;
 using namespace std::literals::chrono_literals;
 
-struct LibtorrentIndexer::NodeInfo
+// Rough memory costs per entry, container overhead included. A fetch is
+// dominated by libtorrent's torrent object, its peer list and DHT traffic.
+static const std::uint64_t activeFetchCost = 64 * 1024;
+static const std::uint64_t nodeCost = 96;
+static const std::uint64_t seenHashCost = sizeof(lt::info_hash_t) + 2 * sizeof(void*);
+static const std::uint64_t queuedHashCost = 2 * sizeof(lt::info_hash_t) + 2 * sizeof(void*);
+static const std::uint64_t fetchSourceCost = sizeof(lt::info_hash_t) + sizeof(boost::asio::ip::address) + 2 * sizeof(void*);
+// An average over the alert types, most of which are small. Sample and
+// metadata alerts carry buffers of their own.
+static const std::uint64_t alertCost = 512;
+
+// The journal replay holds off while this many background fetches are queued
+static const std::size_t replayQueueLimit = 10000;
+
+static const int sampleIntervalSeconds = 5;
+static const int persistIntervalSeconds = 5;
+static const lt::clock_type::duration censusSaveInterval = std::chrono::minutes(5);
+
+// How often Drain checks whether the session has shut down
+static const std::chrono::milliseconds sessionPollInterval = 50ms;
+
+// A secret of this process, drawn at startup
+static std::uint64_t RandomKey()
+{
+    std::random_device dev;
+    return (static_cast<std::uint64_t>(dev()) << 32) | dev();
+}
+
+// Hashes the info hash with the key, through the splitmix64 finalizer
+static std::uint64_t KeyedHash(std::uint64_t key, const lt::sha1_hash& hash)
+{
+    std::uint64_t h = key;
+
+    for (std::size_t i = 0; i < lt::sha1_hash::size(); i += sizeof(std::uint32_t))
+    {
+        std::uint32_t word;
+        std::memcpy(&word, hash.data() + i, sizeof(word));
+
+        h ^= word;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+        h ^= h >> 31;
+    }
+
+    return h;
+}
+
+// Minutes of duplicate and wasted fetch counts kept for the stats
+static const std::size_t fetchHistoryMinutes = 60;
+
+// Sources make up for their past over a few of these
+static const lt::clock_type::duration reputationHalfLife = std::chrono::hours(1);
+
+struct LibtorrentIndexer::ActiveFetch
+{
+    lt::time_point added;
+    bool priority;
+    lt::torrent_handle handle;
+
+    // Counting this one
+    std::uint16_t attempts;
+};
+
+struct LibtorrentIndexer::Waiter
 {
-    lt::time_point nextRequest;
+    explicit Waiter(boost::asio::io_context& io)
+        : timer(io)
+    {
+    }
+
+    lt::time_point started;
+    boost::asio::steady_timer timer;
+    ResolveCallback callback;
 };
 
-LibtorrentIndexer::LibtorrentIndexer(boost::asio::io_context &io, sqlite3* db)
+LibtorrentIndexer::LibtorrentIndexer(
+    boost::asio::io_context &io,
+    Storage& storage,
+    const std::shared_ptr<Options>& opts,
+    SharedSeenSet* seen,
+    FetchJournal* journal)
     : m_io(io),
-      m_timer(io),
-      m_db(db)
+      m_sampleTimer(io),
+      m_persistTimer(io),
+      m_alertTimer(io),
+      m_alertsPending(false),
+      m_poppedAlerts(0),
+      m_drainTimer(io),
+      m_loops(0),
+      m_stopping(false),
+      m_alertsDrained(false),
+      m_drainTimedOut(false),
+      m_drainAlerts(0),
+      m_storage(storage),
+      m_seen(seen),
+      m_journal(journal),
+      m_replayWaiting(false),
+      m_families{{ { "IPv4", {}, 0, 0, 0, 0, 0, 0 }, { "IPv6", {}, 0, 0, 0, 0, 0, 0 } }},
+      m_censusFile(opts->CensusFile()),
+      m_lastCensusSave(lt::clock_type::now()),
+      m_dhtQueryRate(opts->DhtQueryRate()),
+      m_maxActiveFetches(opts->MaxActiveFetches()),
+      m_maxPriorityFetches(64),
+      m_priorityActive(0),
+      m_fetchTimeout(opts->FetchTimeout()),
+      m_budget(opts->MemoryBudget()),
+      m_quietAlerts(false),
+      m_ticks(0),
+      m_duplicates{ 0, 0 },
+      m_enforceReputation(opts->ReputationMode() != "observe"),
+      m_admitKey(RandomKey()),
+      m_lastReputationDecay(lt::clock_type::now()),
+      m_wasted{ 0, lt::time_duration(0), 0, 0 },
+      m_writes(0),
+      m_writeTime(0),
+      m_maxWriteTime(0),
+      m_lastStats(lt::clock_type::now())
 {
     lt::session_params params;
     params.settings.set_int(lt::settings_pack::alert_mask, lt::alert::all_categories);
-    params.settings.set_str(
-        lt::settings_pack::dht_bootstrap_nodes,
-        "router.bittorrent.com:6881,"
-        "dht.transmissionbt.com:6881,"
-        "dht.libtorrent.org:25401");
+    params.settings.set_str(lt::settings_pack::dht_bootstrap_nodes, opts->DhtBootstrapNodes());
+
+    // libtorrent runs a DHT node on every listen socket, so listening on an
+    // IPv6 address joins the IPv6 DHT as well.
+    params.settings.set_str(lt::settings_pack::listen_interfaces, opts->ListenInterfaces());
+
+    // A local swarm runs all its nodes on one address, which the DHT would
+    // otherwise keep a single one of
+    if (opts->DhtLocalSwarm())
+    {
+        params.settings.set_bool(lt::settings_pack::dht_restrict_routing_ips, false);
+        params.settings.set_bool(lt::settings_pack::dht_restrict_search_ips, false);
+    }
 
     m_session = std::make_unique<lt::session>(params);
     m_session->set_alert_notify(
-        [&]
+        [this]
         {
-            boost::asio::post(m_io, [&] { PopAlerts(); });
+            boost::asio::post(
+                m_io,
+                [this]
+                {
+                    m_alertsPending = true;
+                    m_alertTimer.cancel();
+                });
         });
 
-    boost::system::error_code ec;
-    m_timer.expires_from_now(boost::posix_time::seconds(5), ec);
-    m_timer.async_wait([this](auto && PH1) { SampleInfohashes(std::forward<decltype(PH1)>(PH1)); });
+    if (!m_censusFile.empty() && m_census.Load(m_censusFile))
+    {
+        BOOST_LOG_TRIVIAL(info) << "Loaded the DHT census from " << m_censusFile;
+    }
+
+    // The journal is read in the background while sampling starts over
+    if (m_journal != nullptr)
+    {
+        m_journal->Replay(
+            [this](std::vector<FetchJournal::Entry> entries)
+            {
+                boost::asio::post(m_io, [this, entries = std::move(entries)] { Requeue(entries); });
+            },
+            [this]
+            {
+                boost::asio::post(m_io, [this] { m_journal->Replayed(); });
+            });
+    }
+
+    for (auto const loop : { &LibtorrentIndexer::AlertLoop, &LibtorrentIndexer::PersistLoop, &LibtorrentIndexer::SampleLoop })
+    {
+        m_loops += 1;
+
+        boost::asio::co_spawn(
+            m_io,
+            (this->*loop)(),
+            [this](std::exception_ptr ex)
+            {
+                // Out of io_context::run, as if the loop were a handler
+                if (ex) { std::rethrow_exception(ex); }
+                if (--m_loops == 0) { m_drainTimer.cancel(); }
+            });
+    }
 }
 
 LibtorrentIndexer::~LibtorrentIndexer() noexcept
 {
+    // Gone once drained
+    if (m_session) { m_session->set_alert_notify([] {}); }
+    m_sampleTimer.cancel();
+    m_persistTimer.cancel();
+    m_alertTimer.cancel();
+    m_drainTimer.cancel();
+
+    for (auto const& [_, waiters] : m_waiters)
+    {
+        for (auto const& waiter : waiters)
+        {
+            waiter->timer.cancel();
+        }
+    }
+
+    // Past the drain deadline the thread is left running, and main exits
+    // without waiting for it
+    if (m_sessionShutdown.joinable())
+    {
+        if (m_sessionReleased->load()) { m_sessionShutdown.join(); }
+        else { m_sessionShutdown.detach(); }
+    }
+
+    // Hand our unfinished fetches over to the other processes
+    if (m_seen != nullptr)
+    {
+        for (auto const& ih : m_hashes)
+        {
+            m_seen->Release(ih);
+        }
+    }
+}
+
+boost::asio::awaitable<void> LibtorrentIndexer::Drain(std::chrono::seconds timeout)
+{
+    auto const started = std::chrono::steady_clock::now();
+
+    m_stopping = true;
+    m_sampleTimer.cancel();
+    m_persistTimer.cancel();
+
+    // libtorrent raises alerts in order, so once the stats alert requested
+    // here comes around, everything raised before it has been handled
+    m_session->post_session_stats();
+
+    if (m_loops > 0)
+    {
+        boost::system::error_code ec;
+        m_drainTimer.expires_after(timeout);
+        co_await m_drainTimer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+        if (!ec)
+        {
+            BOOST_LOG_TRIVIAL(warning) << "Gave up on the remaining alerts after " << timeout.count() << " s";
+
+            m_drainTimedOut = true;
+            m_alertTimer.cancel();
+        }
+    }
+
+    try
+    {
+        if (m_journal != nullptr)
+        {
+            m_journal->Flush();
+        }
+
+        m_storage.Checkpoint();
+    }
+    catch (const std::exception& ex)
+    {
+        BOOST_LOG_TRIVIAL(error) << "Failed to write out the index: " << ex.what();
+    }
+
+    if (!m_censusFile.empty())
+    {
+        m_census.Save(m_censusFile);
+    }
+
+    // Shutting the session down says goodbye to the DHT and the trackers,
+    // which has no bound of its own. The session_proxy blocks until it is
+    // done, so it is released on a thread of its own and waited for until
+    // the deadline. The alert notification refers to this and m_io, which
+    // may be gone before libtorrent is.
     m_session->set_alert_notify([] {});
-    m_timer.cancel();
+
+    auto proxy = m_session->abort();
+    m_session.reset();
+
+    auto const released = std::make_shared<std::atomic<bool>>(false);
+    m_sessionReleased = released;
+
+    m_sessionShutdown = std::thread(
+        [proxy = std::move(proxy), released]() mutable
+        {
+            proxy = lt::session_proxy();
+            released->store(true);
+        });
+
+    while (!released->load() && std::chrono::steady_clock::now() < started + timeout)
+    {
+        boost::system::error_code ec;
+        m_drainTimer.expires_after(sessionPollInterval);
+        co_await m_drainTimer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    }
+
+    if (!released->load())
+    {
+        BOOST_LOG_TRIVIAL(warning) << "Gave up on the libtorrent session shutting down after " << timeout.count() << " s";
+    }
+
+    auto const queued = m_queue.Size(FetchQueue::Priority::Background) + m_queue.Size(FetchQueue::Priority::High);
+
+    BOOST_LOG_TRIVIAL(info)
+        << "Drained in "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count()
+        << " ms: handled " << m_drainAlerts << " alert(s), left "
+        << m_active.size() << " active and " << queued << " queued fetch(es) for the next run";
+}
+
+bool LibtorrentIndexer::SessionShuttingDown() const
+{
+    return m_sessionReleased != nullptr && !m_sessionReleased->load();
+}
+
+std::size_t LibtorrentIndexer::Enqueue(const std::vector<lt::info_hash_t>& hashes)
+{
+    std::size_t queued = 0;
+
+    for (auto const& ih : hashes)
+    {
+        if (m_hashes.find(ih) != m_hashes.end())
+        {
+            continue;
+        }
+
+        if (auto const match = m_storage.Exists(ih); match != Models::Torrent::Match::None)
+        {
+            if (match == Models::Torrent::Match::Alias) { m_duplicates.avoided += 1; }
+            continue;
+        }
+
+        m_queue.Push(ih, FetchQueue::Priority::Background);
+        m_hashes.insert(ih);
+        queued += 1;
+
+        if (m_journal != nullptr)
+        {
+            m_journal->Add({ ih, std::chrono::system_clock::now(), 0, {} });
+        }
+    }
+
+    PumpFetchQueue();
+
+    return queued;
+}
+
+void LibtorrentIndexer::Resolve(
+    const lt::info_hash_t& hash,
+    std::chrono::seconds timeout,
+    ResolveCallback callback)
+{
+    if (auto const torrent = m_storage.GetTorrent(hash))
+    {
+        callback(torrent);
+        return;
+    }
+
+    // The session is shut down by Drain
+    if (m_stopping)
+    {
+        callback(std::nullopt);
+        return;
+    }
+
+    auto waiter = std::make_shared<Waiter>(m_io);
+    waiter->started = lt::clock_type::now();
+    waiter->callback = std::move(callback);
+    waiter->timer.expires_after(timeout);
+    waiter->timer.async_wait(
+        [this, hash, waiter](boost::system::error_code ec)
+        {
+            // Cancelled when the waiter is completed
+            if (ec) { return; }
+
+            auto it = m_waiters.find(hash);
+
+            if (it != m_waiters.end())
+            {
+                auto& waiters = it->second;
+                waiters.erase(std::remove(waiters.begin(), waiters.end(), waiter), waiters.end());
+                if (waiters.empty()) { m_waiters.erase(it); }
+            }
+
+            waiter->callback(std::nullopt);
+        });
+
+    m_waiters[hash].push_back(waiter);
+
+    // Start looking for peers right away instead of waiting for the torrent
+    // to announce once it gets a fetch slot.
+    m_session->dht_get_peers(hash.get_best());
+
+    if (FindActive(hash) != m_active.end())
+    {
+        return;
+    }
+
+    if (!m_queue.Promote(hash))
+    {
+        m_queue.Push(hash, FetchQueue::Priority::High);
+    }
+
+    m_hashes.insert(hash);
+
+    if (m_seen != nullptr)
+    {
+        m_seen->Claim(hash);
+    }
+
+    PumpFetchQueue();
+}
+
+hamster::DhtCensus::Estimates LibtorrentIndexer::Census() const
+{
+    return m_census.Estimate();
+}
+
+std::array<LibtorrentIndexer::FamilyTotals, 2> LibtorrentIndexer::Families() const
+{
+    std::array<FamilyTotals, 2> totals;
+
+    for (std::size_t i = 0; i < m_families.size(); i++)
+    {
+        totals[i] = { m_families[i].nodes.Size(), m_families[i].totalResponses, m_families[i].totalSamples };
+    }
+
+    return totals;
+}
+
+std::vector<hamster::Models::TorrentSignature::Match> LibtorrentIndexer::Similar(
+    const lt::info_hash_t& hash,
+    std::size_t limit)
+{
+    return m_storage.FindSimilar(hash, limit);
+}
+
+boost::asio::awaitable<void> LibtorrentIndexer::AlertLoop()
+{
+    boost::system::error_code ec;
+
+    while (!m_alertsDrained)
+    {
+        if (!m_alertsPending)
+        {
+            m_alertTimer.expires_at(boost::asio::steady_timer::time_point::max());
+            co_await m_alertTimer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+            if (m_drainTimedOut) { co_return; }
+            continue;
+        }
+
+        m_alertsPending = false;
+        PopAlerts();
+    }
+}
+
+boost::asio::awaitable<void> LibtorrentIndexer::PersistLoop()
+{
+    boost::system::error_code ec;
+
+    while (!m_stopping)
+    {
+        m_persistTimer.expires_after(std::chrono::seconds(persistIntervalSeconds));
+        co_await m_persistTimer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+        // Drain writes out the journal one last time
+        if (m_stopping) { break; }
+
+        HAMSTER_TRACE_SPAN("Persist");
+
+        if (m_journal != nullptr)
+        {
+            m_journal->Flush();
+        }
+
+        auto const now = lt::clock_type::now();
+
+        if (!m_censusFile.empty() && now - m_lastCensusSave >= censusSaveInterval)
+        {
+            m_census.Save(m_censusFile);
+            m_lastCensusSave = now;
+        }
+    }
+}
+
+boost::asio::awaitable<void> LibtorrentIndexer::SampleLoop()
+{
+    boost::system::error_code ec;
+
+    while (!m_stopping)
+    {
+        m_sampleTimer.expires_after(std::chrono::seconds(sampleIntervalSeconds));
+        co_await m_sampleTimer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+        if (m_stopping) { break; }
+
+        SampleInfohashes();
+    }
+}
+
+bool LibtorrentIndexer::AdmitSample(const lt::info_hash_t& hash, double weight)
+{
+    if (weight >= 1) { return true; }
+
+    // Keeps the given share of a source's hashes. The source picks the
+    // hashes, so they are keyed with a secret of ours before choosing.
+    auto const bits = KeyedHash(m_admitKey, hash.get_best()) >> 32;
+
+    if (bits < weight * 4294967296.0) { return true; }
+
+    (weight > 0 ? m_wasted.downWeighted : m_wasted.blocked) += 1;
+
+    return !m_enforceReputation;
+}
+
+std::size_t LibtorrentIndexer::BackgroundFetchLimit() const
+{
+    // Priority fetches are requested by users and are never held back
+    switch (m_budget.Current())
+    {
+        case MemoryBudget::Pressure::Normal:
+            return m_maxActiveFetches;
+        case MemoryBudget::Pressure::Elevated:
+            return m_maxActiveFetches / 2;
+        default:
+            return 0;
+    }
+}
+
+LibtorrentIndexer::DhtFamily& LibtorrentIndexer::FamilyOf(const boost::asio::ip::udp::endpoint& endpoint)
+{
+    return m_families[NodeSchedule::FamilyOf(endpoint)];
+}
+
+std::unordered_map<lt::info_hash_t, LibtorrentIndexer::ActiveFetch>::iterator LibtorrentIndexer::FindActive(
+    const lt::info_hash_t& hash)
+{
+    // Fetches are keyed by the hash they were started with, which for hybrid
+    // torrents is only one of the hashes known once the metadata arrives.
+    auto it = m_active.find(hash);
+
+    if (it == m_active.end() && hash.has_v1()) { it = m_active.find(lt::info_hash_t(hash.v1)); }
+    if (it == m_active.end() && hash.has_v2()) { it = m_active.find(lt::info_hash_t(hash.v2)); }
+
+    return it;
+}
+
+void LibtorrentIndexer::CompleteWaiters(
+    const lt::info_hash_t& hash,
+    const std::optional<Models::Torrent>& torrent)
+{
+    auto const now = lt::clock_type::now();
+
+    for (auto const& key : { hash, lt::info_hash_t(hash.v1), lt::info_hash_t(hash.v2) })
+    {
+        auto it = m_waiters.find(key);
+        if (it == m_waiters.end()) { continue; }
+
+        auto waiters = std::move(it->second);
+        m_waiters.erase(it);
+
+        for (auto const& waiter : waiters)
+        {
+            waiter->timer.cancel();
+
+            if (torrent)
+            {
+                m_resolveLatencies.push_back(now - waiter->started);
+                if (m_resolveLatencies.size() > 1024) { m_resolveLatencies.pop_front(); }
+            }
+
+            waiter->callback(torrent);
+        }
+    }
+}
+
+void LibtorrentIndexer::ContinueReplay()
+{
+    // Paced by the fetch queue, so a large journal does not end up in memory
+    // all at once
+    if (!m_replayWaiting
+        || m_stopping
+        || m_budget.Current() >= MemoryBudget::Pressure::High
+        || m_queue.Size(FetchQueue::Priority::Background) >= replayQueueLimit)
+    {
+        return;
+    }
+
+    m_replayWaiting = false;
+    m_journal->Next();
+}
+
+void LibtorrentIndexer::EndFetch(std::unordered_map<lt::info_hash_t, ActiveFetch>::iterator it)
+{
+    if (it == m_active.end()) { return; }
+    if (it->second.priority) { m_priorityActive -= 1; }
+
+    m_fetchSources.erase(it->first);
+    m_active.erase(it);
+}
+
+void LibtorrentIndexer::ExpireFetches(lt::time_point now)
+{
+    int expired = 0;
+
+    for (auto it = m_active.begin(); it != m_active.end();)
+    {
+        auto const& fetch = it->second;
+
+        // Torrents still being added have no handle yet - they will be
+        // expired on a later tick.
+        if (!fetch.handle.is_valid() || now - fetch.added < m_fetchTimeout)
+        {
+            it++;
+            continue;
+        }
+
+        auto const& hash = it->first;
+
+        m_session->remove_torrent(fetch.handle, lt::session::delete_files);
+
+        if (fetch.priority) { m_priorityActive -= 1; }
+
+        m_wasted.expired += 1;
+        m_wasted.slotTime += now - fetch.added;
+
+        // Background fetches are queued again until the journal would give
+        // up on them, unless another process has taken the hash over. The
+        // claim is renewed for the next attempt.
+        bool retry = !fetch.priority && fetch.attempts < FetchJournal::MaxAttempts;
+
+        if (m_seen != nullptr)
+        {
+            m_seen->Release(hash);
+
+            if (retry)
+            {
+                auto const claim = m_seen->Claim(hash);
+                retry = claim == SharedSeenSet::ClaimResult::Claimed || claim == SharedSeenSet::ClaimResult::Full;
+            }
+        }
+
+        if (retry)
+        {
+            m_queue.Push(hash, FetchQueue::Priority::Background);
+            m_fetchAttempts[hash] = fetch.attempts;
+        }
+        else
+        {
+            if (auto const source = m_fetchSources.find(hash); source != m_fetchSources.end())
+            {
+                m_reputation.Failed(source->second);
+                m_fetchSources.erase(source);
+            }
+
+            if (m_journal != nullptr)
+            {
+                m_journal->Remove(hash);
+            }
+
+            // Forget the hash so it is fetched again if it is sampled again
+            m_hashes.erase(hash);
+        }
+
+        it = m_active.erase(it);
+        expired += 1;
+    }
+
+    if (expired > 0)
+    {
+        BOOST_LOG_TRIVIAL(debug) << "Expired " << expired << " fetch(es) without metadata";
+    }
+}
+
+void LibtorrentIndexer::LogStats()
+{
+    BOOST_LOG_TRIVIAL(info)
+        << "Fetches: " << m_active.size() << " active (" << m_priorityActive << " priority), "
+        << m_queue.Size(FetchQueue::Priority::Background) << " queued, "
+        << m_queue.Size(FetchQueue::Priority::High) << " priority queued";
+
+    if (m_writes > 0)
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::microseconds;
+
+        BOOST_LOG_TRIVIAL(info)
+            << "Writes: " << m_writes << " torrent(s), "
+            << "avg " << duration_cast<microseconds>(m_writeTime).count() / m_writes << " us, "
+            << "max " << duration_cast<microseconds>(m_maxWriteTime).count() << " us";
+
+        m_writes = 0;
+        m_writeTime = lt::time_duration(0);
+        m_maxWriteTime = lt::time_duration(0);
+    }
+
+    for (auto& family : m_families)
+    {
+        BOOST_LOG_TRIVIAL(info)
+            << family.name << " DHT: " << family.nodes.Size() << " node(s), "
+            << family.queries << " quer(ies), " << family.responses << " response(s), "
+            << family.samples << " sample(s), " << family.added << " new info hash(es) "
+            << "(" << (family.samples > 0 ? 100 * family.added / family.samples : 0) << "% yield)";
+
+        family.queries = 0;
+        family.responses = 0;
+        family.samples = 0;
+        family.added = 0;
+    }
+
+    m_duplicateHistory.push_back(m_duplicates);
+    m_duplicates = { 0, 0 };
+
+    if (m_duplicateHistory.size() > fetchHistoryMinutes)
+    {
+        m_duplicateHistory.pop_front();
+    }
+
+    DuplicateFetches hour{ 0, 0 };
+
+    for (auto const& minute : m_duplicateHistory)
+    {
+        hour.avoided += minute.avoided;
+        hour.redundant += minute.redundant;
+    }
+
+    BOOST_LOG_TRIVIAL(info)
+        << "Duplicates in the last " << m_duplicateHistory.size() << " minute(s): "
+        << hour.avoided << " fetch(es) avoided by alias, "
+        << hour.redundant << " redundant fetch(es) of indexed torrents";
+
+    m_wastedHistory.push_back(m_wasted);
+    m_wasted = { 0, lt::time_duration(0), 0, 0 };
+
+    if (m_wastedHistory.size() > fetchHistoryMinutes)
+    {
+        m_wastedHistory.pop_front();
+    }
+
+    WastedFetches wasted{ 0, lt::time_duration(0), 0, 0 };
+
+    for (auto const& minute : m_wastedHistory)
+    {
+        wasted.expired += minute.expired;
+        wasted.slotTime += minute.slotTime;
+        wasted.downWeighted += minute.downWeighted;
+        wasted.blocked += minute.blocked;
+    }
+
+    BOOST_LOG_TRIVIAL(info)
+        << "Wasted fetches in the last " << m_wastedHistory.size() << " minute(s): "
+        << wasted.expired << " expired without metadata after "
+        << std::chrono::duration_cast<std::chrono::minutes>(wasted.slotTime).count() << " slot-minute(s), "
+        << (m_enforceReputation ? "skipped " : "would have skipped ")
+        << wasted.downWeighted << " sample(s) from down-weighted and "
+        << wasted.blocked << " from blocklisted sources";
+
+    auto const reputation = m_reputation.Summarize();
+
+    BOOST_LOG_TRIVIAL(info)
+        << "Node reputation: " << reputation.hosts << " host(s) and " << reputation.subnets << " subnet(s) scored, "
+        << reputation.downWeighted << " down-weighted, " << reputation.blocked << " blocklisted";
+
+    auto const census = m_census.Estimate();
+    auto const share = [&](double count)
+    {
+        return census.population > 0 ? static_cast<int>(100 * count / census.population) : 0;
+    };
+
+    BOOST_LOG_TRIVIAL(info)
+        << "DHT census over the last "
+        << std::chrono::duration_cast<std::chrono::hours>(std::chrono::system_clock::now() - census.since).count() << " h: "
+        << "~" << static_cast<std::uint64_t>(census.population) << " info hash(es) recaptured, "
+        << "~" << static_cast<std::uint64_t>(census.reportedPopulation) << " reported by "
+        << "~" << static_cast<std::uint64_t>(census.nodes) << " node(s), "
+        << "~" << static_cast<std::uint64_t>(census.sampled) << " sampled (" << share(census.sampled) << "%), "
+        << "~" << static_cast<std::uint64_t>(census.indexed) << " indexed (" << share(census.indexed) << "%)";
+
+    BOOST_LOG_TRIVIAL(info)
+        << "Memory (" << MemoryBudget::Name(m_budget.Current()) << " pressure): " << m_budget;
+
+    if (m_resolveLatencies.empty())
+    {
+        return;
+    }
+
+    std::vector<lt::time_duration> latencies(m_resolveLatencies.begin(), m_resolveLatencies.end());
+    std::sort(latencies.begin(), latencies.end());
+
+    auto const percentile = [&](std::size_t p)
+    {
+        auto const latency = latencies[(latencies.size() - 1) * p / 100];
+        return std::chrono::duration_cast<std::chrono::milliseconds>(latency).count();
+    };
+
+    BOOST_LOG_TRIVIAL(info)
+        << "Time to metadata for priority requests: "
+        << "p50 " << percentile(50) << " ms, "
+        << "p95 " << percentile(95) << " ms "
+        << "(last " << latencies.size() << " request(s))";
+}
+
+void LibtorrentIndexer::OnMemoryPressure(lt::time_point now)
+{
+    auto const pressure = m_budget.Current();
+
+    // The DHT log alerts are the bulk of the alert traffic, and feed the node
+    // table. Mute them while nothing new is taken on anyway.
+    if ((pressure >= MemoryBudget::Pressure::High) != m_quietAlerts)
+    {
+        m_quietAlerts = !m_quietAlerts;
+
+        lt::settings_pack settings;
+        settings.set_int(
+            lt::settings_pack::alert_mask,
+            m_quietAlerts
+                ? lt::alert::all_categories & ~lt::alert_category::dht_log
+                : lt::alert::all_categories);
+
+        m_session->apply_settings(settings);
+    }
+
+    if (pressure < MemoryBudget::Pressure::High)
+    {
+        return;
+    }
+
+    auto const release = [this](const lt::info_hash_t& hash)
+    {
+        m_hashes.erase(hash);
+        m_fetchSources.erase(hash);
+        m_fetchAttempts.erase(hash);
+        if (m_seen != nullptr) { m_seen->Release(hash); }
+    };
+
+    // Under critical pressure, give up on the newest half of the background
+    // fetches and everything queued behind them. Other processes, or this one
+    // once the pressure is gone, will pick them up from the DHT again.
+    if (pressure == MemoryBudget::Pressure::Critical)
+    {
+        std::vector<std::unordered_map<lt::info_hash_t, ActiveFetch>::iterator> fetches;
+
+        for (auto it = m_active.begin(); it != m_active.end(); it++)
+        {
+            if (!it->second.priority
+                && it->second.handle.is_valid()
+                && m_waiters.find(it->first) == m_waiters.end())
+            {
+                fetches.push_back(it);
+            }
+        }
+
+        std::sort(
+            fetches.begin(),
+            fetches.end(),
+            [](auto const& lhs, auto const& rhs) { return lhs->second.added > rhs->second.added; });
+
+        fetches.resize(fetches.size() / 2);
+
+        for (auto const& it : fetches)
+        {
+            m_session->remove_torrent(it->second.handle, lt::session::delete_files);
+            release(it->first);
+            m_active.erase(it);
+        }
+
+        m_queue.Trim(FetchQueue::Priority::Background, 0, release);
+
+        for (auto& family : m_families)
+        {
+            family.nodes.DropNotDue(now);
+        }
+
+        BOOST_LOG_TRIVIAL(warning)
+            << "Cancelled " << fetches.size() << " fetch(es) under critical memory pressure";
+    }
+    else
+    {
+        m_queue.Trim(FetchQueue::Priority::Background, m_maxActiveFetches, release);
+    }
+
+    // Only the hashes in flight need to be remembered, the index catches the
+    // ones already fetched.
+    std::unordered_set<lt::info_hash_t> hashes;
+
+    for (auto const& hash : m_hashes)
+    {
+        if (m_queue.Contains(hash) || FindActive(hash) != m_active.end())
+        {
+            hashes.insert(hash);
+        }
+    }
+
+    m_hashes.swap(hashes);
+
+#ifdef __GLIBC__
+    // Hand the freed memory back to the system, or the resident set size
+    // would keep the pressure up
+    malloc_trim(0);
+#endif
 }
 
 void LibtorrentIndexer::PopAlerts()
 {
     static const lt::clock_type::duration minRequestInterval = 5min;
+    static Logging::RateLimiter addedLimiter("Added torrent");
+    static Logging::RateLimiter indexedLimiter("Torrent indexed");
+
+    HAMSTER_TRACE_SPAN("PopAlerts");
 
     std::vector<lt::alert*> alerts;
-    m_session->pop_alerts(&alerts);
+
+    {
+        HAMSTER_TRACE_SPAN("pop_alerts");
+        m_session->pop_alerts(&alerts);
+    }
+
+    m_poppedAlerts = alerts.size();
+
+    if (m_stopping) { m_drainAlerts += alerts.size(); }
 
     auto const now = lt::clock_type::now();
 
@@ -65,68 +949,191 @@ void LibtorrentIndexer::PopAlerts()
     {
         // BOOST_LOG_TRIVIAL(info) << alert->message();
 
+        HAMSTER_TRACE_SPAN(alert->what());
+
         switch (alert->type())
         {
-            case lt::dht_pkt_alert::alert_type:
+            case lt::add_torrent_alert::alert_type:
             {
-                auto const a = lt::alert_cast<lt::dht_pkt_alert>(alert);
+                auto const a = lt::alert_cast<lt::add_torrent_alert>(alert);
+                auto it = m_active.find(a->params.info_hashes);
 
-                if (m_nodes.find(a->node) == m_nodes.end())
+                if (a->error)
                 {
-                    m_nodes.insert({ a->node, { lt::time_point::min() }});
+                    BOOST_LOG_TRIVIAL(warning) << "Failed to add torrent " << a->params.info_hashes << ": " << a->error.message();
+
+                    EndFetch(it);
+                    CompleteWaiters(a->params.info_hashes, std::nullopt);
+                    break;
                 }
+
+                if (it != m_active.end())
+                {
+                    it->second.handle = a->handle;
+                }
+            } break;
+
+            case lt::dht_pkt_alert::alert_type:
+            {
+                auto const a = lt::alert_cast<lt::dht_pkt_alert>(alert);
+                FamilyOf(a->node).nodes.Add(a->node);
             } break;
 
             case lt::dht_sample_infohashes_alert::alert_type:
             {
                 auto const a = lt::alert_cast<lt::dht_sample_infohashes_alert>(alert);
+                auto& family = FamilyOf(a->endpoint);
+
+                family.responses += 1;
+                family.samples += a->num_samples();
+                family.totalResponses += 1;
+                family.totalSamples += a->num_samples();
 
+                m_census.AddReport(a->num_infohashes);
+
+                auto const weight = m_reputation.Weight(a->endpoint.address());
+
+                // Both families share the seen hashes, so a hash found on
+                // both is only fetched once, and counted for the first.
                 for (const auto& hash : a->samples())
                 {
                     auto const ih = lt::info_hash_t(hash);
 
-                    if (m_hashes.find(ih) != m_hashes.end())
+                    m_census.AddSample(hash, a->endpoint);
+
+                    // Seen hashes are pruned under memory pressure, so check
+                    // the index as well. Above high pressure, take on nothing.
+                    if (m_hashes.find(ih) != m_hashes.end()
+                        || m_budget.Current() >= MemoryBudget::Pressure::High)
+                    {
+                        continue;
+                    }
+
+                    // Also matches v2 torrents by their truncated v2 hash,
+                    // which is what they are sampled by
+                    if (auto const match = m_storage.Exists(ih); match != Models::Torrent::Match::None)
                     {
+                        m_census.AddIndexed(hash);
+                        if (match == Models::Torrent::Match::Alias) { m_duplicates.avoided += 1; }
                         continue;
                     }
 
-                    BOOST_LOG_TRIVIAL(debug) << "Added torrent " << ih;
+                    if (!AdmitSample(ih, weight))
+                    {
+                        continue;
+                    }
 
-                    lt::add_torrent_params params;
-                    params.flags &= ~lt::torrent_flags::auto_managed;
-                    params.flags &= ~lt::torrent_flags::need_save_resume;
-                    params.flags &= ~lt::torrent_flags::paused;
-                    params.flags &= ~lt::torrent_flags::update_subscribe;
-                    params.flags |= lt::torrent_flags::upload_mode;
-                    params.info_hashes = ih;
-                    params.save_path = fs::temp_directory_path();
+                    if (m_seen != nullptr)
+                    {
+                        switch (m_seen->Claim(ih))
+                        {
+                            case SharedSeenSet::ClaimResult::InFlight:
+                            case SharedSeenSet::ClaimResult::Done:
+                                continue;
+                            default:
+                                break;
+                        }
+                    }
 
-                    m_session->async_add_torrent(params);
-                    m_hashes.insert(ih);
-                }
+                    HAMSTER_LOG_RATE_LIMITED(debug, addedLimiter, "Added torrent ", ih);
 
-                for (auto const& [_, endpoint] : a->nodes())
-                {
-                    auto it = m_nodes.find(endpoint);
+                    m_queue.Push(ih, FetchQueue::Priority::Background);
+                    m_hashes.insert(ih);
+                    m_fetchSources[ih] = a->endpoint.address();
+                    family.added += 1;
 
-                    if (it == m_nodes.end())
+                    if (m_journal != nullptr)
                     {
-                        it = m_nodes.insert({ endpoint, { lt::time_point::min() }}).first;
+                        m_journal->Add({ ih, std::chrono::system_clock::now(), 0, a->endpoint });
                     }
+                }
 
-                    it->second.nextRequest = now + std::max(a->interval, minRequestInterval);
+                for (auto const& [id, endpoint] : a->nodes())
+                {
+                    m_census.AddNode(id, a->endpoint);
+                    FamilyOf(endpoint).nodes.Defer(endpoint, now + std::max(a->interval, minRequestInterval));
                 }
             } break;
 
+            case lt::session_stats_alert::alert_type:
+            {
+                // Requested by Drain
+                if (m_stopping) { m_alertsDrained = true; }
+            } break;
+
             case lt::metadata_received_alert::alert_type:
             {
                 auto const a = lt::alert_cast<lt::metadata_received_alert>(alert);
+                auto const ti = a->handle.torrent_file();
+                auto const hashes = a->handle.info_hashes();
+
+                auto const writeStarted = lt::clock_type::now();
+                std::optional<bool> inserted;
+
+                try
+                {
+                    inserted = m_storage.InsertTorrent(*ti);
+                }
+                catch (const DatabaseException& ex)
+                {
+                    BOOST_LOG_TRIVIAL(error) << "Failed to index " << a->torrent_name() << ": " << ex.what();
+                }
+
+                auto const writeTime = lt::clock_type::now() - writeStarted;
+
+                m_writes += 1;
+                m_writeTime += writeTime;
+                m_maxWriteTime = std::max(m_maxWriteTime, writeTime);
+
+                auto const it = FindActive(hashes);
+
+                if (it != m_active.end())
+                {
+                    if (auto const source = m_fetchSources.find(it->first); source != m_fetchSources.end())
+                    {
+                        m_reputation.Resolved(source->second);
+                    }
+                }
 
-                Models::Torrent::Insert(
-                    m_db,
-                    *a->handle.torrent_file());
+                if (inserted)
+                {
+                    if (!*inserted) { m_duplicates.redundant += 1; }
 
-                BOOST_LOG_TRIVIAL(info) << "Torrent indexed: " << a->torrent_name();
+                    // The torrent may be sampled again by any of its hashes
+                    if (hashes.has_v1())
+                    {
+                        m_hashes.insert(lt::info_hash_t(hashes.v1));
+                        m_census.AddIndexed(hashes.v1);
+                    }
+
+                    if (hashes.has_v2())
+                    {
+                        m_hashes.insert(lt::info_hash_t(hashes.get(lt::protocol_version::V2)));
+                        m_census.AddIndexed(hashes.get(lt::protocol_version::V2));
+                    }
+
+                    if (m_seen != nullptr)
+                    {
+                        m_seen->MarkDone(hashes);
+                    }
+
+                    if (m_journal != nullptr && it != m_active.end())
+                    {
+                        m_journal->Remove(it->first);
+                    }
+
+                    HAMSTER_LOG_RATE_LIMITED(info, indexedLimiter, "Torrent indexed: ", std::string(a->torrent_name()));
+                }
+                else if (m_seen != nullptr)
+                {
+                    // Left in the journal for the next run, and to whichever
+                    // process samples it next
+                    m_seen->Release(hashes);
+                }
+
+                CompleteWaiters(hashes, Models::Torrent::FromTorrentInfo(*ti));
+
+                EndFetch(it);
 
                 m_session->remove_torrent(
                     a->handle,
@@ -134,40 +1141,221 @@ void LibtorrentIndexer::PopAlerts()
             } break;
         }
     }
+
+    PumpFetchQueue();
 }
 
-void LibtorrentIndexer::SampleInfohashes(boost::system::error_code ec)
+void LibtorrentIndexer::PumpFetchQueue()
 {
-    if (ec) { return; }
+    // Whatever is queued by now waits in the journal for the next run
+    if (m_stopping) { return; }
+
+    HAMSTER_TRACE_SPAN("PumpFetchQueue");
+
+    // Priority fetches have slots of their own, so a full set of background
+    // fetches never delays them and they never starve the background ones.
+    while (m_priorityActive < m_maxPriorityFetches)
+    {
+        auto const hash = m_queue.Pop(FetchQueue::Priority::High);
+        if (!hash) { break; }
+
+        StartFetch(*hash, true);
+    }
+
+    while (m_active.size() - m_priorityActive < BackgroundFetchLimit())
+    {
+        auto const hash = m_queue.Pop(FetchQueue::Priority::Background);
+        if (!hash) { break; }
+
+        StartFetch(*hash, false);
+    }
+}
+
+void LibtorrentIndexer::Requeue(const std::vector<FetchJournal::Entry>& entries)
+{
+    std::size_t queued = 0;
+
+    for (auto const& entry : entries)
+    {
+        if (m_hashes.find(entry.hash) != m_hashes.end())
+        {
+            continue;
+        }
 
+        if (auto const match = m_storage.Exists(entry.hash); match != Models::Torrent::Match::None)
+        {
+            if (match == Models::Torrent::Match::Alias) { m_duplicates.avoided += 1; }
+            continue;
+        }
+
+        // Hashes queued through the control socket have no source
+        auto const sampled = entry.source.port() != 0;
+
+        if (sampled && !AdmitSample(entry.hash, m_reputation.Weight(entry.source.address())))
+        {
+            continue;
+        }
+
+        // Journaled again, as the old journal is removed once replayed.
+        // Under memory pressure they wait for the next run.
+        if (m_budget.Current() >= MemoryBudget::Pressure::High)
+        {
+            m_journal->Add(entry);
+            continue;
+        }
+
+        // Hashes another process fetches, or has fetched, are left to it
+        if (m_seen != nullptr)
+        {
+            switch (m_seen->Claim(entry.hash))
+            {
+                case SharedSeenSet::ClaimResult::InFlight:
+                case SharedSeenSet::ClaimResult::Done:
+                    continue;
+                default:
+                    break;
+            }
+        }
+
+        m_journal->Add(entry);
+
+        m_queue.Push(entry.hash, FetchQueue::Priority::Background);
+        m_hashes.insert(entry.hash);
+        queued += 1;
+
+        if (entry.attempts > 0)
+        {
+            m_fetchAttempts[entry.hash] = entry.attempts;
+        }
+
+        if (sampled)
+        {
+            m_fetchSources[entry.hash] = entry.source.address();
+        }
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "Queued " << queued << " of " << entries.size() << " journaled info hash(es)";
+
+    // The batch is journaled anew before the next one is asked for
+    m_journal->Flush();
+    m_replayWaiting = true;
+
+    PumpFetchQueue();
+    ContinueReplay();
+}
+
+void LibtorrentIndexer::SampleInfohashes()
+{
     static std::random_device dev;
     static std::mt19937 rng(dev());
     static std::uniform_int_distribution<std::mt19937::result_type> dist(
         std::numeric_limits<std::uint8_t>::min(),
         std::numeric_limits<std::uint8_t>::max());
 
+    HAMSTER_TRACE_SPAN("SampleInfohashes");
+
     auto const now = lt::clock_type::now();
 
-    auto it = std::find_if(
-        m_nodes.begin(),
-        m_nodes.end(),
-        [now](auto const& n) { return n.second.nextRequest < now; });
+    m_ticks += 1;
+
+    m_census.Rotate(std::chrono::system_clock::now());
+
+    if (now - m_lastReputationDecay >= reputationHalfLife)
+    {
+        m_reputation.Decay();
+        m_lastReputationDecay = now;
+    }
+    UpdateMemoryBudget();
+    OnMemoryPressure(now);
+    ContinueReplay();
 
-    int sampled = 0;
+    // Sample every other tick under elevated pressure, and not at all above
+    auto const pressure = m_budget.Current();
+    auto const sample = pressure == MemoryBudget::Pressure::Normal
+        || (pressure == MemoryBudget::Pressure::Elevated && m_ticks % 2 == 0);
 
-    for (;it != m_nodes.end(); it++)
+    for (auto& family : m_families)
     {
-        it->second.nextRequest = now + 1h;
+        // Whatever a blocklisted node samples would be skipped anyway
+        auto const due = family.nodes.TakeDue(
+            now,
+            sample ? std::size_t(m_dhtQueryRate) * sampleIntervalSeconds : 0,
+            1h,
+            [this](auto const& endpoint)
+            {
+                return m_enforceReputation && m_reputation.Weight(endpoint.address()) == 0;
+            });
+
+        for (auto const& endpoint : due)
+        {
+            lt::sha1_hash hash;
+            for (auto& b : hash) { b = dist(rng); }
+
+            m_session->dht_sample_infohashes(endpoint, hash);
+        }
+
+        family.queries += due.size();
 
-        lt::sha1_hash hash;
-        for (auto& b : hash) { b = dist(rng); }
+        BOOST_LOG_TRIVIAL(debug) << "Sampled " << due.size() << " of " << family.nodes.Size() << " " << family.name << " node(s)";
+    }
+
+    ExpireFetches(now);
+    PumpFetchQueue();
 
-        m_session->dht_sample_infohashes(it->first, hash);
-        sampled += 1;
+    if (now - m_lastStats >= 1min)
+    {
+        LogStats();
+        m_lastStats = now;
     }
+}
 
-    BOOST_LOG_TRIVIAL(debug) << "Sampled " << sampled << " of " << m_nodes.size() << " node(s)";
+void LibtorrentIndexer::StartFetch(const lt::info_hash_t& hash, bool priority)
+{
+    std::uint16_t attempts = 1;
+
+    if (auto const it = m_fetchAttempts.find(hash); it != m_fetchAttempts.end())
+    {
+        attempts += it->second;
+        m_fetchAttempts.erase(it);
+    }
 
-    m_timer.expires_from_now(boost::posix_time::seconds(5), ec);
-    m_timer.async_wait([this](auto && PH1) { SampleInfohashes(std::forward<decltype(PH1)>(PH1)); });
+    m_session->async_add_torrent(FetchParams(hash));
+    m_active.insert({ hash, { lt::clock_type::now(), priority, {}, attempts }});
+
+    if (m_journal != nullptr)
+    {
+        m_journal->Attempt(hash);
+    }
+
+    if (priority) { m_priorityActive += 1; }
+}
+
+void LibtorrentIndexer::UpdateMemoryBudget()
+{
+    using Consumer = MemoryBudget::Consumer;
+
+    auto const queued = m_queue.Size(FetchQueue::Priority::Background) + m_queue.Size(FetchQueue::Priority::High);
+
+    m_budget.Set(Consumer::ActiveFetches, m_active.size() * activeFetchCost);
+    m_budget.Set(Consumer::Nodes, (m_families[0].nodes.Size() + m_families[1].nodes.Size()) * nodeCost);
+    m_budget.Set(Consumer::SeenHashes, m_hashes.size() * seenHashCost + m_hashes.bucket_count() * sizeof(void*));
+    m_budget.Set(Consumer::FetchQueue, queued * queuedHashCost + m_fetchAttempts.size() * seenHashCost);
+    m_budget.Set(Consumer::Storage, m_storage.MemoryUsage());
+    m_budget.Set(Consumer::Reputation, m_reputation.MemoryUsage() + m_fetchSources.size() * fetchSourceCost);
+    m_budget.Set(Consumer::PendingWrites, m_journal != nullptr ? m_journal->Pending() : 0);
+    m_budget.Set(Consumer::Alerts, m_poppedAlerts * alertCost);
+
+    auto const previous = m_budget.Current();
+    auto const pressure = m_budget.Update();
+
+    if (pressure > previous)
+    {
+        BOOST_LOG_TRIVIAL(warning)
+            << "Memory pressure is " << MemoryBudget::Name(pressure) << ": " << m_budget;
+    }
+    else if (pressure < previous)
+    {
+        BOOST_LOG_TRIVIAL(info)
+            << "Memory pressure is back to " << MemoryBudget::Name(pressure) << ": " << m_budget;
+    }
 }
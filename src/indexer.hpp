@@ -1,16 +1,37 @@
 #pragma once
 
-#include <map>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <libtorrent/fwd.hpp>
 #include <libtorrent/info_hash.hpp>
-#include <sqlite3.h>
+#include <libtorrent/time.hpp>
+
+#include "census.hpp"
+#include "fetchjournal.hpp"
+#include "fetchqueue.hpp"
+#include "memorybudget.hpp"
+#include "models/torrent.hpp"
+#include "models/torrentsignature.hpp"
+#include "nodeschedule.hpp"
+#include "reputation.hpp"
 
 namespace hamster
 {
+    class Options;
+    class SharedSeenSet;
+    class Storage;
+
     class IIndexer
     {
     public:
@@ -20,21 +41,205 @@ namespace hamster
     class LibtorrentIndexer : public IIndexer
     {
     public:
-        LibtorrentIndexer(boost::asio::io_context& io, sqlite3* db);
+        using ResolveCallback = std::function<void(const std::optional<Models::Torrent>&)>;
+
+        // Counts for one DHT family since startup
+        struct FamilyTotals
+        {
+            std::size_t nodes;
+            std::uint64_t responses;
+            std::uint64_t samples;
+        };
+
+        LibtorrentIndexer(
+            boost::asio::io_context& io,
+            Storage& storage,
+            const std::shared_ptr<Options>& opts,
+            SharedSeenSet* seen = nullptr,
+            FetchJournal* journal = nullptr);
         ~LibtorrentIndexer() noexcept override;
 
+        // Stops sampling and starting fetches, handles the alerts libtorrent
+        // has raised so far, writes out the fetch journal and the index and
+        // shuts down the libtorrent session. Gives up on the alerts and the
+        // session once the timeout passes. The fetches still pending are left
+        // in the journal for the next run.
+        boost::asio::awaitable<void> Drain(std::chrono::seconds timeout);
+
+        // Whether the libtorrent session is still shutting down after Drain
+        // gave up on it. The process then has to exit without running the
+        // static destructors under it.
+        bool SessionShuttingDown() const;
+
+        // Queues the given info hashes for a background metadata fetch,
+        // skipping the ones already seen or indexed. Returns the number of
+        // hashes queued.
+        std::size_t Enqueue(const std::vector<lt::info_hash_t>& hashes);
+
+        // Fetches the metadata for the given info hash ahead of everything
+        // found by sampling. The callback is invoked with std::nullopt if the
+        // metadata could not be fetched within the timeout.
+        void Resolve(
+            const lt::info_hash_t& hash,
+            std::chrono::seconds timeout,
+            ResolveCallback callback);
+
+        DhtCensus::Estimates Census() const;
+
+        // IPv4 first, then IPv6
+        std::array<FamilyTotals, 2> Families() const;
+
+        std::vector<Models::TorrentSignature::Match> Similar(
+            const lt::info_hash_t& hash,
+            std::size_t limit);
+
     private:
-        struct NodeInfo;
+        struct ActiveFetch;
+        struct Waiter;
+
+        // Fetches of torrents which turned out to be indexed already, per
+        // minute
+        struct DuplicateFetches
+        {
+            // Info hashes skipped because they matched the truncated v2 hash
+            // of an indexed torrent, which would have been fetched again
+            // without the alias
+            std::uint64_t avoided;
+
+            // Fetches completed for a torrent the index already had under
+            // another of its hashes
+            std::uint64_t redundant;
+        };
+
+        // Fetches which wasted a slot, and samples skipped for the reputation
+        // of their source, per minute
+        struct WastedFetches
+        {
+            // Fetches which timed out without metadata, and for how long
+            // they held their slots
+            std::uint64_t expired;
+            lt::time_duration slotTime;
+
+            // In observe mode, the samples which would have been skipped
+            std::uint64_t downWeighted;
+            std::uint64_t blocked;
+        };
+
+        // The IPv4 and IPv6 DHTs are separate networks with nodes of their
+        // own, so each is crawled on a schedule and a query budget of its own.
+        struct DhtFamily
+        {
+            const char* name;
+            NodeSchedule nodes;
+
+            // Since the last stats
+            std::uint64_t queries;
+            std::uint64_t responses;
+            std::uint64_t samples;
+            std::uint64_t added;
+
+            // Since startup
+            std::uint64_t totalResponses;
+            std::uint64_t totalSamples;
+        };
 
+        DhtFamily& FamilyOf(const boost::asio::ip::udp::endpoint& endpoint);
+
+        // Run from construction until Drain
+        boost::asio::awaitable<void> AlertLoop();
+        boost::asio::awaitable<void> PersistLoop();
+        boost::asio::awaitable<void> SampleLoop();
+
+        // Whether to fetch a hash sampled from a source of the given weight.
+        // Counts the skipped ones.
+        bool AdmitSample(const lt::info_hash_t& hash, double weight);
+
+        std::size_t BackgroundFetchLimit() const;
+        std::unordered_map<lt::info_hash_t, ActiveFetch>::iterator FindActive(const lt::info_hash_t& hash);
+
+        void CompleteWaiters(const lt::info_hash_t& hash, const std::optional<Models::Torrent>& torrent);
+        void ContinueReplay();
+        void EndFetch(std::unordered_map<lt::info_hash_t, ActiveFetch>::iterator it);
+        void ExpireFetches(lt::time_point now);
+        void LogStats();
+        void OnMemoryPressure(lt::time_point now);
         void PopAlerts();
-        void SampleInfohashes(boost::system::error_code ec);
+        void PumpFetchQueue();
+        void Requeue(const std::vector<FetchJournal::Entry>& entries);
+        void SampleInfohashes();
+        void StartFetch(const lt::info_hash_t& hash, bool priority);
+        void UpdateMemoryBudget();
 
         boost::asio::io_context& m_io;
-        boost::asio::deadline_timer m_timer;
+        boost::asio::steady_timer m_sampleTimer;
+        boost::asio::steady_timer m_persistTimer;
+
+        // Expires never, and is cancelled to wake the alert loop
+        boost::asio::steady_timer m_alertTimer;
+        bool m_alertsPending;
 
-        sqlite3* m_db;
+        // The number of alerts the last pop returned
+        std::size_t m_poppedAlerts;
+
+        // Cancelled once the last loop returns
+        boost::asio::steady_timer m_drainTimer;
+        int m_loops;
+        bool m_stopping;
+        bool m_alertsDrained;
+        bool m_drainTimedOut;
+        std::uint64_t m_drainAlerts;
+
+        Storage& m_storage;
+        SharedSeenSet* m_seen;
+        FetchJournal* m_journal;
+
+        // Whether the journal replay waits for Next after the last batch
+        bool m_replayWaiting;
         std::unique_ptr<libtorrent::session> m_session;
-        std::map<boost::asio::ip::udp::endpoint, NodeInfo> m_nodes;
+
+        // Releases the session_proxy once Drain has aborted the session
+        std::thread m_sessionShutdown;
+        std::shared_ptr<std::atomic<bool>> m_sessionReleased;
+        std::array<DhtFamily, 2> m_families;
+        DhtCensus m_census;
+        std::string m_censusFile;
+        lt::time_point m_lastCensusSave;
+        std::uint32_t m_dhtQueryRate;
         std::unordered_set<lt::info_hash_t> m_hashes;
+
+        FetchQueue m_queue;
+        std::unordered_map<lt::info_hash_t, ActiveFetch> m_active;
+        std::unordered_map<lt::info_hash_t, std::vector<std::shared_ptr<Waiter>>> m_waiters;
+        std::size_t m_maxActiveFetches;
+        std::size_t m_maxPriorityFetches;
+        std::size_t m_priorityActive;
+        lt::time_duration m_fetchTimeout;
+
+        MemoryBudget m_budget;
+        bool m_quietAlerts;
+        std::uint64_t m_ticks;
+
+        DuplicateFetches m_duplicates;
+        std::deque<DuplicateFetches> m_duplicateHistory;
+
+        NodeReputation m_reputation;
+        bool m_enforceReputation;
+        std::uint64_t m_admitKey;
+        lt::time_point m_lastReputationDecay;
+
+        // The source of each queued or active fetch sampled from the DHT
+        std::unordered_map<lt::info_hash_t, boost::asio::ip::address> m_fetchSources;
+
+        // The fetch attempts made so far at queued hashes which had any
+        std::unordered_map<lt::info_hash_t, std::uint16_t> m_fetchAttempts;
+
+        WastedFetches m_wasted;
+        std::deque<WastedFetches> m_wastedHistory;
+
+        std::deque<lt::time_duration> m_resolveLatencies;
+        int m_writes;
+        lt::time_duration m_writeTime;
+        lt::time_duration m_maxWriteTime;
+        lt::time_point m_lastStats;
     };
 }
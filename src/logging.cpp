@@ -0,0 +1,231 @@
+#include "logging.hpp"
+
+#include <chrono>
+
+#include <boost/core/null_deleter.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <boost/log/attributes/clock.hpp>
+#include <boost/log/attributes/value_extraction.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/sinks/async_frontend.hpp>
+#include <boost/log/sinks/text_ostream_backend.hpp>
+#include <boost/log/support/date_time.hpp>
+
+namespace logging = boost::log;
+namespace sinks = boost::log::sinks;
+namespace expr = boost::log::expressions;
+
+using hamster::Logging::Deferred;
+using hamster::Logging::DeferredAttribute;
+
+static std::atomic<std::uint64_t> dropped = 0;
+static std::atomic<std::uint32_t> rateLimit = 0;
+static std::atomic<int> minLevel = logging::trivial::info;
+
+// A queueing strategy for asynchronous_sink which never blocks the logging
+// thread. The bundled bounded_fifo_queue takes a mutex on every record.
+template<std::size_t Capacity>
+class BoundedLockFreeQueue
+{
+protected:
+    BoundedLockFreeQueue() = default;
+
+    template<typename ArgsT>
+    explicit BoundedLockFreeQueue(ArgsT const&) {}
+
+    ~BoundedLockFreeQueue()
+    {
+        logging::record_view* rec = nullptr;
+        while (m_queue.pop(rec)) { delete rec; }
+    }
+
+    void enqueue(logging::record_view const& rec)
+    {
+        try_enqueue(rec);
+    }
+
+    bool try_enqueue(logging::record_view const& rec)
+    {
+        auto copy = new logging::record_view(rec);
+
+        if (!m_queue.bounded_push(copy))
+        {
+            delete copy;
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        m_sequence.fetch_add(1, std::memory_order_release);
+        m_sequence.notify_one();
+
+        return true;
+    }
+
+    bool try_dequeue_ready(logging::record_view& rec)
+    {
+        logging::record_view* ptr = nullptr;
+        if (!m_queue.pop(ptr)) { return false; }
+
+        rec = std::move(*ptr);
+        delete ptr;
+
+        return true;
+    }
+
+    bool try_dequeue(logging::record_view& rec)
+    {
+        return try_dequeue_ready(rec);
+    }
+
+    bool dequeue_ready(logging::record_view& rec)
+    {
+        while (true)
+        {
+            auto const sequence = m_sequence.load(std::memory_order_acquire);
+
+            if (m_interrupted.exchange(false, std::memory_order_acquire)) { return false; }
+            if (try_dequeue_ready(rec)) { return true; }
+
+            m_sequence.wait(sequence, std::memory_order_acquire);
+        }
+    }
+
+    void interrupt_dequeue()
+    {
+        m_interrupted.store(true, std::memory_order_release);
+        m_sequence.fetch_add(1, std::memory_order_release);
+        m_sequence.notify_all();
+    }
+
+private:
+    boost::lockfree::queue<logging::record_view*, boost::lockfree::capacity<Capacity>> m_queue;
+    std::atomic<std::uint32_t> m_sequence = 0;
+    std::atomic<bool> m_interrupted = false;
+};
+
+using Sink = sinks::asynchronous_sink<sinks::text_ostream_backend, BoundedLockFreeQueue<8192>>;
+
+static boost::shared_ptr<Sink> sink;
+
+void hamster::Logging::Setup(
+    boost::log::trivial::severity_level level,
+    std::ostream& stream)
+{
+    minLevel = level;
+
+    auto core = logging::core::get();
+    core->add_global_attribute("TimeStamp", logging::attributes::local_clock());
+    core->set_filter(logging::trivial::severity >= level);
+
+    auto backend = boost::make_shared<sinks::text_ostream_backend>();
+    backend->add_stream(boost::shared_ptr<std::ostream>(&stream, boost::null_deleter()));
+    backend->auto_flush(true);
+
+    logging::formatter const format =
+        expr::stream
+            << "[" << expr::format_date_time<boost::posix_time::ptime>("TimeStamp", "%Y-%m-%d %H:%M:%S.%f") << "] "
+            << "[" << logging::trivial::severity << "] "
+            << expr::smessage;
+
+    // The formatter runs on the sink thread, not on the thread which logs.
+    sink = boost::make_shared<Sink>(backend);
+    sink->set_formatter(
+        [format](logging::record_view const& rec, logging::formatting_ostream& stream)
+        {
+            format(rec, stream);
+
+            if (auto const deferred = logging::extract<Deferred>(DeferredAttribute, rec))
+            {
+                stream.stream() << *deferred;
+            }
+        });
+
+    core->add_sink(sink);
+}
+
+void hamster::Logging::Shutdown()
+{
+    if (!sink) { return; }
+
+    logging::core::get()->remove_sink(sink);
+
+    sink->stop();
+    sink->flush();
+    sink.reset();
+}
+
+std::ostream& hamster::Logging::operator<<(std::ostream& stream, const Deferred& deferred)
+{
+    stream << deferred.text;
+    std::visit([&stream](auto const& argument) { stream << argument; }, deferred.argument);
+
+    return stream;
+}
+
+bool hamster::Logging::Enabled(boost::log::trivial::severity_level level)
+{
+    return level >= minLevel.load(std::memory_order_relaxed);
+}
+
+std::uint64_t hamster::Logging::Dropped()
+{
+    return dropped.load(std::memory_order_relaxed);
+}
+
+void hamster::Logging::SetRateLimit(std::uint32_t perSecond)
+{
+    rateLimit = perSecond;
+}
+
+std::uint32_t hamster::Logging::RateLimit()
+{
+    return rateLimit;
+}
+
+using hamster::Logging::RateLimiter;
+
+RateLimiter::RateLimiter(const char* name)
+    : m_name(name),
+      m_window(0),
+      m_count(0),
+      m_suppressed(0),
+      m_reported(0)
+{
+}
+
+bool RateLimiter::Allow()
+{
+    auto const limit = rateLimit.load(std::memory_order_relaxed);
+    if (limit == 0) { return true; }
+
+    auto const window = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    auto current = m_window.load(std::memory_order_relaxed);
+
+    if (current != window && m_window.compare_exchange_strong(current, window, std::memory_order_relaxed))
+    {
+        m_count.store(0, std::memory_order_relaxed);
+
+        auto const suppressed = m_suppressed.load(std::memory_order_relaxed);
+        auto const reported = m_reported.exchange(suppressed, std::memory_order_relaxed);
+
+        if (suppressed != reported)
+        {
+            BOOST_LOG_TRIVIAL(info) << "Suppressed " << (suppressed - reported) << " '" << m_name << "' message(s)";
+        }
+    }
+
+    if (m_count.fetch_add(1, std::memory_order_relaxed) < limit) { return true; }
+
+    m_suppressed.fetch_add(1, std::memory_order_relaxed);
+
+    return false;
+}
+
+std::uint64_t RateLimiter::Suppressed() const
+{
+    return m_suppressed.load(std::memory_order_relaxed);
+}
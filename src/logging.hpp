@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <variant>
+
+#include <boost/log/trivial.hpp>
+#include <boost/log/utility/manipulators/add_value.hpp>
+#include <libtorrent/info_hash.hpp>
+
+#include "tracing.hpp"
+
+// Logs text followed by argument through BOOST_LOG_TRIVIAL, at most
+// Logging::RateLimit() times per second for the given limiter. Use for
+// messages emitted once per alert or sample. The text must be a string
+// literal. It is attached to the record along with a copy of the argument,
+// and both are formatted on the sink thread. With tracing, the time spent
+// logging is recorded as a span.
+#ifdef HAMSTER_TRACING
+#define HAMSTER_LOG_RATE_LIMITED(severity, limiter, text, argument) \
+    if (!::hamster::Logging::Enabled(::boost::log::trivial::severity) || !(limiter).Allow()) {} \
+    else if (::hamster::Tracing::Span hamsterTraceLog("log " #severity); true) \
+        BOOST_LOG_TRIVIAL(severity) << ::boost::log::add_value( \
+            ::hamster::Logging::DeferredAttribute, \
+            ::hamster::Logging::Deferred{ text, argument })
+#else
+#define HAMSTER_LOG_RATE_LIMITED(severity, limiter, text, argument) \
+    if (!::hamster::Logging::Enabled(::boost::log::trivial::severity) || !(limiter).Allow()) {} \
+    else BOOST_LOG_TRIVIAL(severity) << ::boost::log::add_value( \
+        ::hamster::Logging::DeferredAttribute, \
+        ::hamster::Logging::Deferred{ text, argument })
+#endif
+
+namespace hamster::Logging
+{
+    inline constexpr const char* DeferredAttribute = "Deferred";
+
+    // A message of HAMSTER_LOG_RATE_LIMITED, kept as is until the sink
+    // formats it
+    struct Deferred
+    {
+        const char* text;
+        std::variant<lt::info_hash_t, std::string> argument;
+    };
+
+    std::ostream& operator<<(std::ostream& stream, const Deferred& deferred);
+
+    // Installs an asynchronous sink writing to the given stream. Records are
+    // passed to a dedicated thread through a bounded lock-free queue, where
+    // they are formatted and written. Records are dropped when the queue is
+    // full. Only the messages of HAMSTER_LOG_RATE_LIMITED are formatted
+    // entirely on that thread, the others are streamed by the thread which
+    // logs them.
+    void Setup(
+        boost::log::trivial::severity_level level,
+        std::ostream& stream = std::clog);
+
+    // Flushes the queue and removes the sink installed by Setup.
+    void Shutdown();
+
+    bool Enabled(boost::log::trivial::severity_level level);
+
+    // The number of records dropped because the queue was full.
+    std::uint64_t Dropped();
+
+    void SetRateLimit(std::uint32_t perSecond);
+    std::uint32_t RateLimit();
+
+    class RateLimiter
+    {
+    public:
+        explicit RateLimiter(const char* name);
+
+        bool Allow();
+
+        // The number of messages suppressed by this limiter.
+        std::uint64_t Suppressed() const;
+
+    private:
+        const char* m_name;
+        std::atomic<std::int64_t> m_window;
+        std::atomic<std::uint32_t> m_count;
+        std::atomic<std::uint64_t> m_suppressed;
+        std::atomic<std::uint64_t> m_reported;
+    };
+}
@@ -0,0 +1,1019 @@
+#include "logstorage.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <set>
+#include <type_traits>
+
+#include <boost/crc.hpp>
+#include <boost/log/trivial.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "database.hpp"
+#include "minhash.hpp"
+#include "tracing.hpp"
+
+namespace fs = std::filesystem;
+using hamster::LogStorage;
+using hamster::MinHash;
+using hamster::Models::Torrent;
+using hamster::Models::TorrentSignature;
+
+static const std::size_t memtableLimit = 1024 * 1024;
+static const std::chrono::seconds flushInterval = std::chrono::seconds(1);
+
+// Sealed segments with less than this share of live records are compacted
+static const double compactionThreshold = 0.5;
+
+enum RecordType : std::uint8_t
+{
+    TorrentRecord = 1
+};
+
+// Every record starts with a CRC-32 over the rest of the record, the payload
+// length, a sequence number ordering the records across segments and the
+// record type. Integers are stored in host byte order.
+static const std::size_t headerSize = 4 + 4 + 8 + 1;
+
+namespace
+{
+    class Writer
+    {
+    public:
+        explicit Writer(std::string& out)
+            : m_out(out)
+        {
+        }
+
+        template<typename T>
+        void Put(T value)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            m_out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void PutBytes(const void* data, std::size_t size)
+        {
+            m_out.append(static_cast<const char*>(data), size);
+        }
+
+        void PutString(std::string_view str)
+        {
+            Put(static_cast<std::uint32_t>(str.size()));
+            m_out.append(str);
+        }
+
+    private:
+        std::string& m_out;
+    };
+
+    class Reader
+    {
+    public:
+        explicit Reader(std::string_view in)
+            : m_in(in),
+              m_ok(true)
+        {
+        }
+
+        bool Ok() const { return m_ok; }
+
+        template<typename T>
+        T Get()
+        {
+            T value{};
+            GetBytes(&value, sizeof(value));
+            return value;
+        }
+
+        void GetBytes(void* data, std::size_t size)
+        {
+            if (!m_ok || m_in.size() < size)
+            {
+                m_ok = false;
+                return;
+            }
+
+            std::memcpy(data, m_in.data(), size);
+            m_in.remove_prefix(size);
+        }
+
+        std::string GetString()
+        {
+            auto const size = Get<std::uint32_t>();
+
+            if (!m_ok || m_in.size() < size)
+            {
+                m_ok = false;
+                return {};
+            }
+
+            std::string str(m_in.substr(0, size));
+            m_in.remove_prefix(size);
+
+            return str;
+        }
+
+    private:
+        std::string_view m_in;
+        bool m_ok;
+    };
+
+    struct DecodedTorrent
+    {
+        hamster::Models::Torrent torrent;
+        MinHash::Signature signature;
+    };
+}
+
+static std::uint64_t BucketKey(int band, std::int64_t bucket)
+{
+    return (static_cast<std::uint64_t>(band) << 32) | static_cast<std::uint32_t>(bucket);
+}
+
+static hamster::DatabaseException IoError(const std::string& what)
+{
+    return hamster::DatabaseException(what + ": " + std::strerror(errno));
+}
+
+static std::string SegmentPath(const std::string& directory, std::uint32_t id)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "segment-%08u.log", id);
+
+    return (fs::path(directory) / name).string();
+}
+
+static void ReadAt(int fd, char* data, std::size_t size, std::uint64_t offset)
+{
+    while (size > 0)
+    {
+        auto const res = ::pread(fd, data, size, static_cast<off_t>(offset));
+
+        if (res < 0 && errno == EINTR) { continue; }
+        if (res < 0) { throw IoError("Failed to read segment"); }
+        if (res == 0) { throw hamster::DatabaseException("Unexpected end of segment"); }
+
+        data += res;
+        size -= static_cast<std::size_t>(res);
+        offset += static_cast<std::uint64_t>(res);
+    }
+}
+
+static std::string Frame(std::uint64_t sequence, std::uint8_t type, std::string_view payload)
+{
+    auto const length = static_cast<std::uint32_t>(payload.size());
+
+    std::string record(headerSize, '\0');
+    std::memcpy(&record[4], &length, sizeof(length));
+    std::memcpy(&record[8], &sequence, sizeof(sequence));
+    record[16] = static_cast<char>(type);
+    record.append(payload);
+
+    boost::crc_32_type crc;
+    crc.process_bytes(record.data() + 4, record.size() - 4);
+
+    std::uint32_t const checksum = crc.checksum();
+    std::memcpy(&record[0], &checksum, sizeof(checksum));
+
+    return record;
+}
+
+// Returns the length of the record at the start of data, or 0 if it is torn
+// or corrupt.
+static std::size_t Unframe(std::string_view data)
+{
+    if (data.size() < headerSize) { return 0; }
+
+    std::uint32_t checksum;
+    std::uint32_t length;
+    std::memcpy(&checksum, data.data(), sizeof(checksum));
+    std::memcpy(&length, data.data() + 4, sizeof(length));
+
+    if (data.size() - headerSize < length) { return 0; }
+
+    boost::crc_32_type crc;
+    crc.process_bytes(data.data() + 4, headerSize - 4 + length);
+
+    return crc.checksum() == checksum ? headerSize + length : 0;
+}
+
+static std::uint64_t SequenceOf(std::string_view record)
+{
+    std::uint64_t sequence;
+    std::memcpy(&sequence, record.data() + 8, sizeof(sequence));
+    return sequence;
+}
+
+static std::uint8_t TypeOf(std::string_view record)
+{
+    return static_cast<std::uint8_t>(record[16]);
+}
+
+static std::string_view PayloadOf(std::string_view record)
+{
+    return record.substr(headerSize);
+}
+
+static void EncodeHashes(Writer& writer, const lt::info_hash_t& hashes)
+{
+    writer.Put(static_cast<std::uint8_t>((hashes.has_v1() ? 1 : 0) | (hashes.has_v2() ? 2 : 0)));
+    if (hashes.has_v1()) { writer.PutBytes(hashes.v1.data(), lt::sha1_hash::size()); }
+    if (hashes.has_v2()) { writer.PutBytes(hashes.v2.data(), lt::sha256_hash::size()); }
+}
+
+static std::string EncodeTorrent(const lt::torrent_info& torrentInfo, MinHash::Signature& signature)
+{
+    auto const& files = torrentInfo.files();
+
+    std::string payload;
+    Writer writer(payload);
+
+    EncodeHashes(writer, torrentInfo.info_hashes());
+    writer.PutString(torrentInfo.name());
+    writer.Put<std::int64_t>(torrentInfo.total_size());
+    writer.Put<std::uint32_t>(files.num_files());
+
+    std::vector<std::uint64_t> features;
+    features.reserve(files.num_files());
+
+    for (int i = 0; i < files.num_files(); i++)
+    {
+        auto const path = files.file_path(lt::file_index_t{i});
+        auto const size = files.file_size(lt::file_index_t{i});
+
+        writer.PutString(path);
+        writer.Put<std::int64_t>(size);
+
+        features.push_back(MinHash::Feature(path, size));
+    }
+
+    signature = MinHash::Compute(features);
+    writer.PutBytes(signature.data(), sizeof(signature));
+
+    return payload;
+}
+
+static std::string EncodeTorrent(const DecodedTorrent& decoded)
+{
+    std::string payload;
+    Writer writer(payload);
+
+    EncodeHashes(writer, decoded.torrent.infoHashes);
+    writer.PutString(decoded.torrent.name);
+    writer.Put<std::int64_t>(decoded.torrent.size);
+    writer.Put<std::uint32_t>(static_cast<std::uint32_t>(decoded.torrent.files.size()));
+
+    for (auto const& file : decoded.torrent.files)
+    {
+        writer.PutString(file.path);
+        writer.Put<std::int64_t>(file.size);
+    }
+
+    writer.PutBytes(decoded.signature.data(), sizeof(decoded.signature));
+
+    return payload;
+}
+
+static lt::info_hash_t DecodeHashes(Reader& reader)
+{
+    lt::info_hash_t hashes;
+    auto const flags = reader.Get<std::uint8_t>();
+
+    if (flags & 1) { reader.GetBytes(hashes.v1.data(), lt::sha1_hash::size()); }
+    if (flags & 2) { reader.GetBytes(hashes.v2.data(), lt::sha256_hash::size()); }
+
+    return hashes;
+}
+
+static bool DecodeTorrent(std::string_view payload, DecodedTorrent& decoded)
+{
+    Reader reader(payload);
+
+    decoded.torrent.infoHashes = DecodeHashes(reader);
+    decoded.torrent.name = reader.GetString();
+    decoded.torrent.size = reader.Get<std::int64_t>();
+
+    auto const numFiles = reader.Get<std::uint32_t>();
+
+    for (std::uint32_t i = 0; i < numFiles && reader.Ok(); i++)
+    {
+        auto path = reader.GetString();
+        auto const size = reader.Get<std::int64_t>();
+
+        decoded.torrent.files.push_back({ std::move(path), size });
+    }
+
+    reader.GetBytes(decoded.signature.data(), sizeof(decoded.signature));
+
+    return reader.Ok();
+}
+
+std::size_t LogStorage::KeyHash::operator()(const Key& key) const
+{
+    // Info hashes are uniformly distributed already
+    std::size_t hash;
+    std::memcpy(&hash, key.bytes.data(), sizeof(hash));
+
+    return hash;
+}
+
+LogStorage::LogStorage(const std::string& directory, std::uint64_t segmentSize)
+    : m_directory(directory),
+      m_segmentSize(segmentSize),
+      m_active(0),
+      m_sequence(0),
+      m_stop(false)
+{
+    fs::create_directories(m_directory);
+
+    std::vector<std::uint32_t> ids;
+
+    for (auto const& entry : fs::directory_iterator(m_directory))
+    {
+        auto const name = entry.path().filename().string();
+        unsigned id;
+        char extension[4] = {};
+
+        if (std::sscanf(name.c_str(), "segment-%8u.%3s", &id, extension) == 2
+            && std::strcmp(extension, "log") == 0)
+        {
+            ids.push_back(id);
+        }
+    }
+
+    std::sort(ids.begin(), ids.end());
+
+    for (auto const id : ids)
+    {
+        auto const path = SegmentPath(m_directory, id);
+        int const fd = ::open(path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+
+        if (fd < 0) { throw IoError("Failed to open " + path); }
+
+        auto const size = static_cast<std::uint64_t>(fs::file_size(path));
+        m_segments[id] = Segment{ fd, size, 0, false };
+
+        std::string data(size, '\0');
+        ReadAt(fd, data.data(), data.size(), 0);
+
+        std::string_view const view(data);
+        std::uint64_t offset = 0;
+
+        while (offset < view.size())
+        {
+            auto const length = Unframe(view.substr(offset));
+
+            if (length == 0 || !Replay(id, offset, view.substr(offset, length)))
+            {
+                break;
+            }
+
+            offset += length;
+        }
+
+        if (offset == size) { continue; }
+
+        // A torn write at the end of the last segment is what a crash leaves
+        // behind. Anywhere else, the segment is damaged and is left alone.
+        if (id == ids.back())
+        {
+            BOOST_LOG_TRIVIAL(warning)
+                << "Truncating " << (size - offset) << " byte(s) of incomplete records from " << path;
+
+            if (::ftruncate(fd, static_cast<off_t>(offset)) != 0) { throw IoError("Failed to truncate " + path); }
+
+            m_segments[id].size = offset;
+        }
+        else
+        {
+            BOOST_LOG_TRIVIAL(error) << "Segment " << path << " is corrupt at offset " << offset;
+            m_segments[id].corrupt = true;
+        }
+    }
+
+    // Appending to the last segment while it has room keeps restarts from
+    // leaving small segments behind, which compaction would never pick
+    if (!ids.empty() && m_segments.at(ids.back()).size < m_segmentSize)
+    {
+        m_active = ids.back();
+    }
+    else
+    {
+        OpenSegment(ids.empty() ? 1 : ids.back() + 1);
+    }
+
+    BOOST_LOG_TRIVIAL(info)
+        << "Opened " << m_torrents.size() << " torrent(s) from " << ids.size() << " segment(s)";
+
+    m_thread = std::thread([this] { Run(); });
+}
+
+LogStorage::~LogStorage() noexcept
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+
+    m_cv.notify_all();
+    m_thread.join();
+
+    try
+    {
+        Flush();
+        Sync();
+    }
+    catch (const std::exception& ex)
+    {
+        BOOST_LOG_TRIVIAL(error) << "Failed to write the memtable out: " << ex.what();
+    }
+
+    for (auto const& [_, segment] : m_segments)
+    {
+        ::close(segment.fd);
+    }
+}
+
+void LogStorage::Begin()
+{
+    // Records are appended in order, so a batch is simply everything written
+    // up to the next Commit.
+}
+
+void LogStorage::Commit()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    Flush();
+    Sync();
+}
+
+void LogStorage::Checkpoint()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    Flush();
+    Sync();
+}
+
+Torrent::Match LogStorage::Exists(const lt::info_hash_t& hash)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (FindOrdinal(hash) == nullptr) { return Torrent::Match::None; }
+
+    // Found by its v1 form alone, which may be a truncated v2 hash
+    if (hash.has_v1()
+        && m_aliases.count(KeyOf(hash.v1)) > 0
+        && !(hash.has_v2() && m_keys.count(KeyOf(hash.v2)) > 0))
+    {
+        return Torrent::Match::Alias;
+    }
+
+    return Torrent::Match::Hash;
+}
+
+std::vector<TorrentSignature::Match> LogStorage::FindSimilar(
+    const lt::info_hash_t& hash,
+    std::size_t limit)
+{
+    std::vector<TorrentSignature::Match> matches;
+
+    std::uint32_t self;
+    std::string record;
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        auto const ordinal = FindOrdinal(hash);
+        if (ordinal == nullptr) { return matches; }
+
+        self = *ordinal;
+        record = Read(m_torrents[self]);
+    }
+
+    DecodedTorrent target;
+    if (!DecodeTorrent(PayloadOf(record), target)) { return matches; }
+
+    auto const bands = MinHash::ComputeBands(target.signature);
+
+    // Collect the torrents sharing at least one band bucket
+    std::set<std::uint32_t> candidates;
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        for (int band = 0; band < MinHash::NumBands; band++)
+        {
+            auto [it, end] = m_buckets.equal_range(BucketKey(band, bands[band]));
+
+            for (int taken = 0; it != end && taken < TorrentSignature::MaxCandidatesPerBand; it++, taken++)
+            {
+                if (it->second != self) { candidates.insert(it->second); }
+            }
+        }
+    }
+
+    // Score the candidates on their full signatures
+    for (auto const candidate : candidates)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            record = Read(m_torrents[candidate]);
+        }
+
+        DecodedTorrent other;
+        if (!DecodeTorrent(PayloadOf(record), other)) { continue; }
+
+        double const similarity = MinHash::Similarity(target.signature, other.signature);
+        if (similarity < TorrentSignature::MinSimilarity) { continue; }
+
+        TorrentSignature::Match match;
+        match.infoHashes = other.torrent.infoHashes;
+        match.name = std::move(other.torrent.name);
+        match.size = other.torrent.size;
+        match.similarity = similarity;
+
+        matches.push_back(std::move(match));
+    }
+
+    std::sort(
+        matches.begin(),
+        matches.end(),
+        [](auto const& lhs, auto const& rhs) { return lhs.similarity > rhs.similarity; });
+
+    if (matches.size() > limit) { matches.resize(limit); }
+
+    return matches;
+}
+
+std::optional<hamster::Models::Torrent> LogStorage::GetTorrent(const lt::info_hash_t& hash)
+{
+    std::string record;
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        auto const ordinal = FindOrdinal(hash);
+        if (ordinal == nullptr) { return std::nullopt; }
+
+        record = Read(m_torrents[*ordinal]);
+    }
+
+    DecodedTorrent decoded;
+    if (!DecodeTorrent(PayloadOf(record), decoded)) { return std::nullopt; }
+
+    return std::move(decoded.torrent);
+}
+
+bool LogStorage::InsertTorrent(const lt::torrent_info& torrentInfo)
+{
+    HAMSTER_TRACE_SPAN("LogStorage::InsertTorrent");
+
+    auto const hashes = torrentInfo.info_hashes();
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        auto const found = FindOrdinal(hashes);
+
+        if (found != nullptr)
+        {
+            auto const ordinal = *found;
+
+            // Complete the hashes of the stored torrent, unless one of them
+            // already belongs to another torrent
+            bool missing = false;
+
+            for (auto const& key : KeysOf(hashes))
+            {
+                auto const it = m_keys.find(key);
+
+                if (it == m_keys.end()) { missing = true; }
+                else if (it->second != ordinal) { return false; }
+            }
+
+            if (!missing) { return false; }
+
+            DecodedTorrent decoded;
+            if (!DecodeTorrent(PayloadOf(Read(m_torrents[ordinal])), decoded)) { return false; }
+
+            if (hashes.has_v1()) { decoded.torrent.infoHashes.v1 = hashes.v1; }
+            if (hashes.has_v2()) { decoded.torrent.infoHashes.v2 = hashes.v2; }
+
+            auto const location = Append(TorrentRecord, EncodeTorrent(decoded));
+
+            m_segments.at(m_torrents[ordinal].segment).live -= m_torrents[ordinal].length;
+            m_torrents[ordinal] = location;
+            AddKeys(decoded.torrent.infoHashes, ordinal);
+
+            return false;
+        }
+    }
+
+    // Only this thread inserts torrents, so encode without holding the lock
+    MinHash::Signature signature;
+    auto const payload = EncodeTorrent(torrentInfo, signature);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    Index(hashes, Append(TorrentRecord, payload), signature);
+
+    return true;
+}
+
+std::uint64_t LogStorage::MemoryUsage()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // Hash and tree nodes carry about two pointers of overhead each
+    return m_memtable.capacity()
+        + m_keys.size() * (sizeof(std::pair<const Key, std::uint32_t>) + 2 * sizeof(void*))
+        + m_keys.bucket_count() * sizeof(void*)
+        + m_aliases.size() * (sizeof(Key) + 2 * sizeof(void*))
+        + m_aliases.bucket_count() * sizeof(void*)
+        + m_torrents.capacity() * sizeof(Location)
+        + m_buckets.size() * (sizeof(std::pair<const std::uint64_t, std::uint32_t>) + sizeof(void*))
+        + m_buckets.bucket_count() * sizeof(void*);
+}
+
+void LogStorage::ScanTorrents(const std::function<void(const Models::Torrent&)>& callback)
+{
+    std::size_t count;
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        count = m_torrents.size();
+    }
+
+    for (std::size_t ordinal = 0; ordinal < count; ordinal++)
+    {
+        std::string record;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            record = Read(m_torrents[ordinal]);
+        }
+
+        DecodedTorrent decoded;
+
+        if (DecodeTorrent(PayloadOf(record), decoded))
+        {
+            callback(decoded.torrent);
+        }
+    }
+}
+
+LogStorage::Key LogStorage::KeyOf(const lt::sha1_hash& hash)
+{
+    Key key;
+    std::memcpy(key.bytes.data(), hash.data(), lt::sha1_hash::size());
+
+    return key;
+}
+
+LogStorage::Key LogStorage::KeyOf(const lt::sha256_hash& hash)
+{
+    Key key;
+    std::memcpy(key.bytes.data(), hash.data(), lt::sha256_hash::size());
+    key.v2 = true;
+
+    return key;
+}
+
+std::vector<LogStorage::Key> LogStorage::KeysOf(const lt::info_hash_t& hash)
+{
+    std::vector<Key> keys;
+
+    if (hash.has_v1()) { keys.push_back(KeyOf(hash.v1)); }
+
+    // v2 torrents are also sampled on the DHT by their truncated v2 hash,
+    // which is keyed like a v1 hash
+    if (hash.has_v2())
+    {
+        keys.push_back(KeyOf(hash.v2));
+        keys.push_back(KeyOf(hash.get(lt::protocol_version::V2)));
+    }
+
+    return keys;
+}
+
+bool LogStorage::AddKeys(const lt::info_hash_t& hash, std::uint32_t ordinal)
+{
+    bool added = false;
+
+    for (auto const& key : KeysOf(hash))
+    {
+        added |= m_keys.emplace(key, ordinal).second;
+    }
+
+    if (hash.has_v2())
+    {
+        auto const alias = KeyOf(hash.get(lt::protocol_version::V2));
+        if (m_keys.at(alias) == ordinal) { m_aliases.insert(alias); }
+    }
+
+    return added;
+}
+
+LogStorage::Location LogStorage::Append(std::uint8_t type, std::string_view payload)
+{
+    auto const record = Frame(++m_sequence, type, payload);
+    auto& segment = m_segments.at(m_active);
+
+    Location location{ m_active, static_cast<std::uint32_t>(record.size()), segment.size + m_memtable.size() };
+
+    m_memtable += record;
+    segment.live += record.size();
+
+    if (m_memtable.size() >= memtableLimit)
+    {
+        Flush();
+    }
+
+    return location;
+}
+
+void LogStorage::Compact(std::uint32_t id)
+{
+    int fd;
+    std::uint64_t size;
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        auto const& segment = m_segments.at(id);
+        fd = segment.fd;
+        size = segment.size;
+    }
+
+    // Sealed segments never change, and only this thread removes them
+    std::string data(size, '\0');
+    ReadAt(fd, data.data(), data.size(), 0);
+
+    std::string_view const view(data);
+    std::uint64_t offset = 0;
+    std::size_t moved = 0;
+
+    while (offset < view.size())
+    {
+        auto const length = Unframe(view.substr(offset));
+
+        if (length == 0)
+        {
+            throw DatabaseException("Segment " + std::to_string(id) + " is corrupt at offset " + std::to_string(offset));
+        }
+
+        auto const record = view.substr(offset, length);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        // Move the record if it is still the one its key points at
+        switch (TypeOf(record))
+        {
+            case TorrentRecord:
+            {
+                Reader reader(PayloadOf(record));
+                auto const ordinal = FindOrdinal(DecodeHashes(reader));
+
+                if (ordinal != nullptr && m_torrents[*ordinal].segment == id && m_torrents[*ordinal].offset == offset)
+                {
+                    m_torrents[*ordinal] = Append(TorrentRecord, PayloadOf(record));
+                    moved += 1;
+                }
+            } break;
+        }
+
+        offset += length;
+    }
+
+    // The moved records must be on disk before the only other copy goes
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        Flush();
+        Sync();
+
+        ::close(m_segments.at(id).fd);
+        m_segments.erase(id);
+    }
+
+    fs::remove(SegmentPath(m_directory, id));
+
+    BOOST_LOG_TRIVIAL(info)
+        << "Compacted segment " << id << ": moved " << moved << " record(s), "
+        << "reclaimed " << size / 1024 << " KiB";
+}
+
+const std::uint32_t* LogStorage::FindOrdinal(const lt::info_hash_t& hash)
+{
+    if (hash.has_v1())
+    {
+        auto const it = m_keys.find(KeyOf(hash.v1));
+        if (it != m_keys.end()) { return &it->second; }
+    }
+
+    if (hash.has_v2())
+    {
+        auto const it = m_keys.find(KeyOf(hash.v2));
+        if (it != m_keys.end()) { return &it->second; }
+    }
+
+    return nullptr;
+}
+
+void LogStorage::Flush()
+{
+    if (m_memtable.empty()) { return; }
+
+    HAMSTER_TRACE_SPAN("LogStorage::Flush");
+
+    auto& segment = m_segments.at(m_active);
+    std::size_t written = 0;
+
+    while (written < m_memtable.size())
+    {
+        auto const res = ::write(segment.fd, m_memtable.data() + written, m_memtable.size() - written);
+
+        if (res < 0 && errno == EINTR) { continue; }
+
+        if (res < 0)
+        {
+            // Keep the locations of the records still in the memtable valid
+            segment.size += written;
+            m_memtable.erase(0, written);
+
+            throw IoError("Failed to write segment " + std::to_string(m_active));
+        }
+
+        written += static_cast<std::size_t>(res);
+    }
+
+    segment.size += written;
+    m_memtable.clear();
+
+    if (segment.size >= m_segmentSize)
+    {
+        Sync();
+        OpenSegment(m_active + 1);
+    }
+}
+
+void LogStorage::Index(
+    const lt::info_hash_t& hash,
+    const Location& location,
+    const MinHash::Signature& signature)
+{
+    auto const ordinal = static_cast<std::uint32_t>(m_torrents.size());
+
+    m_torrents.push_back(location);
+    AddKeys(hash, ordinal);
+
+    auto const bands = MinHash::ComputeBands(signature);
+
+    for (int band = 0; band < MinHash::NumBands; band++)
+    {
+        m_buckets.emplace(BucketKey(band, bands[band]), ordinal);
+    }
+}
+
+void LogStorage::OpenSegment(std::uint32_t id)
+{
+    auto const path = SegmentPath(m_directory, id);
+    int const fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd < 0) { throw IoError("Failed to create " + path); }
+
+    m_segments[id] = Segment{ fd, 0, 0, false };
+    m_active = id;
+}
+
+std::string LogStorage::Read(const Location& location)
+{
+    std::string record(location.length, '\0');
+    auto const& segment = m_segments.at(location.segment);
+
+    if (location.segment == m_active && location.offset >= segment.size)
+    {
+        m_memtable.copy(record.data(), record.size(), location.offset - segment.size);
+    }
+    else
+    {
+        ReadAt(segment.fd, record.data(), record.size(), location.offset);
+    }
+
+    return record;
+}
+
+bool LogStorage::Replay(std::uint32_t segment, std::uint64_t offset, std::string_view record)
+{
+    auto const sequence = SequenceOf(record);
+    Location const location{ segment, static_cast<std::uint32_t>(record.size()), offset };
+
+    m_sequence = std::max(m_sequence, sequence);
+
+    switch (TypeOf(record))
+    {
+        case TorrentRecord:
+        {
+            DecodedTorrent decoded;
+            if (!DecodeTorrent(PayloadOf(record), decoded)) { return false; }
+
+            if (auto const found = FindOrdinal(decoded.torrent.infoHashes))
+            {
+                auto const ordinal = *found;
+
+                // A later record of a torrent which completes its hashes
+                // supersedes the earlier one. Anything else is a copy
+                // compaction made before crashing.
+                if (AddKeys(decoded.torrent.infoHashes, ordinal))
+                {
+                    m_segments.at(m_torrents[ordinal].segment).live -= m_torrents[ordinal].length;
+                    m_torrents[ordinal] = location;
+                    m_segments.at(segment).live += record.size();
+                }
+
+                return true;
+            }
+
+            Index(decoded.torrent.infoHashes, location, decoded.signature);
+            m_segments.at(segment).live += record.size();
+        } return true;
+
+        default:
+            return false;
+    }
+}
+
+void LogStorage::Run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (!m_stop)
+    {
+        m_cv.wait_for(lock, flushInterval, [this] { return m_stop; });
+        if (m_stop) { break; }
+
+        try
+        {
+            Flush();
+        }
+        catch (const std::exception& ex)
+        {
+            BOOST_LOG_TRIVIAL(error) << "Failed to write the memtable out: " << ex.what();
+        }
+
+        // Compact the sealed segment holding the smallest share of live records
+        std::optional<std::uint32_t> candidate;
+        double lowest = compactionThreshold;
+
+        for (auto const& [id, segment] : m_segments)
+        {
+            if (id == m_active || segment.corrupt) { continue; }
+
+            double const ratio = segment.size > 0
+                ? static_cast<double>(segment.live) / static_cast<double>(segment.size)
+                : 0.0;
+
+            if (ratio < lowest)
+            {
+                lowest = ratio;
+                candidate = id;
+            }
+        }
+
+        if (!candidate) { continue; }
+
+        lock.unlock();
+
+        try
+        {
+            Compact(*candidate);
+            lock.lock();
+        }
+        catch (const std::exception& ex)
+        {
+            BOOST_LOG_TRIVIAL(error) << "Failed to compact segment " << *candidate << ": " << ex.what();
+
+            // Leave it alone rather than failing again every second
+            lock.lock();
+            m_segments.at(*candidate).corrupt = true;
+        }
+    }
+}
+
+void LogStorage::Sync()
+{
+    HAMSTER_TRACE_SPAN("LogStorage::Sync");
+
+    if (::fdatasync(m_segments.at(m_active).fd) != 0)
+    {
+        throw IoError("Failed to sync segment " + std::to_string(m_active));
+    }
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "minhash.hpp"
+#include "storage.hpp"
+
+namespace hamster
+{
+    // A log-structured store tuned for what the indexer does most: append a
+    // steady stream of torrents which are never updated, and look up info
+    // hashes which mostly are not indexed yet.
+    //
+    // Records are appended to the active segment file through an in-memory
+    // memtable, which is written out once it fills up, on Commit, or after a
+    // second at the latest. The location of every record is kept in memory,
+    // so looking up a missing hash never touches the disk and reading a
+    // torrent takes a single read. Segments are sealed once they are full,
+    // and a background thread compacts sealed segments which mostly hold
+    // superseded records by moving their live records to the active segment.
+    //
+    // Writes outside of a batch are not synced to disk until the segment is
+    // sealed, so a host crash loses up to a second of them.
+    class LogStorage : public Storage
+    {
+    public:
+        explicit LogStorage(
+            const std::string& directory,
+            std::uint64_t segmentSize = 64 * 1024 * 1024);
+        ~LogStorage() noexcept override;
+
+        void Begin() override;
+        void Commit() override;
+        void Checkpoint() override;
+
+        Models::Torrent::Match Exists(const lt::info_hash_t& hash) override;
+
+        std::vector<Models::TorrentSignature::Match> FindSimilar(
+            const lt::info_hash_t& hash,
+            std::size_t limit) override;
+
+        std::optional<Models::Torrent> GetTorrent(const lt::info_hash_t& hash) override;
+        bool InsertTorrent(const lt::torrent_info& torrentInfo) override;
+        std::uint64_t MemoryUsage() override;
+        void ScanTorrents(const std::function<void(const Models::Torrent&)>& callback) override;
+
+    private:
+        struct Key
+        {
+            std::array<std::uint8_t, 32> bytes{};
+            bool v2 = false;
+
+            bool operator==(const Key& other) const = default;
+        };
+
+        struct KeyHash
+        {
+            std::size_t operator()(const Key& key) const;
+        };
+
+        struct Location
+        {
+            std::uint32_t segment;
+            std::uint32_t length;
+            std::uint64_t offset;
+        };
+
+        struct Segment
+        {
+            int fd;
+            std::uint64_t size;
+            std::uint64_t live;
+            bool corrupt;
+        };
+
+        static Key KeyOf(const lt::sha1_hash& hash);
+        static Key KeyOf(const lt::sha256_hash& hash);
+        static std::vector<Key> KeysOf(const lt::info_hash_t& hash);
+
+        // Points the keys of the hash which are not taken yet at the ordinal.
+        // Returns true if any was added.
+        bool AddKeys(const lt::info_hash_t& hash, std::uint32_t ordinal);
+        Location Append(std::uint8_t type, std::string_view payload);
+        void Compact(std::uint32_t id);
+        const std::uint32_t* FindOrdinal(const lt::info_hash_t& hash);
+        void Flush();
+        void Index(const lt::info_hash_t& hash, const Location& location, const MinHash::Signature& signature);
+        void OpenSegment(std::uint32_t id);
+        std::string Read(const Location& location);
+        bool Replay(std::uint32_t segment, std::uint64_t offset, std::string_view record);
+        void Run();
+        void Sync();
+
+        std::string m_directory;
+        std::uint64_t m_segmentSize;
+
+        std::mutex m_mutex;
+        std::map<std::uint32_t, Segment> m_segments;
+        std::uint32_t m_active;
+        std::string m_memtable;
+        std::uint64_t m_sequence;
+
+        // Torrents have one key per hash, plus one for the truncated v2 hash,
+        // all pointing at the same ordinal. The truncated v2 keys are also
+        // kept apart, like the alias table of the SQLite engine. The LSH
+        // buckets are keyed by the band in the upper and the bucket truncated
+        // to 32 bits in the lower half, which lets through some false
+        // candidates.
+        std::unordered_map<Key, std::uint32_t, KeyHash> m_keys;
+        std::unordered_set<Key, KeyHash> m_aliases;
+        std::vector<Location> m_torrents;
+        std::unordered_multimap<std::uint64_t, std::uint32_t> m_buckets;
+
+        std::condition_variable m_cv;
+        bool m_stop;
+        std::thread m_thread;
+    };
+}
@@ -1,51 +1,354 @@
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+
 #include <boost/asio.hpp>
 #include <boost/asio/signal_set.hpp>
-#include <boost/log/expressions.hpp>
 #include <boost/log/trivial.hpp>
+#include <nlohmann/json.hpp>
 
 #include <sqlite3.h>
 
+#include "control.hpp"
 #include "database.hpp"
+#include "fetchjournal.hpp"
+#include "importer.hpp"
 #include "indexer.hpp"
+#include "logging.hpp"
+#include "logstorage.hpp"
+#include "maintenance.hpp"
 #include "migrator.hpp"
+#include "models/infohash.hpp"
 #include "options.hpp"
+#include "seenset.hpp"
+#include "sqlitestorage.hpp"
+
+static int SendCommand(const std::shared_ptr<hamster::Options>& opts, const std::string& command)
+{
+    try
+    {
+        auto const response = hamster::ControlClient::Send(opts->ControlSocket(), command);
+        std::cout << response << std::endl;
+
+        return nlohmann::json::parse(response).value("status", "") == "ok" ? 0 : 1;
+    }
+    catch (const std::exception& ex)
+    {
+        std::cerr << "Failed to query " << opts->ControlSocket() << ": " << ex.what() << std::endl;
+        return -1;
+    }
+}
+
+static int Resolve(const std::shared_ptr<hamster::Options>& opts)
+{
+    auto const& args = opts->CommandArgs();
+
+    if (args.empty() || args.size() > 2)
+    {
+        std::cerr << "Usage: hamster resolve <info hash or magnet link> [timeout in seconds]" << std::endl;
+        return -1;
+    }
+
+    std::string command = "resolve " + args[0];
+    if (args.size() > 1) { command += " " + args[1]; }
+
+    return SendCommand(opts, command);
+}
+
+static int Similar(const std::shared_ptr<hamster::Options>& opts)
+{
+    auto const& args = opts->CommandArgs();
+
+    if (args.empty() || args.size() > 2)
+    {
+        std::cerr << "Usage: hamster similar <info hash or magnet link> [limit]" << std::endl;
+        return -1;
+    }
+
+    std::string command = "similar " + args[0];
+    if (args.size() > 1) { command += " " + args[1]; }
+
+    return SendCommand(opts, command);
+}
+
+static int Trace(const std::shared_ptr<hamster::Options>& opts)
+{
+    auto const& args = opts->CommandArgs();
+
+    if (args.size() != 1)
+    {
+        std::cerr << "Usage: hamster trace <output file>" << std::endl;
+        return -1;
+    }
+
+    // The indexer writes the file, from a working directory of its own
+    return SendCommand(opts, "trace " + std::filesystem::absolute(args[0]).string());
+}
+
+static int Import(const std::shared_ptr<hamster::Options>& opts, hamster::Storage& storage)
+{
+    auto const& args = opts->CommandArgs();
+
+    if (args.empty())
+    {
+        std::cerr << "Usage: hamster import <file or directory> [...]" << std::endl;
+        return -1;
+    }
+
+    hamster::Importer importer(storage, opts->ImportThreads());
+
+    // Info hashes without metadata go to the fetch queue of the process
+    // serving the control socket.
+    auto const stats = importer.Run(
+        args,
+        [&](const std::vector<lt::info_hash_t>& hashes)
+        {
+            std::string command = "fetch";
+
+            for (auto const& ih : hashes)
+            {
+                command += " ";
+                command += ih.has_v1()
+                    ? hamster::Models::InfoHashString(ih.v1)
+                    : hamster::Models::InfoHashString(ih.v2);
+            }
+
+            try
+            {
+                hamster::ControlClient::Send(opts->ControlSocket(), command);
+            }
+            catch (const std::exception& ex)
+            {
+                BOOST_LOG_TRIVIAL(warning)
+                    << "Failed to queue " << hashes.size() << " info hash(es) through "
+                    << opts->ControlSocket() << ": " << ex.what();
+            }
+        });
+
+    return stats.failed > 0 ? 1 : 0;
+}
 
 int main(int argc, char* argv[])
 {
     auto const opts = hamster::Options::Parse(argc, argv);
 
-    boost::log::core::get()->set_filter(
-        boost::log::trivial::severity >= opts->LogLevel());
+    if (opts->Command() == "resolve")
+    {
+        return Resolve(opts);
+    }
+
+    if (opts->Command() == "similar")
+    {
+        return Similar(opts);
+    }
+
+    if (opts->Command() == "stats")
+    {
+        return SendCommand(opts, "stats");
+    }
+
+    if (opts->Command() == "trace")
+    {
+        return Trace(opts);
+    }
+
+    if (!opts->Command().empty() && opts->Command() != "import")
+    {
+        std::cerr << "Unknown command: " << opts->Command() << std::endl;
+        return -1;
+    }
+
+    if (opts->StorageEngine() != "sqlite" && opts->StorageEngine() != "log")
+    {
+        std::cerr << "Unknown storage engine: " << opts->StorageEngine() << std::endl;
+        return -1;
+    }
+
+    if (opts->ReputationMode() != "enforce" && opts->ReputationMode() != "observe")
+    {
+        std::cerr << "Unknown reputation mode: " << opts->ReputationMode() << std::endl;
+        return -1;
+    }
+
+    hamster::Logging::Setup(opts->LogLevel());
+    hamster::Logging::SetRateLimit(opts->LogRateLimit());
 
     BOOST_LOG_TRIVIAL(info) << "Hamster";
     BOOST_LOG_TRIVIAL(info) << "- Database: " << (opts->DbFile() == ":memory:" ? "(in-memory)" : opts->DbFile());
+    BOOST_LOG_TRIVIAL(info) << "- Storage engine: " << opts->StorageEngine();
 
-    sqlite3* db = hamster::OpenDatabase(opts->DbFile());
+    std::unique_ptr<hamster::Storage> storage;
+    std::unique_ptr<hamster::DatabaseMaintenance> maintenance;
 
-    if (!hamster::MigrateDatabase(db))
+    if (opts->StorageEngine() == "log")
     {
-        BOOST_LOG_TRIVIAL(fatal)
-            << "Failed to migrate database: "
-            << sqlite3_errmsg(db)
-            << ". Exiting...";
-        return -1;
+        storage = std::make_unique<hamster::LogStorage>(opts->DbFile());
+    }
+    else
+    {
+        sqlite3* db = hamster::OpenDatabase(opts->DbFile());
+
+        if (!hamster::MigrateDatabase(db))
+        {
+            BOOST_LOG_TRIVIAL(fatal)
+                << "Failed to migrate database: "
+                << sqlite3_errmsg(db)
+                << ". Exiting...";
+            hamster::Logging::Shutdown();
+            return -1;
+        }
+
+        // A second connection to an in-memory database would see a database
+        // of its own, so leave those to SQLite's automatic checkpoints.
+        if (opts->DbFile() != ":memory:" && opts->WalCheckpointInterval().count() > 0)
+        {
+            // Two checkpointers would contend for the WAL, so only start
+            // ours once SQLite's own is off
+            if (sqlite3_exec(db, "PRAGMA wal_autocheckpoint=0;", nullptr, nullptr, nullptr) != SQLITE_OK)
+            {
+                BOOST_LOG_TRIVIAL(warning)
+                    << "Failed to disable automatic WAL checkpoints, leaving checkpoints to SQLite: "
+                    << sqlite3_errmsg(db);
+            }
+            else
+            {
+                maintenance = std::make_unique<hamster::DatabaseMaintenance>(
+                    opts->DbFile(),
+                    opts->WalCheckpointInterval(),
+                    opts->WalSizeLimit());
+            }
+        }
+
+        storage = std::make_unique<hamster::SqliteStorage>(db);
+    }
+
+    if (opts->Command() == "import")
+    {
+        int res = Import(opts, *storage);
+
+        maintenance.reset();
+        storage.reset();
+        hamster::Logging::Shutdown();
+
+        return res;
+    }
+
+    std::unique_ptr<hamster::SharedSeenSet> seen;
+
+    if (!opts->SharedMemoryName().empty())
+    {
+        seen = hamster::SharedSeenSet::Open(
+            opts->SharedMemoryName(),
+            opts->SharedMemoryCapacity(),
+            std::chrono::minutes(10));
+
+        BOOST_LOG_TRIVIAL(info)
+            << "- Shared seen-set: " << opts->SharedMemoryName()
+            << " (" << seen->Capacity() << " slots)";
     }
 
     boost::asio::io_context io;
     boost::asio::signal_set signals(io, SIGINT, SIGTERM);
 
-    signals.async_wait(
-        [&](boost::system::error_code ec, int signal)
+    // Outlives the indexer, which writes to it until destroyed, and is
+    // outlived by the io_context its replay posts to
+    std::unique_ptr<hamster::FetchJournal> journal;
+
+    if (!opts->FetchJournalFile().empty())
+    {
+        journal = std::make_unique<hamster::FetchJournal>(opts->FetchJournalFile());
+        BOOST_LOG_TRIVIAL(info) << "- Fetch journal: " << opts->FetchJournalFile();
+    }
+
+    auto indexer = std::make_unique<hamster::LibtorrentIndexer>(io, *storage, opts, seen.get(), journal.get());
+
+    std::unique_ptr<hamster::ControlServer> control;
+
+    if (!opts->ControlSocket().empty())
+    {
+        try
+        {
+            control = std::make_unique<hamster::ControlServer>(io, opts->ControlSocket(), *indexer);
+        }
+        catch (const std::exception& ex)
+        {
+            BOOST_LOG_TRIVIAL(fatal) << "Failed to open control socket: " << ex.what() << ". Exiting...";
+
+            indexer.reset();
+            journal.reset();
+            maintenance.reset();
+            storage.reset();
+            hamster::Logging::Shutdown();
+
+            return -1;
+        }
+
+        BOOST_LOG_TRIVIAL(info) << "- Control socket: " << opts->ControlSocket();
+    }
+
+    std::optional<std::chrono::steady_clock::time_point> shutdownStarted;
+
+    boost::asio::co_spawn(
+        io,
+        [&]() -> boost::asio::awaitable<void>
         {
+            boost::system::error_code ec;
+            int const signal = co_await signals.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+            if (ec) { co_return; }
+
             BOOST_LOG_TRIVIAL(info) << "Interrupt (" << signal << ") received - shutting down...";
-            io.stop();
-        });
+            shutdownStarted = std::chrono::steady_clock::now();
+
+            signals.async_wait(
+                [&](boost::system::error_code error, int)
+                {
+                    if (error) { return; }
 
-    hamster::LibtorrentIndexer indexer(io, db);
+                    BOOST_LOG_TRIVIAL(warning) << "Interrupted again - exiting without draining";
+                    io.stop();
+                });
+
+            co_await indexer->Drain(opts->ShutdownTimeout());
+            io.stop();
+        },
+        boost::asio::detached);
 
     io.run();
 
-    sqlite3_close(db);
+    // The libtorrent session is shut down by Drain already, within the
+    // shutdown timeout, or left to shut down on a thread of its own
+    bool const sessionShuttingDown = indexer->SessionShuttingDown();
+
+    control.reset();
+    indexer.reset();
+    journal.reset();
+    maintenance.reset();
+    storage.reset();
+
+    if (shutdownStarted)
+    {
+        BOOST_LOG_TRIVIAL(info)
+            << "Shut down in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - *shutdownStarted).count()
+            << " ms";
+    }
+
+    if (auto const dropped = hamster::Logging::Dropped(); dropped > 0)
+    {
+        BOOST_LOG_TRIVIAL(warning) << "Dropped " << dropped << " log record(s)";
+    }
+
+    hamster::Logging::Shutdown();
+
+    // Everything of ours is written out, and the static destructors must not
+    // run under libtorrent
+    if (sessionShuttingDown)
+    {
+        std::_Exit(0);
+    }
 
     return 0;
 }
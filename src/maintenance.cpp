@@ -0,0 +1,211 @@
+#include "maintenance.hpp"
+
+#include <algorithm>
+#include <filesystem>
+
+#include <boost/log/trivial.hpp>
+
+#include "database.hpp"
+
+namespace fs = std::filesystem;
+using hamster::DatabaseMaintenance;
+
+static const int vacuumSlicePages = 256;
+static const std::chrono::milliseconds vacuumBudget = std::chrono::milliseconds(100);
+static const std::chrono::minutes reportInterval = std::chrono::minutes(1);
+
+static const char* ModeName(int mode)
+{
+    switch (mode)
+    {
+        case SQLITE_CHECKPOINT_PASSIVE: return "passive";
+        case SQLITE_CHECKPOINT_RESTART: return "restart";
+        case SQLITE_CHECKPOINT_TRUNCATE: return "truncate";
+        default: return "unknown";
+    }
+}
+
+static std::int64_t PragmaInt(sqlite3* db, const char* sql)
+{
+    std::int64_t value = -1;
+
+    sqlite3_exec(
+        db,
+        sql,
+        [](void* user, int, char** values, char**)
+        {
+            if (values[0] != nullptr) { *static_cast<std::int64_t*>(user) = std::stoll(values[0]); }
+            return SQLITE_OK;
+        },
+        &value,
+        nullptr);
+
+    return value;
+}
+
+DatabaseMaintenance::DatabaseMaintenance(
+    const std::string& file,
+    std::chrono::seconds interval,
+    std::uintmax_t walSizeLimit)
+    : m_db(hamster::OpenDatabase(file)),
+      m_walFile(file + "-wal"),
+      m_interval(interval),
+      m_walSizeLimit(walSizeLimit),
+      m_dataVersion(-1),
+      m_lastReport(std::chrono::steady_clock::now()),
+      m_maxWalSize(0),
+      m_checkpoints(0),
+      m_framesCheckpointed(0),
+      m_checkpointTime(0),
+      m_maxCheckpointTime(0),
+      m_pagesVacuumed(0),
+      m_incrementalVacuum(false),
+      m_stop(false)
+{
+    // Databases created before incremental auto_vacuum have nothing to
+    // reclaim incrementally until they are converted
+    m_incrementalVacuum = PragmaInt(m_db, "PRAGMA auto_vacuum;") == 2;
+
+    m_thread = std::thread([this] { Run(); });
+}
+
+DatabaseMaintenance::~DatabaseMaintenance() noexcept
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+
+    m_cv.notify_all();
+    m_thread.join();
+
+    sqlite3_close(m_db);
+}
+
+void DatabaseMaintenance::Checkpoint(std::uintmax_t walSize)
+{
+    // Escalate from a passive checkpoint, which never blocks the writer, to
+    // restarting the WAL from its beginning and, when it has grown far past
+    // the limit, truncating it.
+    int mode = SQLITE_CHECKPOINT_PASSIVE;
+
+    if (walSize > m_walSizeLimit * 2) { mode = SQLITE_CHECKPOINT_TRUNCATE; }
+    else if (walSize > m_walSizeLimit) { mode = SQLITE_CHECKPOINT_RESTART; }
+
+    int frames = 0;
+    int checkpointed = 0;
+
+    auto const started = std::chrono::steady_clock::now();
+    int res = sqlite3_wal_checkpoint_v2(m_db, nullptr, mode, &frames, &checkpointed);
+    auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+
+    if (res == SQLITE_BUSY)
+    {
+        BOOST_LOG_TRIVIAL(warning)
+            << "WAL checkpoint (" << ModeName(mode) << ") blocked by a reader, WAL is "
+            << walSize / 1024 << " KiB";
+        return;
+    }
+
+    if (res != SQLITE_OK)
+    {
+        BOOST_LOG_TRIVIAL(error) << "WAL checkpoint failed: " << sqlite3_errmsg(m_db);
+        return;
+    }
+
+    m_checkpoints += 1;
+    m_framesCheckpointed += std::max(checkpointed, 0);
+    m_checkpointTime += elapsed;
+    m_maxCheckpointTime = std::max(m_maxCheckpointTime, elapsed);
+
+    if (mode != SQLITE_CHECKPOINT_PASSIVE)
+    {
+        BOOST_LOG_TRIVIAL(info)
+            << "WAL at " << walSize / 1024 << " KiB, ran " << ModeName(mode)
+            << " checkpoint in " << elapsed.count() << " ms";
+    }
+}
+
+bool DatabaseMaintenance::IsIdle()
+{
+    // data_version changes whenever another connection commits.
+    auto const version = PragmaInt(m_db, "PRAGMA data_version;");
+    bool const idle = version == m_dataVersion;
+
+    m_dataVersion = version;
+
+    return idle;
+}
+
+void DatabaseMaintenance::Report(std::uintmax_t walSize)
+{
+    auto const now = std::chrono::steady_clock::now();
+
+    m_maxWalSize = std::max(m_maxWalSize, walSize);
+
+    if (now - m_lastReport < reportInterval) { return; }
+
+    BOOST_LOG_TRIVIAL(info)
+        << "Database maintenance: WAL " << walSize / 1024 << " KiB (max " << m_maxWalSize / 1024 << " KiB), "
+        << m_checkpoints << " checkpoint(s) of " << m_framesCheckpointed << " frame(s) taking "
+        << m_checkpointTime.count() << " ms (max " << m_maxCheckpointTime.count() << " ms), "
+        << m_pagesVacuumed << " page(s) vacuumed";
+
+    m_lastReport = now;
+    m_maxWalSize = 0;
+    m_checkpoints = 0;
+    m_framesCheckpointed = 0;
+    m_checkpointTime = std::chrono::milliseconds(0);
+    m_maxCheckpointTime = std::chrono::milliseconds(0);
+    m_pagesVacuumed = 0;
+}
+
+void DatabaseMaintenance::Run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (!m_cv.wait_for(lock, m_interval, [this] { return m_stop; }))
+    {
+        lock.unlock();
+
+        std::error_code ec;
+        auto walSize = fs::file_size(m_walFile, ec);
+        if (ec) { walSize = 0; }
+
+        Checkpoint(walSize);
+
+        if (m_incrementalVacuum && IsIdle())
+        {
+            Vacuum();
+        }
+
+        Report(walSize);
+
+        lock.lock();
+    }
+}
+
+void DatabaseMaintenance::Vacuum()
+{
+    static const std::string slice = "PRAGMA incremental_vacuum(" + std::to_string(vacuumSlicePages) + ");";
+
+    auto const started = std::chrono::steady_clock::now();
+
+    // Free pages in small slices, and stop as soon as the writer is active
+    // again so it does not have to wait for us.
+    while (std::chrono::steady_clock::now() - started < vacuumBudget)
+    {
+        auto const freePages = PragmaInt(m_db, "PRAGMA freelist_count;");
+        if (freePages <= 0) { break; }
+
+        if (sqlite3_exec(m_db, slice.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+        {
+            BOOST_LOG_TRIVIAL(warning) << "Incremental vacuum failed: " << sqlite3_errmsg(m_db);
+            break;
+        }
+
+        m_pagesVacuumed += std::min<std::int64_t>(freePages, vacuumSlicePages);
+
+        if (!IsIdle()) { break; }
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <sqlite3.h>
+
+namespace hamster
+{
+    // Checkpoints the WAL and reclaims free pages on a connection and thread
+    // of its own, so the ingest path never stalls on an auto-checkpoint.
+    class DatabaseMaintenance
+    {
+    public:
+        DatabaseMaintenance(
+            const std::string& file,
+            std::chrono::seconds interval,
+            std::uintmax_t walSizeLimit);
+        ~DatabaseMaintenance() noexcept;
+
+    private:
+        void Checkpoint(std::uintmax_t walSize);
+        bool IsIdle();
+        void Report(std::uintmax_t walSize);
+        void Run();
+        void Vacuum();
+
+        sqlite3* m_db;
+        std::string m_walFile;
+        std::chrono::seconds m_interval;
+        std::uintmax_t m_walSizeLimit;
+        std::int64_t m_dataVersion;
+
+        std::chrono::steady_clock::time_point m_lastReport;
+        std::uintmax_t m_maxWalSize;
+        int m_checkpoints;
+        int m_framesCheckpointed;
+        std::chrono::milliseconds m_checkpointTime;
+        std::chrono::milliseconds m_maxCheckpointTime;
+        std::int64_t m_pagesVacuumed;
+        bool m_incrementalVacuum;
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_stop;
+        std::thread m_thread;
+    };
+}
@@ -0,0 +1,116 @@
+#include "memorybudget.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+
+#include <unistd.h>
+
+using hamster::MemoryBudget;
+
+static const double elevatedThreshold = 0.70;
+static const double highThreshold = 0.85;
+static const double criticalThreshold = 0.95;
+static const double hysteresis = 0.05;
+
+static MemoryBudget::Pressure LevelFor(double usage)
+{
+    if (usage >= criticalThreshold) { return MemoryBudget::Pressure::Critical; }
+    if (usage >= highThreshold) { return MemoryBudget::Pressure::High; }
+    if (usage >= elevatedThreshold) { return MemoryBudget::Pressure::Elevated; }
+
+    return MemoryBudget::Pressure::Normal;
+}
+
+static std::uint64_t MiB(std::uint64_t bytes)
+{
+    return bytes / (1024 * 1024);
+}
+
+MemoryBudget::MemoryBudget(std::uint64_t limit)
+    : m_limit(limit),
+      m_consumers{},
+      m_resident(0),
+      m_pressure(Pressure::Normal)
+{
+}
+
+std::uint64_t MemoryBudget::Accounted() const
+{
+    return std::accumulate(m_consumers.begin(), m_consumers.end(), std::uint64_t(0));
+}
+
+void MemoryBudget::Set(Consumer consumer, std::uint64_t bytes)
+{
+    m_consumers[static_cast<std::size_t>(consumer)] = bytes;
+}
+
+MemoryBudget::Pressure MemoryBudget::Update()
+{
+    m_resident = ResidentSetSize();
+
+    if (m_limit == 0)
+    {
+        return m_pressure;
+    }
+
+    auto const usage = static_cast<double>(std::max(Accounted(), m_resident)) / static_cast<double>(m_limit);
+    auto const level = LevelFor(usage);
+
+    m_pressure = level >= m_pressure
+        ? level
+        : std::max(level, LevelFor(usage + hysteresis));
+
+    return m_pressure;
+}
+
+const char* MemoryBudget::Name(Pressure pressure)
+{
+    switch (pressure)
+    {
+        case Pressure::Normal: return "normal";
+        case Pressure::Elevated: return "elevated";
+        case Pressure::High: return "high";
+        case Pressure::Critical: return "critical";
+        default: return "unknown";
+    }
+}
+
+std::uint64_t MemoryBudget::ResidentSetSize()
+{
+    // The second field is the number of resident pages
+    std::ifstream statm("/proc/self/statm");
+    std::uint64_t size = 0;
+    std::uint64_t resident = 0;
+
+    if (!(statm >> size >> resident))
+    {
+        return 0;
+    }
+
+    return resident * static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+}
+
+std::ostream& hamster::operator<<(std::ostream& stream, const MemoryBudget& budget)
+{
+    auto const& consumers = budget.m_consumers;
+
+    stream
+        << MiB(budget.Accounted()) << " MiB accounted ("
+        << "fetches " << MiB(consumers[static_cast<std::size_t>(MemoryBudget::Consumer::ActiveFetches)]) << ", "
+        << "nodes " << MiB(consumers[static_cast<std::size_t>(MemoryBudget::Consumer::Nodes)]) << ", "
+        << "seen " << MiB(consumers[static_cast<std::size_t>(MemoryBudget::Consumer::SeenHashes)]) << ", "
+        << "queue " << MiB(consumers[static_cast<std::size_t>(MemoryBudget::Consumer::FetchQueue)]) << ", "
+        << "storage " << MiB(consumers[static_cast<std::size_t>(MemoryBudget::Consumer::Storage)]) << ", "
+        << "reputation " << MiB(consumers[static_cast<std::size_t>(MemoryBudget::Consumer::Reputation)]) << ", "
+        << "pending writes " << MiB(consumers[static_cast<std::size_t>(MemoryBudget::Consumer::PendingWrites)]) << ", "
+        << "alerts " << MiB(consumers[static_cast<std::size_t>(MemoryBudget::Consumer::Alerts)]) << "), "
+        << MiB(budget.Resident()) << " MiB resident";
+
+    if (budget.Limit() > 0)
+    {
+        stream << " of a " << MiB(budget.Limit()) << " MiB budget";
+    }
+
+    return stream;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+namespace hamster
+{
+    // Tracks estimates of the memory held by the main consumers of the
+    // indexer, and turns them into a pressure level for the indexer to back
+    // off on. The estimates are cross-checked against the resident set size,
+    // which also covers what they miss (libtorrent internals, fragmentation).
+    class MemoryBudget
+    {
+    public:
+        enum class Consumer
+        {
+            ActiveFetches,
+            Nodes,
+            SeenHashes,
+            FetchQueue,
+            Storage,
+            Reputation,
+            // Journal records waiting for the next flush
+            PendingWrites,
+            // The alerts libtorrent queued since the last time they were
+            // popped
+            Alerts
+        };
+
+        static constexpr std::size_t NumConsumers = 8;
+
+        enum class Pressure
+        {
+            // Below 70% of the budget
+            Normal,
+            // Above 70% - slow down
+            Elevated,
+            // Above 85% - stop taking on new work and shrink caches
+            High,
+            // Above 95% - drop work in progress
+            Critical
+        };
+
+        // A limit of 0 disables the budget, which then always reports normal
+        // pressure.
+        explicit MemoryBudget(std::uint64_t limit);
+
+        std::uint64_t Accounted() const;
+        std::uint64_t Limit() const { return m_limit; }
+        Pressure Current() const { return m_pressure; }
+        std::uint64_t Resident() const { return m_resident; }
+
+        void Set(Consumer consumer, std::uint64_t bytes);
+
+        // Samples the resident set size and recomputes the pressure level. A
+        // level is only left once usage drops a margin below it, so the
+        // indexer does not flap between levels.
+        Pressure Update();
+
+        static const char* Name(Pressure pressure);
+
+        // The resident set size of this process, or 0 if it is unknown.
+        static std::uint64_t ResidentSetSize();
+
+    private:
+        friend std::ostream& operator<<(std::ostream& stream, const MemoryBudget& budget);
+
+        std::uint64_t m_limit;
+        std::array<std::uint64_t, NumConsumers> m_consumers;
+        std::uint64_t m_resident;
+        Pressure m_pressure;
+    };
+
+    // Writes a breakdown of the accounted memory
+    std::ostream& operator<<(std::ostream& stream, const MemoryBudget& budget);
+}
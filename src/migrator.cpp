@@ -4,6 +4,10 @@
 
 #include <boost/log/trivial.hpp>
 
+#include "database.hpp"
+#include "minhash.hpp"
+#include "models/torrentsignature.hpp"
+
 int Migration_0001_Init(sqlite3* db)
 {
     int res = sqlite3_exec(
@@ -91,14 +95,174 @@ int Migration_0002_RemoveUnnecessaryTables(sqlite3* db)
     return SQLITE_OK;
 }
 
-bool hamster::MigrateDatabase(sqlite3* db)
+int Migration_0003_IndexTorrentFiles(sqlite3* db)
+{
+    return sqlite3_exec(
+        db,
+        "CREATE INDEX IF NOT EXISTS idx_torrentfiles_torrent_id ON torrentfiles (torrent_id);",
+        nullptr,
+        nullptr,
+        nullptr);
+}
+
+int Migration_0004_IncrementalAutoVacuum(sqlite3* db)
+{
+    // OpenDatabase creates new databases with incremental auto_vacuum.
+    // Converting an existing one takes a full VACUUM, which rewrites the
+    // whole file, so that is left to the operator.
+    int mode = -1;
+    int res = sqlite3_exec(
+        db,
+        "PRAGMA auto_vacuum;",
+        [](void* user, int columns, char** values, char** names)
+        {
+            *static_cast<int*>(user) = std::stoi(values[0]);
+            return SQLITE_OK;
+        },
+        &mode,
+        nullptr);
+
+    if (res != SQLITE_OK) return res;
+
+    if (mode != 2)
+    {
+        BOOST_LOG_TRIVIAL(info)
+            << "The database does not reclaim free pages. Run "
+            << "'PRAGMA auto_vacuum=INCREMENTAL; VACUUM;' on it while Hamster is stopped to enable it.";
+    }
+
+    return SQLITE_OK;
+}
+
+// Throws a DatabaseException on failure, leaving it to MigrateDatabase to
+// roll back
+static void InsertTorrentSignatures(sqlite3* db)
 {
-    static std::vector<std::function<int(sqlite3*)>> migrations =
+    sqlite3_stmt* stmt = nullptr;
+    int res = sqlite3_prepare_v2(
+        db,
+        "SELECT torrent_id, path, size FROM torrentfiles ORDER BY torrent_id;",
+        -1,
+        &stmt,
+        nullptr);
+
+    if (res != SQLITE_OK) throw hamster::DatabaseException(db);
+
+    sqlite3_int64 current = -1;
+    std::vector<std::uint64_t> features;
+
+    try
+    {
+        while ((res = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            auto const id = sqlite3_column_int64(stmt, 0);
+
+            if (id != current && !features.empty())
+            {
+                hamster::Models::TorrentSignature::Insert(db, current, hamster::MinHash::Compute(features));
+                features.clear();
+            }
+
+            current = id;
+            features.push_back(
+                hamster::MinHash::Feature(
+                    reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)),
+                    sqlite3_column_int64(stmt, 2)));
+        }
+
+        if (res != SQLITE_DONE) throw hamster::DatabaseException(db);
+    }
+    catch (const hamster::DatabaseException&)
+    {
+        sqlite3_finalize(stmt);
+        throw;
+    }
+
+    sqlite3_finalize(stmt);
+
+    if (!features.empty())
     {
-        { &Migration_0001_Init },
-        { &Migration_0002_RemoveUnnecessaryTables }
-    };
+        hamster::Models::TorrentSignature::Insert(db, current, hamster::MinHash::Compute(features));
+    }
+}
+
+int Migration_0005_TorrentSignatures(sqlite3* db)
+{
+    int res = sqlite3_exec(
+        db,
+        "CREATE TABLE torrent_signatures ("
+        "   torrent_id INTEGER PRIMARY KEY REFERENCES torrents(id),"
+        "   signature BLOB NOT NULL"
+        ");",
+        nullptr,
+        nullptr,
+        nullptr);
 
+    if (res != SQLITE_OK) return res;
+
+    res = sqlite3_exec(
+        db,
+        "CREATE TABLE torrent_lsh ("
+        "   band INTEGER NOT NULL,"
+        "   bucket INTEGER NOT NULL,"
+        "   torrent_id INTEGER NOT NULL REFERENCES torrents(id),"
+        "   PRIMARY KEY (band, bucket, torrent_id)"
+        ") WITHOUT ROWID;",
+        nullptr,
+        nullptr,
+        nullptr);
+
+    if (res != SQLITE_OK) return res;
+
+    // Compute signatures for the torrents indexed so far
+    InsertTorrentSignatures(db);
+
+    return SQLITE_OK;
+}
+
+int Migration_0006_TorrentAliases(sqlite3* db)
+{
+    // v2 torrents are announced and sampled on the DHT by their v2 hash
+    // truncated to 20 bytes, which looks like a v1 hash. Map those to the
+    // torrent so they are not fetched again.
+    int res = sqlite3_exec(
+        db,
+        "CREATE TABLE torrent_aliases ("
+        "   info_hash TEXT PRIMARY KEY,"
+        "   torrent_id INTEGER NOT NULL REFERENCES torrents(id)"
+        ") WITHOUT ROWID;",
+        nullptr,
+        nullptr,
+        nullptr);
+
+    if (res != SQLITE_OK) return res;
+
+    return sqlite3_exec(
+        db,
+        "INSERT OR IGNORE INTO torrent_aliases (info_hash, torrent_id) "
+        "SELECT substr(info_hash_v2, 1, 40), id FROM torrents WHERE info_hash_v2 IS NOT NULL;",
+        nullptr,
+        nullptr,
+        nullptr);
+}
+
+static const std::vector<std::function<int(sqlite3*)>> migrations =
+{
+    { &Migration_0001_Init },
+    { &Migration_0002_RemoveUnnecessaryTables },
+    { &Migration_0003_IndexTorrentFiles },
+    { &Migration_0004_IncrementalAutoVacuum },
+    { &Migration_0005_TorrentSignatures },
+    { &Migration_0006_TorrentAliases }
+};
+
+bool hamster::MigrateDatabase(sqlite3* db)
+{
+    return MigrateDatabase(db, static_cast<int>(migrations.size()));
+}
+
+bool hamster::MigrateDatabase(sqlite3* db, int targetVersion)
+{
     // Get current user_version
     int userVersion = -1;
     int res = sqlite3_exec(
@@ -122,30 +286,48 @@ bool hamster::MigrateDatabase(sqlite3* db)
     BOOST_LOG_TRIVIAL(info)
         << "Database version is "
         << userVersion << ", running "
-        << migrations.size() - userVersion
+        << targetVersion - userVersion
         << " migration(s)";
 
-    for (int i = userVersion; i < migrations.size(); i++)
+    // Each migration commits along with the version it brings the database
+    // to, so a failed one leaves the database at the version before it, and
+    // runs again from there on the next start
+    for (int i = userVersion; i < targetVersion; i++)
     {
-        res = migrations[i](db);
-
-        if (res != SQLITE_OK)
+        if (sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr) != SQLITE_OK)
         {
-            BOOST_LOG_TRIVIAL(error) << "Failed to run migration #" << i << ": " << sqlite3_errmsg(db);
+            BOOST_LOG_TRIVIAL(error) << "Failed to begin migration #" << i << ": " << sqlite3_errmsg(db);
             return false;
         }
-    }
 
-    std::string setUserVersion = "PRAGMA user_version=" + std::to_string(migrations.size());
+        std::string const setUserVersion = "PRAGMA user_version=" + std::to_string(i + 1);
 
-    res = sqlite3_exec(
-        db,
-        setUserVersion.c_str(),
-        nullptr,
-        nullptr,
-        nullptr);
+        try
+        {
+            res = migrations[i](db);
+
+            if (res == SQLITE_OK)
+            {
+                res = sqlite3_exec(db, setUserVersion.c_str(), nullptr, nullptr, nullptr);
+            }
 
-    if (res != SQLITE_OK) { return false; }
+            if (res == SQLITE_OK)
+            {
+                res = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+            }
+
+            if (res != SQLITE_OK)
+            {
+                throw DatabaseException(db);
+            }
+        }
+        catch (const DatabaseException& ex)
+        {
+            BOOST_LOG_TRIVIAL(error) << "Failed to run migration #" << i << ": " << ex.what();
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+    }
 
     BOOST_LOG_TRIVIAL(info) << "Database migrated and up to date.";
 
@@ -5,4 +5,7 @@
 namespace hamster
 {
     bool MigrateDatabase(sqlite3* db);
+
+    // Runs the migrations up to the given schema version only
+    bool MigrateDatabase(sqlite3* db, int targetVersion);
 }
@@ -0,0 +1,119 @@
+#include "minhash.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <limits>
+
+using hamster::MinHash;
+
+namespace
+{
+    // Per-hash multipliers (odd) and seeds, generated once with splitmix64.
+    struct Permutations
+    {
+        Permutations()
+        {
+            std::uint64_t state = 0x9e3779b97f4a7c15;
+
+            for (int i = 0; i < MinHash::NumHashes; i++)
+            {
+                std::uint64_t z = (state += 0x9e3779b97f4a7c15);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+                z = z ^ (z >> 31);
+
+                multipliers[i] = static_cast<std::uint32_t>(z) | 1;
+                seeds[i] = static_cast<std::uint32_t>(z >> 32);
+            }
+        }
+
+        alignas(64) std::uint32_t multipliers[MinHash::NumHashes];
+        alignas(64) std::uint32_t seeds[MinHash::NumHashes];
+    };
+
+    const Permutations permutations;
+}
+
+std::uint64_t MinHash::Feature(std::string_view path, std::int64_t size)
+{
+    auto const slash = path.find_last_of("/\\");
+    auto const name = slash == std::string_view::npos ? path : path.substr(slash + 1);
+
+    // FNV-1a over the lower cased name, then the size
+    std::uint64_t hash = 0xcbf29ce484222325;
+
+    for (char c : name)
+    {
+        hash ^= static_cast<std::uint8_t>(std::tolower(static_cast<unsigned char>(c)));
+        hash *= 0x100000001b3;
+    }
+
+    hash ^= static_cast<std::uint64_t>(size);
+    hash *= 0x100000001b3;
+
+    return hash;
+}
+
+MinHash::Signature MinHash::Compute(const std::vector<std::uint64_t>& features)
+{
+    Signature signature;
+    signature.fill(std::numeric_limits<std::uint32_t>::max());
+
+    auto const* multipliers = permutations.multipliers;
+    auto const* seeds = permutations.seeds;
+
+    for (auto const feature : features)
+    {
+        auto const lo = static_cast<std::uint32_t>(feature);
+        auto const hi = static_cast<std::uint32_t>(feature >> 32);
+
+        // Fixed trip count and independent 32 bit lanes, which leaves the
+        // compiler free to vectorize this for whatever target it builds for.
+        for (int i = 0; i < NumHashes; i++)
+        {
+            std::uint32_t h = (lo * multipliers[i] + hi) ^ seeds[i];
+            h ^= h >> 16;
+            h *= 0x85ebca6b;
+            h ^= h >> 13;
+            h *= 0xc2b2ae35;
+            h ^= h >> 16;
+
+            signature[i] = std::min(signature[i], h);
+        }
+    }
+
+    return signature;
+}
+
+MinHash::Bands MinHash::ComputeBands(const Signature& signature)
+{
+    Bands bands;
+
+    for (int band = 0; band < NumBands; band++)
+    {
+        std::uint64_t hash = 0xcbf29ce484222325 ^ static_cast<std::uint64_t>(band);
+
+        for (int row = 0; row < RowsPerBand; row++)
+        {
+            hash ^= signature[band * RowsPerBand + row];
+            hash *= 0x100000001b3;
+            hash ^= hash >> 29;
+        }
+
+        bands[band] = static_cast<std::int64_t>(hash);
+    }
+
+    return bands;
+}
+
+double MinHash::Similarity(const Signature& lhs, const Signature& rhs)
+{
+    int equal = 0;
+
+    for (int i = 0; i < NumHashes; i++)
+    {
+        equal += lhs[i] == rhs[i] ? 1 : 0;
+    }
+
+    return static_cast<double>(equal) / NumHashes;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace hamster
+{
+    // MinHash signatures over the file lists of torrents, and the LSH band
+    // keys used to look up torrents with similar file lists.
+    class MinHash
+    {
+    public:
+        static constexpr int NumHashes = 64;
+        static constexpr int NumBands = 16;
+        static constexpr int RowsPerBand = NumHashes / NumBands;
+
+        using Signature = std::array<std::uint32_t, NumHashes>;
+        using Bands = std::array<std::int64_t, NumBands>;
+
+        // Hashes a file into a feature. Only the file name and size are used,
+        // since re-packs tend to move files into other directories.
+        static std::uint64_t Feature(std::string_view path, std::int64_t size);
+
+        static Signature Compute(const std::vector<std::uint64_t>& features);
+        static Bands ComputeBands(const Signature& signature);
+
+        // Estimates the Jaccard similarity of the feature sets behind the two
+        // signatures.
+        static double Similarity(const Signature& lhs, const Signature& rhs);
+    };
+}
@@ -0,0 +1,61 @@
+#include "infohash.hpp"
+
+#include <cctype>
+
+#include <libtorrent/magnet_uri.hpp>
+
+static int HexValue(char c)
+{
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+}
+
+template<typename T>
+static std::optional<T> FromHex(std::string_view hex)
+{
+    T hash;
+    if (hex.size() != static_cast<std::size_t>(T::size()) * 2) { return std::nullopt; }
+
+    for (std::size_t i = 0; i < hex.size(); i += 2)
+    {
+        int const hi = HexValue(hex[i]);
+        int const lo = HexValue(hex[i + 1]);
+
+        if (hi < 0 || lo < 0) { return std::nullopt; }
+
+        hash[i / 2] = static_cast<std::uint8_t>((hi << 4) | lo);
+    }
+
+    return hash;
+}
+
+std::optional<lt::info_hash_t> hamster::Models::ParseInfoHash(std::string_view text)
+{
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front()))) { text.remove_prefix(1); }
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.back()))) { text.remove_suffix(1); }
+
+    if (auto v1 = FromHex<lt::sha1_hash>(text))
+    {
+        return lt::info_hash_t(*v1);
+    }
+
+    if (auto v2 = FromHex<lt::sha256_hash>(text))
+    {
+        return lt::info_hash_t(*v2);
+    }
+
+    if (text.rfind("magnet:", 0) == 0)
+    {
+        lt::error_code ec;
+        auto const params = lt::parse_magnet_uri(text, ec);
+
+        if (!ec && (params.info_hashes.has_v1() || params.info_hashes.has_v2()))
+        {
+            return params.info_hashes;
+        }
+    }
+
+    return std::nullopt;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#include <libtorrent/info_hash.hpp>
+
+namespace hamster::Models
+{
+    template<typename T>
+    inline std::string InfoHashString(T hash)
+    {
+        std::stringstream h;
+        h << hash;
+        return h.str();
+    }
+
+    // Parses a hex encoded v1 (40 chars) or v2 (64 chars) info hash, or a
+    // magnet link.
+    std::optional<lt::info_hash_t> ParseInfoHash(std::string_view text);
+}
@@ -164,7 +164,7 @@ void Node::Update(
     sqlite3_stmt* stmt = nullptr;
     sqlite3_prepare_v2(
         db,
-        "UPDATE nodes SET last_seen = $4, next_request = $3 WHERE remote_addr = $1 AND port = $2;",
+        "UPDATE nodes SET last_seen = $3, next_request = $4 WHERE remote_addr = $1 AND port = $2;",
         -1,
         &stmt,
         nullptr);
@@ -6,15 +6,10 @@
 
 #include <chrono>
 
-using hamster::Models::Sample;
+#include "infohash.hpp"
 
-template<typename T>
-static std::string InfoHashString(T hash)
-{
-    std::stringstream h;
-    h << hash;
-    return h.str();
-}
+using hamster::Models::InfoHashString;
+using hamster::Models::Sample;
 
 void Sample::Delete(
     sqlite3 *db,
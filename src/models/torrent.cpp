@@ -1,29 +1,44 @@
 #include "torrent.hpp"
 
+#include "database.hpp"
+#include "infohash.hpp"
+#include "torrentsignature.hpp"
+
+using hamster::MinHash;
+using hamster::Models::InfoHashString;
+using hamster::Models::ParseInfoHash;
 using hamster::Models::Torrent;
+using hamster::Models::TorrentSignature;
 
-template<typename T>
-static std::string InfoHashString(T hash)
+// Runs a statement which returns no rows, and finalizes it
+static void Execute(sqlite3* db, sqlite3_stmt* stmt)
 {
-    std::stringstream h;
-    h << hash;
-    return h.str();
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+    {
+        hamster::DatabaseException ex(db);
+        sqlite3_finalize(stmt);
+        throw ex;
+    }
+
+    sqlite3_finalize(stmt);
 }
 
-void Torrent::Insert(
-    sqlite3 *db,
-    const libtorrent::torrent_info &torrentInfo)
+static sqlite3_stmt* Prepare(sqlite3* db, const char* sql)
 {
-    auto const hashes = torrentInfo.info_hashes();
-
     sqlite3_stmt* stmt = nullptr;
-    sqlite3_prepare_v2(
-        db,
-        "INSERT INTO torrents (info_hash_v1, info_hash_v2, name, size) VALUES ($1,$2,$3,$4);",
-        -1,
-        &stmt,
-        nullptr);
 
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        throw hamster::DatabaseException(db);
+    }
+
+    return stmt;
+}
+
+// Binds the v1 and v2 hashes to parameters 1 and 2, or NULL for the missing
+// ones
+static void BindHashes(sqlite3_stmt* stmt, const libtorrent::info_hash_t& hashes)
+{
     if (hashes.has_v1())
     {
         std::string hash = InfoHashString(hashes.v1);
@@ -43,32 +58,264 @@ void Torrent::Insert(
     {
         sqlite3_bind_null(stmt, 2);
     }
+}
+
+// Reads a torrent from columns 1 to 4 (info_hash_v1, info_hash_v2, name, size)
+static Torrent ReadTorrent(sqlite3_stmt* stmt)
+{
+    Torrent torrent;
+
+    for (int column : { 1, 2 })
+    {
+        if (sqlite3_column_type(stmt, column) == SQLITE_NULL) { continue; }
+
+        auto const text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, column));
+
+        if (auto const parsed = ParseInfoHash(text))
+        {
+            if (parsed->has_v1()) { torrent.infoHashes.v1 = parsed->v1; }
+            if (parsed->has_v2()) { torrent.infoHashes.v2 = parsed->v2; }
+        }
+    }
+
+    torrent.name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+    torrent.size = sqlite3_column_int64(stmt, 4);
+
+    return torrent;
+}
+
+Torrent::Match Torrent::Exists(
+    sqlite3* db,
+    const libtorrent::info_hash_t& hashes)
+{
+    // A 20 byte hash may also be the truncated v2 hash a v2 torrent is
+    // sampled by on the DHT
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(
+        db,
+        "SELECT 0 FROM torrents WHERE info_hash_v1 = $1 OR info_hash_v2 = $2 "
+        "UNION ALL SELECT 1 FROM torrent_aliases WHERE info_hash = $1 "
+        "ORDER BY 1 LIMIT 1;",
+        -1,
+        &stmt,
+        nullptr);
+
+    BindHashes(stmt, hashes);
+
+    Match match = Match::None;
+
+    switch (sqlite3_step(stmt))
+    {
+        case SQLITE_ROW:
+            match = sqlite3_column_int(stmt, 0) == 0 ? Match::Hash : Match::Alias;
+            break;
+    }
 
-    sqlite3_bind_text(stmt,  3, torrentInfo.name().c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(stmt, 4, torrentInfo.total_size());
-    sqlite3_step(stmt);
     sqlite3_finalize(stmt);
 
-    sqlite3_int64 id = sqlite3_last_insert_rowid(db);
+    return match;
+}
+
+Torrent Torrent::FromTorrentInfo(
+    const libtorrent::torrent_info& torrentInfo)
+{
+    Torrent torrent;
+    torrent.infoHashes = torrentInfo.info_hashes();
+    torrent.name = torrentInfo.name();
+    torrent.size = torrentInfo.total_size();
+
+    auto const& files = torrentInfo.files();
+
+    for (int i = 0; i < files.num_files(); i++)
+    {
+        torrent.files.push_back({
+            files.file_path(lt::file_index_t{i}),
+            files.file_size(lt::file_index_t{i})
+        });
+    }
+
+    return torrent;
+}
+
+std::optional<Torrent> Torrent::GetByInfoHash(
+    sqlite3* db,
+    const libtorrent::info_hash_t& hashes)
+{
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(
+        db,
+        "SELECT id, info_hash_v1, info_hash_v2, name, size FROM torrents "
+        "WHERE info_hash_v1 = $1 OR info_hash_v2 = $2 "
+        "OR id = (SELECT torrent_id FROM torrent_aliases WHERE info_hash = $1);",
+        -1,
+        &stmt,
+        nullptr);
+
+    BindHashes(stmt, hashes);
+
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+    {
+        sqlite3_finalize(stmt);
+        return std::nullopt;
+    }
+
+    sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+    Torrent torrent = ReadTorrent(stmt);
+
+    sqlite3_finalize(stmt);
 
-    // insert files
     sqlite3_prepare_v2(
         db,
-        "INSERT INTO torrentfiles (torrent_id, path, size) VALUES ($1,$2,$3);",
+        "SELECT path, size FROM torrentfiles WHERE torrent_id = $1 ORDER BY id;",
         -1,
         &stmt,
         nullptr);
+    sqlite3_bind_int64(stmt, 1, id);
+
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        torrent.files.push_back({
+            reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+            sqlite3_column_int64(stmt, 1)
+        });
+    }
+
+    sqlite3_finalize(stmt);
+
+    return torrent;
+}
+
+bool Torrent::Insert(
+    sqlite3 *db,
+    const libtorrent::torrent_info &torrentInfo)
+{
+    auto const hashes = torrentInfo.info_hashes();
+
+    sqlite3_stmt* stmt = Prepare(
+        db,
+        "INSERT INTO torrents (info_hash_v1, info_hash_v2, name, size) VALUES ($1,$2,$3,$4) "
+        "ON CONFLICT DO NOTHING;");
+
+    BindHashes(stmt, hashes);
+    sqlite3_bind_text(stmt,  3, torrentInfo.name().c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 4, torrentInfo.total_size());
+    Execute(db, stmt);
+
+    bool const inserted = sqlite3_changes(db) > 0;
+    sqlite3_int64 const id = sqlite3_last_insert_rowid(db);
+
+    // Complete the hashes of a torrent stored under one of them, unless the
+    // other one is already taken by a torrent of its own
+    if (!inserted)
+    {
+        stmt = Prepare(
+            db,
+            "UPDATE OR IGNORE torrents SET "
+            "   info_hash_v1 = COALESCE(info_hash_v1, $1),"
+            "   info_hash_v2 = COALESCE(info_hash_v2, $2) "
+            "WHERE info_hash_v1 = $1 OR info_hash_v2 = $2;");
+
+        BindHashes(stmt, hashes);
+        Execute(db, stmt);
+    }
+
+    if (hashes.has_v2())
+    {
+        std::string const alias = InfoHashString(hashes.get(lt::protocol_version::V2));
+        std::string const hash = InfoHashString(hashes.v2);
+
+        stmt = Prepare(
+            db,
+            "INSERT OR IGNORE INTO torrent_aliases (info_hash, torrent_id) "
+            "SELECT $1, id FROM torrents WHERE info_hash_v2 = $2;");
+
+        sqlite3_bind_text(stmt, 1, alias.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, hash.c_str(), -1, SQLITE_TRANSIENT);
+        Execute(db, stmt);
+    }
+
+    if (!inserted)
+    {
+        return false;
+    }
+
+    // insert files
+    stmt = Prepare(
+        db,
+        "INSERT INTO torrentfiles (torrent_id, path, size) VALUES ($1,$2,$3);");
 
     auto const& files = torrentInfo.files();
 
+    std::vector<std::uint64_t> features;
+    features.reserve(files.num_files());
+
     for (int i = 0; i < files.num_files(); i++)
     {
+        auto const path = files.file_path(lt::file_index_t{i});
+        auto const size = files.file_size(lt::file_index_t{i});
+
         sqlite3_bind_int64(stmt, 1, id);
-        sqlite3_bind_text(stmt,  2, files.file_path(lt::file_index_t{i}).c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int64(stmt, 3, files.file_size(lt::file_index_t{i}));
-        sqlite3_step(stmt);
+        sqlite3_bind_text(stmt,  2, path.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 3, size);
+
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            hamster::DatabaseException ex(db);
+            sqlite3_finalize(stmt);
+            throw ex;
+        }
+
         sqlite3_reset(stmt);
+
+        features.push_back(MinHash::Feature(path, size));
     }
 
     sqlite3_finalize(stmt);
+
+    TorrentSignature::Insert(db, id, MinHash::Compute(features));
+
+    return true;
+}
+
+void Torrent::Scan(
+    sqlite3* db,
+    const std::function<void(const Torrent&)>& callback)
+{
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(
+        db,
+        "SELECT t.id, t.info_hash_v1, t.info_hash_v2, t.name, t.size, f.path, f.size FROM torrents t "
+        "LEFT JOIN torrentfiles f ON f.torrent_id = t.id "
+        "ORDER BY t.id, f.id;",
+        -1,
+        &stmt,
+        nullptr);
+
+    std::optional<Torrent> current;
+    sqlite3_int64 currentId = 0;
+
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        sqlite3_int64 const id = sqlite3_column_int64(stmt, 0);
+
+        if (!current || id != currentId)
+        {
+            if (current) { callback(*current); }
+
+            current = ReadTorrent(stmt);
+            currentId = id;
+        }
+
+        if (sqlite3_column_type(stmt, 5) != SQLITE_NULL)
+        {
+            current->files.push_back({
+                reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5)),
+                sqlite3_column_int64(stmt, 6)
+            });
+        }
+    }
+
+    if (current) { callback(*current); }
+
+    sqlite3_finalize(stmt);
 }
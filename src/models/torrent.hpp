@@ -1,5 +1,11 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
 #include <libtorrent/torrent_info.hpp>
 
 #include <sqlite3.h>
@@ -9,8 +15,48 @@ namespace hamster::Models
     class Torrent
     {
     public:
-        static void Insert(
+        struct File
+        {
+            std::string path;
+            std::int64_t size;
+        };
+
+        // How Exists found a hash: as a hash of the torrent itself, or as a
+        // truncated v2 hash in the alias table
+        enum class Match
+        {
+            None,
+            Hash,
+            Alias
+        };
+
+        static Match Exists(
+            sqlite3* db,
+            const libtorrent::info_hash_t& hash);
+
+        static Torrent FromTorrentInfo(
+            const libtorrent::torrent_info& torrentInfo);
+
+        static std::optional<Torrent> GetByInfoHash(
+            sqlite3* db,
+            const libtorrent::info_hash_t& hash);
+
+        // Stores the torrent, or adds the hashes missing from the torrent
+        // already stored under one of its hashes. Returns true if the torrent
+        // was new. Throws a DatabaseException if a statement fails.
+        static bool Insert(
             sqlite3* db,
             const libtorrent::torrent_info& torrentInfo);
+
+        // Calls the callback with every torrent and its files, in insertion
+        // order.
+        static void Scan(
+            sqlite3* db,
+            const std::function<void(const Torrent&)>& callback);
+
+        libtorrent::info_hash_t infoHashes;
+        std::string name;
+        std::int64_t size;
+        std::vector<File> files;
     };
 }
@@ -0,0 +1,207 @@
+#include "torrentsignature.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+
+#include "database.hpp"
+#include "infohash.hpp"
+
+using hamster::MinHash;
+using hamster::Models::InfoHashString;
+using hamster::Models::ParseInfoHash;
+using hamster::Models::TorrentSignature;
+
+static bool ReadSignature(sqlite3_stmt* stmt, int column, MinHash::Signature& signature)
+{
+    if (sqlite3_column_bytes(stmt, column) != sizeof(signature)) { return false; }
+
+    std::memcpy(signature.data(), sqlite3_column_blob(stmt, column), sizeof(signature));
+    return true;
+}
+
+std::vector<TorrentSignature::Match> TorrentSignature::FindSimilar(
+    sqlite3* db,
+    const libtorrent::info_hash_t& hashes,
+    std::size_t limit)
+{
+    std::vector<Match> matches;
+
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(
+        db,
+        "SELECT t.id, s.signature FROM torrents t "
+        "JOIN torrent_signatures s ON s.torrent_id = t.id "
+        "WHERE t.info_hash_v1 = $1 OR t.info_hash_v2 = $2 "
+        "OR t.id = (SELECT torrent_id FROM torrent_aliases WHERE info_hash = $1);",
+        -1,
+        &stmt,
+        nullptr);
+
+    if (hashes.has_v1())
+    {
+        std::string hash = InfoHashString(hashes.v1);
+        sqlite3_bind_text(stmt, 1, hash.c_str(), -1, SQLITE_TRANSIENT);
+    }
+    else
+    {
+        sqlite3_bind_null(stmt, 1);
+    }
+
+    if (hashes.has_v2())
+    {
+        std::string hash = InfoHashString(hashes.v2);
+        sqlite3_bind_text(stmt, 2, hash.c_str(), -1, SQLITE_TRANSIENT);
+    }
+    else
+    {
+        sqlite3_bind_null(stmt, 2);
+    }
+
+    MinHash::Signature signature;
+
+    if (sqlite3_step(stmt) != SQLITE_ROW || !ReadSignature(stmt, 1, signature))
+    {
+        sqlite3_finalize(stmt);
+        return matches;
+    }
+
+    sqlite3_int64 const id = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    // Collect the torrents sharing at least one band bucket
+    std::unordered_set<sqlite3_int64> candidates;
+    auto const bands = MinHash::ComputeBands(signature);
+
+    sqlite3_prepare_v2(
+        db,
+        "SELECT torrent_id FROM torrent_lsh WHERE band = $1 AND bucket = $2 LIMIT $3;",
+        -1,
+        &stmt,
+        nullptr);
+
+    for (int band = 0; band < MinHash::NumBands; band++)
+    {
+        sqlite3_bind_int(stmt,   1, band);
+        sqlite3_bind_int64(stmt, 2, bands[band]);
+        sqlite3_bind_int(stmt,   3, MaxCandidatesPerBand);
+
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            auto const candidate = sqlite3_column_int64(stmt, 0);
+            if (candidate != id) { candidates.insert(candidate); }
+        }
+
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+
+    // Score the candidates on their full signatures
+    sqlite3_prepare_v2(
+        db,
+        "SELECT t.info_hash_v1, t.info_hash_v2, t.name, t.size, s.signature FROM torrents t "
+        "JOIN torrent_signatures s ON s.torrent_id = t.id "
+        "WHERE t.id = $1;",
+        -1,
+        &stmt,
+        nullptr);
+
+    for (auto const candidate : candidates)
+    {
+        sqlite3_bind_int64(stmt, 1, candidate);
+
+        MinHash::Signature other;
+
+        if (sqlite3_step(stmt) == SQLITE_ROW && ReadSignature(stmt, 4, other))
+        {
+            double const similarity = MinHash::Similarity(signature, other);
+
+            if (similarity >= MinSimilarity)
+            {
+                Match match;
+                match.name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+                match.size = sqlite3_column_int64(stmt, 3);
+                match.similarity = similarity;
+
+                for (int column : { 0, 1 })
+                {
+                    if (sqlite3_column_type(stmt, column) == SQLITE_NULL) { continue; }
+
+                    if (auto const parsed = ParseInfoHash(reinterpret_cast<const char*>(sqlite3_column_text(stmt, column))))
+                    {
+                        if (parsed->has_v1()) { match.infoHashes.v1 = parsed->v1; }
+                        if (parsed->has_v2()) { match.infoHashes.v2 = parsed->v2; }
+                    }
+                }
+
+                matches.push_back(std::move(match));
+            }
+        }
+
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+
+    std::sort(
+        matches.begin(),
+        matches.end(),
+        [](auto const& lhs, auto const& rhs) { return lhs.similarity > rhs.similarity; });
+
+    if (matches.size() > limit) { matches.resize(limit); }
+
+    return matches;
+}
+
+void TorrentSignature::Insert(
+    sqlite3* db,
+    sqlite3_int64 torrentId,
+    const MinHash::Signature& signature)
+{
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(
+        db,
+        "INSERT OR REPLACE INTO torrent_signatures (torrent_id, signature) VALUES ($1,$2);",
+        -1,
+        &stmt,
+        nullptr);
+    sqlite3_bind_int64(stmt, 1, torrentId);
+    sqlite3_bind_blob(stmt,  2, signature.data(), sizeof(signature), SQLITE_TRANSIENT);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+    {
+        hamster::DatabaseException ex(db);
+        sqlite3_finalize(stmt);
+        throw ex;
+    }
+
+    sqlite3_finalize(stmt);
+
+    auto const bands = MinHash::ComputeBands(signature);
+
+    sqlite3_prepare_v2(
+        db,
+        "INSERT OR IGNORE INTO torrent_lsh (band, bucket, torrent_id) VALUES ($1,$2,$3);",
+        -1,
+        &stmt,
+        nullptr);
+
+    for (int band = 0; band < MinHash::NumBands; band++)
+    {
+        sqlite3_bind_int(stmt,   1, band);
+        sqlite3_bind_int64(stmt, 2, bands[band]);
+        sqlite3_bind_int64(stmt, 3, torrentId);
+
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            hamster::DatabaseException ex(db);
+            sqlite3_finalize(stmt);
+            throw ex;
+        }
+
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <libtorrent/info_hash.hpp>
+#include <sqlite3.h>
+
+#include "../minhash.hpp"
+
+namespace hamster::Models
+{
+    class TorrentSignature
+    {
+    public:
+        // With 16 bands of 4 rows, torrents this similar collide in at least
+        // one band about 2/3 of the time, and torrents less similar are not
+        // interesting.
+        static constexpr double MinSimilarity = 0.5;
+
+        // Buckets shared by a very large number of torrents (e.g. single file
+        // torrents of a common file) carry little information, so cap them.
+        static constexpr int MaxCandidatesPerBand = 1000;
+
+        struct Match
+        {
+            libtorrent::info_hash_t infoHashes;
+            std::string name;
+            std::int64_t size;
+            double similarity;
+        };
+
+        // Finds torrents whose file lists are similar to the one of the given
+        // torrent, most similar first.
+        static std::vector<Match> FindSimilar(
+            sqlite3* db,
+            const libtorrent::info_hash_t& hash,
+            std::size_t limit);
+
+        static void Insert(
+            sqlite3* db,
+            sqlite3_int64 torrentId,
+            const MinHash::Signature& signature);
+    };
+}
@@ -0,0 +1,52 @@
+#include "nodeschedule.hpp"
+
+using hamster::NodeSchedule;
+
+std::size_t NodeSchedule::FamilyOf(const Endpoint& endpoint)
+{
+    auto const& address = endpoint.address();
+    return address.is_v6() && !address.to_v6().is_v4_mapped() ? 1 : 0;
+}
+
+void NodeSchedule::Add(const Endpoint& endpoint)
+{
+    m_nodes.insert({ endpoint, lt::time_point::min() });
+}
+
+void NodeSchedule::Defer(const Endpoint& endpoint, lt::time_point due)
+{
+    m_nodes[endpoint] = due;
+}
+
+std::vector<NodeSchedule::Endpoint> NodeSchedule::TakeDue(
+    lt::time_point now,
+    std::size_t limit,
+    lt::time_duration retryAfter,
+    const std::function<bool(const Endpoint&)>& skip)
+{
+    std::vector<Endpoint> due;
+
+    for (auto& [endpoint, next] : m_nodes)
+    {
+        if (due.size() >= limit) { break; }
+        if (next >= now) { continue; }
+
+        next = now + retryAfter;
+
+        if (skip && skip(endpoint)) { continue; }
+
+        due.push_back(endpoint);
+    }
+
+    return due;
+}
+
+void NodeSchedule::DropNotDue(lt::time_point now)
+{
+    for (auto it = m_nodes.begin(); it != m_nodes.end();)
+    {
+        it = it->second > now
+            ? m_nodes.erase(it)
+            : std::next(it);
+    }
+}
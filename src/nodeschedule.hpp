@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+#include <libtorrent/time.hpp>
+
+namespace hamster
+{
+    // The DHT nodes of one address family, and when each of them is due to be
+    // asked for samples next
+    class NodeSchedule
+    {
+    public:
+        using Endpoint = boost::asio::ip::udp::endpoint;
+
+        // Which family a node belongs to, 0 for IPv4 and 1 for IPv6.
+        // IPv4-mapped addresses are IPv4 nodes reached through an IPv6 socket.
+        static std::size_t FamilyOf(const Endpoint& endpoint);
+
+        std::size_t Size() const { return m_nodes.size(); }
+
+        // Adds a node which is due right away, unless it is known already
+        void Add(const Endpoint& endpoint);
+
+        // Sets when a node is due next, adding it if needed
+        void Defer(const Endpoint& endpoint, lt::time_point due);
+
+        // Takes up to limit nodes which are due at now and defers each of them
+        // by retryAfter. Nodes for which skip returns true are deferred as
+        // well, but neither taken nor counted against the limit.
+        std::vector<Endpoint> TakeDue(
+            lt::time_point now,
+            std::size_t limit,
+            lt::time_duration retryAfter,
+            const std::function<bool(const Endpoint&)>& skip);
+
+        // Forgets the nodes which are not due at now. They are found again
+        // through DHT traffic.
+        void DropNotDue(lt::time_point now);
+
+    private:
+        std::map<Endpoint, lt::time_point> m_nodes;
+    };
+}
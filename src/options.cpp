@@ -1,6 +1,8 @@
 #include "options.hpp"
 
+#include <algorithm>
 #include <filesystem>
+#include <thread>
 
 #include <boost/program_options.hpp>
 
@@ -13,25 +15,130 @@ std::shared_ptr<Options> Options::Parse(int argc, char **argv)
 {
     po::options_description desc("Allowed options");
     desc.add_options()
+        ("census-file", po::value<std::string>(), "set the path of the DHT census sketches (default <db-file>.census)")
+        ("control-socket", po::value<std::string>(), "set the control socket path")
         ("db-file", po::value<std::string>(), "set the db file path")
+        ("dht-bootstrap-nodes", po::value<std::string>(), "set the comma separated list of DHT nodes to bootstrap from")
+        ("dht-local-swarm", po::bool_switch(), "allow many DHT nodes on one address, for crawling a local test swarm")
+        ("dht-query-rate", po::value<std::uint32_t>(), "set the max number of sample_infohashes queries per second, per address family")
+        ("fetch-journal", po::value<std::string>(), "set the path of the journal of info hashes waiting for metadata (default <db-file>.pending)")
+        ("fetch-timeout", po::value<std::uint32_t>(), "set the number of seconds to wait for metadata before giving up on a torrent")
+        ("import-threads", po::value<unsigned>(), "set the number of threads parsing torrent files when importing")
+        ("listen-interfaces", po::value<std::string>(), "set the comma separated list of interfaces and ports to listen on")
         ("log-level", po::value<std::string>(), "set log level")
+        ("log-rate-limit", po::value<std::uint32_t>(), "set the max number of per-torrent log messages per second, per message kind (default 100, 0 = unlimited)")
+        ("max-active-fetches", po::value<std::uint32_t>(), "set the max number of torrents fetching metadata at once")
+        ("memory-budget", po::value<std::uint32_t>(), "set the memory budget in MiB above which the indexer backs off (0 = unlimited)")
+        ("reputation-mode", po::value<std::string>(), "set whether low reputation sources are skipped (enforce) or only counted (observe)")
+        ("shm-name", po::value<std::string>(), "share seen info hashes with other processes through this shared memory segment")
+        ("shm-capacity", po::value<std::uint32_t>(), "set the number of info hashes the shared memory segment can hold")
+        ("shutdown-timeout", po::value<std::uint32_t>(), "set the number of seconds to drain pending work for on shutdown")
+        ("storage-engine", po::value<std::string>(), "set the storage engine (sqlite or log)")
+        ("wal-checkpoint-interval", po::value<std::uint32_t>(), "set the number of seconds between WAL checkpoints (0 = let SQLite checkpoint inline)")
+        ("wal-size-limit", po::value<std::uint32_t>(), "set the WAL size in MiB above which checkpoints restart or truncate the WAL")
         ;
 
+    po::options_description hidden;
+    hidden.add_options()
+        ("command", po::value<std::string>())
+        ("command-args", po::value<std::vector<std::string>>())
+        ;
+
+    po::options_description all;
+    all.add(desc).add(hidden);
+
+    po::positional_options_description positional;
+    positional.add("command", 1);
+    positional.add("command-args", -1);
+
     po::variables_map vm;
-    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::store(po::command_line_parser(argc, argv).options(all).positional(positional).run(), vm);
     po::notify(vm);
 
     auto opts = new Options();
     opts->m_dbFile = fs::current_path() / "hamster.db";
+    opts->m_dhtBootstrapNodes =
+        "router.bittorrent.com:6881,"
+        "dht.transmissionbt.com:6881,"
+        "dht.libtorrent.org:25401";
+    opts->m_dhtLocalSwarm = false;
+    opts->m_dhtQueryRate = 200;
+    opts->m_fetchTimeout = std::chrono::minutes(10);
+    opts->m_importThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    opts->m_listenInterfaces = "0.0.0.0:6881,[::]:6881";
     opts->m_logLevel = boost::log::trivial::severity_level::info;
+    opts->m_logRateLimit = 100;
+    opts->m_maxActiveFetches = 1000;
+    opts->m_memoryBudget = 0;
+    opts->m_reputationMode = "enforce";
+    opts->m_shmCapacity = 1 << 20;
+    opts->m_shutdownTimeout = std::chrono::seconds(10);
+    opts->m_storageEngine = "sqlite";
+    opts->m_walCheckpointInterval = std::chrono::seconds(10);
+    opts->m_walSizeLimit = 64 * 1024 * 1024;
 
     if (const char* dbFile = std::getenv("HAMSTER_DB_FILE"))
     {
         opts->m_dbFile = dbFile;
     }
 
+    if (const char* controlSocket = std::getenv("HAMSTER_CONTROL_SOCKET"))
+    {
+        opts->m_controlSocket = controlSocket;
+    }
+
+    if (const char* shmName = std::getenv("HAMSTER_SHM_NAME"))
+    {
+        opts->m_shmName = shmName;
+    }
+
     // command line parameters overrides the env variables
+    if (vm.count("census-file")) { opts->m_censusFile = vm["census-file"].as<std::string>(); }
+    if (vm.count("command")) { opts->m_command = vm["command"].as<std::string>(); }
+    if (vm.count("command-args")) { opts->m_commandArgs = vm["command-args"].as<std::vector<std::string>>(); }
+    if (vm.count("control-socket")) { opts->m_controlSocket = vm["control-socket"].as<std::string>(); }
     if (vm.count("db-file")) { opts->m_dbFile = vm["db-file"].as<std::string>(); }
+    if (vm.count("dht-bootstrap-nodes")) { opts->m_dhtBootstrapNodes = vm["dht-bootstrap-nodes"].as<std::string>(); }
+    if (vm.count("dht-local-swarm")) { opts->m_dhtLocalSwarm = vm["dht-local-swarm"].as<bool>(); }
+    if (vm.count("dht-query-rate")) { opts->m_dhtQueryRate = vm["dht-query-rate"].as<std::uint32_t>(); }
+    if (vm.count("fetch-journal")) { opts->m_fetchJournalFile = vm["fetch-journal"].as<std::string>(); }
+    if (vm.count("fetch-timeout")) { opts->m_fetchTimeout = std::chrono::seconds(vm["fetch-timeout"].as<std::uint32_t>()); }
+    if (vm.count("import-threads")) { opts->m_importThreads = vm["import-threads"].as<unsigned>(); }
+    if (vm.count("listen-interfaces")) { opts->m_listenInterfaces = vm["listen-interfaces"].as<std::string>(); }
+    if (vm.count("log-rate-limit")) { opts->m_logRateLimit = vm["log-rate-limit"].as<std::uint32_t>(); }
+    if (vm.count("max-active-fetches")) { opts->m_maxActiveFetches = vm["max-active-fetches"].as<std::uint32_t>(); }
+    if (vm.count("memory-budget")) { opts->m_memoryBudget = std::uint64_t(vm["memory-budget"].as<std::uint32_t>()) * 1024 * 1024; }
+    if (vm.count("reputation-mode")) { opts->m_reputationMode = vm["reputation-mode"].as<std::string>(); }
+    if (vm.count("shm-name")) { opts->m_shmName = vm["shm-name"].as<std::string>(); }
+    if (vm.count("shm-capacity")) { opts->m_shmCapacity = vm["shm-capacity"].as<std::uint32_t>(); }
+    if (vm.count("shutdown-timeout")) { opts->m_shutdownTimeout = std::chrono::seconds(vm["shutdown-timeout"].as<std::uint32_t>()); }
+    if (vm.count("storage-engine")) { opts->m_storageEngine = vm["storage-engine"].as<std::string>(); }
+    if (vm.count("wal-checkpoint-interval")) { opts->m_walCheckpointInterval = std::chrono::seconds(vm["wal-checkpoint-interval"].as<std::uint32_t>()); }
+    if (vm.count("wal-size-limit")) { opts->m_walSizeLimit = std::uintmax_t(vm["wal-size-limit"].as<std::uint32_t>()) * 1024 * 1024; }
+
+    // Each database gets a control socket of its own, unless it lives in memory
+    if (opts->m_controlSocket.empty() && opts->m_dbFile != ":memory:")
+    {
+        opts->m_controlSocket = opts->m_dbFile + ".sock";
+    }
+
+    // As does its journal of pending fetches
+    if (!vm.count("fetch-journal") && opts->m_dbFile != ":memory:")
+    {
+        opts->m_fetchJournalFile = opts->m_dbFile + ".pending";
+    }
+
+    // And its DHT census
+    if (!vm.count("census-file") && opts->m_dbFile != ":memory:")
+    {
+        opts->m_censusFile = opts->m_dbFile + ".census";
+    }
+
+    // POSIX shared memory object names must begin with a slash
+    if (!opts->m_shmName.empty() && opts->m_shmName[0] != '/')
+    {
+        opts->m_shmName = "/" + opts->m_shmName;
+    }
 
     if (vm.count("log-level"))
     {
@@ -47,12 +154,117 @@ std::shared_ptr<Options> Options::Parse(int argc, char **argv)
     return std::shared_ptr<Options>(opts);
 }
 
+const std::string& Options::CensusFile()
+{
+    return m_censusFile;
+}
+
+const std::string& Options::Command()
+{
+    return m_command;
+}
+
+const std::vector<std::string>& Options::CommandArgs()
+{
+    return m_commandArgs;
+}
+
+const std::string& Options::ControlSocket()
+{
+    return m_controlSocket;
+}
+
 const std::string& Options::DbFile()
 {
     return m_dbFile;
 }
 
+const std::string& Options::DhtBootstrapNodes()
+{
+    return m_dhtBootstrapNodes;
+}
+
+bool Options::DhtLocalSwarm()
+{
+    return m_dhtLocalSwarm;
+}
+
+std::uint32_t Options::DhtQueryRate()
+{
+    return m_dhtQueryRate;
+}
+
+const std::string& Options::FetchJournalFile()
+{
+    return m_fetchJournalFile;
+}
+
+std::chrono::seconds Options::FetchTimeout()
+{
+    return m_fetchTimeout;
+}
+
 boost::log::trivial::severity_level Options::LogLevel()
 {
     return m_logLevel;
 }
+
+unsigned Options::ImportThreads()
+{
+    return m_importThreads;
+}
+
+const std::string& Options::ListenInterfaces()
+{
+    return m_listenInterfaces;
+}
+
+std::uint32_t Options::LogRateLimit()
+{
+    return m_logRateLimit;
+}
+
+std::uint32_t Options::MaxActiveFetches()
+{
+    return m_maxActiveFetches;
+}
+
+std::uint64_t Options::MemoryBudget()
+{
+    return m_memoryBudget;
+}
+
+const std::string& Options::ReputationMode()
+{
+    return m_reputationMode;
+}
+
+const std::string& Options::SharedMemoryName()
+{
+    return m_shmName;
+}
+
+std::uint32_t Options::SharedMemoryCapacity()
+{
+    return m_shmCapacity;
+}
+
+std::chrono::seconds Options::ShutdownTimeout()
+{
+    return m_shutdownTimeout;
+}
+
+const std::string& Options::StorageEngine()
+{
+    return m_storageEngine;
+}
+
+std::chrono::seconds Options::WalCheckpointInterval()
+{
+    return m_walCheckpointInterval;
+}
+
+std::uintmax_t Options::WalSizeLimit()
+{
+    return m_walSizeLimit;
+}
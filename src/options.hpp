@@ -1,7 +1,10 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <boost/log/trivial.hpp>
 
@@ -12,11 +15,53 @@ namespace hamster
     public:
         static std::shared_ptr<Options> Parse(int argc, char* argv[]);
 
+        const std::string& Command();
+        const std::string& CensusFile();
+        const std::vector<std::string>& CommandArgs();
+        const std::string& ControlSocket();
         const std::string& DbFile();
+        const std::string& DhtBootstrapNodes();
+        bool DhtLocalSwarm();
+        std::uint32_t DhtQueryRate();
+        const std::string& FetchJournalFile();
+        std::chrono::seconds FetchTimeout();
+        unsigned ImportThreads();
+        const std::string& ListenInterfaces();
         boost::log::trivial::severity_level LogLevel();
+        std::uint32_t LogRateLimit();
+        std::uint32_t MaxActiveFetches();
+        std::uint64_t MemoryBudget();
+        const std::string& ReputationMode();
+        const std::string& SharedMemoryName();
+        std::uint32_t SharedMemoryCapacity();
+        std::chrono::seconds ShutdownTimeout();
+        const std::string& StorageEngine();
+        std::chrono::seconds WalCheckpointInterval();
+        std::uintmax_t WalSizeLimit();
 
     private:
+        std::string m_censusFile;
+        std::string m_command;
+        std::vector<std::string> m_commandArgs;
+        std::string m_controlSocket;
         std::string m_dbFile;
+        std::string m_dhtBootstrapNodes;
+        bool m_dhtLocalSwarm;
+        std::uint32_t m_dhtQueryRate;
+        std::string m_fetchJournalFile;
+        std::chrono::seconds m_fetchTimeout;
+        unsigned m_importThreads;
+        std::string m_listenInterfaces;
         boost::log::trivial::severity_level m_logLevel;
+        std::uint32_t m_logRateLimit;
+        std::uint32_t m_maxActiveFetches;
+        std::uint64_t m_memoryBudget;
+        std::string m_reputationMode;
+        std::string m_shmName;
+        std::uint32_t m_shmCapacity;
+        std::chrono::seconds m_shutdownTimeout;
+        std::string m_storageEngine;
+        std::chrono::seconds m_walCheckpointInterval;
+        std::uintmax_t m_walSizeLimit;
     };
 }
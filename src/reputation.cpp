@@ -0,0 +1,297 @@
+#include "reputation.hpp"
+
+#include <algorithm>
+#include <bit>
+
+using hamster::NodeReputation;
+
+static const std::uint32_t none = 0;
+
+// Prefix lengths in the IPv6 address space IPv4 addresses are mapped into
+static const int ipv4HostLength = 128;
+static const int ipv4SubnetLength = 96 + 24;
+static const int ipv6HostLength = 64;
+static const int ipv6SubnetLength = 48;
+
+// A prefix is judged once it has this many outcomes, and only if there are
+// enough overall to know what the average looks like
+static const double minOutcomes = 10;
+static const double minTotalOutcomes = 100;
+
+// Scores are smoothed towards the average as if by this many outcomes, so a
+// short run of bad luck does not condemn a source
+static const double priorOutcomes = 4;
+
+// Relative to the average resolve ratio. Most sampled hashes never resolve
+// on honest nodes either, so only sources doing much worse are penalized.
+static const double downWeightBelow = 0.5;
+static const double blockBelow = 0.1;
+
+// Decayed prefixes with fewer outcomes than this left are dropped
+static const float minKeptOutcomes = 0.5f;
+
+static bool Bit(const std::array<std::uint8_t, 16>& key, int index)
+{
+    return (key[index / 8] >> (7 - index % 8)) & 1;
+}
+
+// The length of the prefix the keys share, up to limit bits
+static int CommonLength(const std::array<std::uint8_t, 16>& lhs, const std::array<std::uint8_t, 16>& rhs, int limit)
+{
+    int length = 0;
+
+    for (std::size_t i = 0; i < lhs.size() && length < limit; i++)
+    {
+        auto const diff = static_cast<std::uint8_t>(lhs[i] ^ rhs[i]);
+
+        if (diff != 0)
+        {
+            length += std::countl_zero(diff);
+            break;
+        }
+
+        length += 8;
+    }
+
+    return std::min(length, limit);
+}
+
+static std::array<std::uint8_t, 16> Masked(std::array<std::uint8_t, 16> key, int length)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        int const bits = std::clamp(length - i * 8, 0, 8);
+        key[i] &= static_cast<std::uint8_t>(0xff00 >> bits);
+    }
+
+    return key;
+}
+
+static bool IsMappedIpv4(const std::array<std::uint8_t, 16>& key)
+{
+    return std::all_of(key.begin(), key.begin() + 10, [](auto b) { return b == 0; })
+        && key[10] == 0xff
+        && key[11] == 0xff;
+}
+
+template <typename Visitor>
+void NodeReputation::Visit(const Key& key, Visitor&& visitor) const
+{
+    std::uint32_t index = 0;
+
+    while (true)
+    {
+        auto const& node = m_nodes[index];
+
+        if (CommonLength(key, node.key, node.length) < node.length)
+        {
+            return;
+        }
+
+        if (node.scored) { visitor(node); }
+        if (node.length == 128) { return; }
+
+        index = node.children[Bit(key, node.length)];
+
+        if (index == none) { return; }
+    }
+}
+
+NodeReputation::NodeReputation()
+    : m_nodes{ Node{ {}, 0, false, { none, none }, { 0, 0 } } },
+      m_total{ 0, 0 }
+{
+}
+
+void NodeReputation::Resolved(const boost::asio::ip::address& address)
+{
+    Add(address, { 1, 0 });
+}
+
+void NodeReputation::Failed(const boost::asio::ip::address& address)
+{
+    Add(address, { 0, 1 });
+}
+
+double NodeReputation::Weight(const boost::asio::ip::address& address) const
+{
+    auto const average = Average();
+
+    if (average <= 0) { return 1; }
+
+    double weight = 1;
+
+    Visit(
+        KeyOf(address),
+        [&](const Node& node) { weight = std::min(weight, WeightOf(node.counts, average)); });
+
+    return weight;
+}
+
+void NodeReputation::Decay()
+{
+    std::vector<Node> kept;
+
+    for (auto const& node : m_nodes)
+    {
+        if (!node.scored) { continue; }
+
+        Counts const counts{ node.counts.resolved / 2, node.counts.failed / 2 };
+
+        if (counts.resolved + counts.failed >= minKeptOutcomes)
+        {
+            kept.push_back(node);
+            kept.back().counts = counts;
+        }
+    }
+
+    // Rebuilt rather than pruned in place, which also packs the nodes
+    m_nodes.clear();
+    m_nodes.shrink_to_fit();
+    m_nodes.push_back({ {}, 0, false, { none, none }, { 0, 0 } });
+
+    for (auto const& node : kept)
+    {
+        Insert(node.key, node.length) = node.counts;
+    }
+
+    m_total.resolved /= 2;
+    m_total.failed /= 2;
+}
+
+NodeReputation::Summary NodeReputation::Summarize() const
+{
+    auto const average = Average();
+    Summary summary{ 0, 0, 0, 0 };
+
+    for (auto const& node : m_nodes)
+    {
+        if (!node.scored) { continue; }
+
+        auto const host = IsMappedIpv4(node.key) ? node.length == ipv4HostLength : node.length == ipv6HostLength;
+        (host ? summary.hosts : summary.subnets) += 1;
+
+        if (average <= 0) { continue; }
+
+        auto const weight = WeightOf(node.counts, average);
+
+        if (weight == 0) { summary.blocked += 1; }
+        else if (weight < 1) { summary.downWeighted += 1; }
+    }
+
+    return summary;
+}
+
+std::uint64_t NodeReputation::MemoryUsage() const
+{
+    return m_nodes.capacity() * sizeof(Node);
+}
+
+NodeReputation::Key NodeReputation::KeyOf(const boost::asio::ip::address& address)
+{
+    if (address.is_v4())
+    {
+        return boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4()).to_bytes();
+    }
+
+    return address.to_v6().to_bytes();
+}
+
+void NodeReputation::Add(const boost::asio::ip::address& address, Counts outcome)
+{
+    auto const key = KeyOf(address);
+    auto const v4 = address.is_v4() || address.to_v6().is_v4_mapped();
+
+    for (int const length : { v4 ? ipv4SubnetLength : ipv6SubnetLength, v4 ? ipv4HostLength : ipv6HostLength })
+    {
+        auto& counts = Insert(key, length);
+        counts.resolved += outcome.resolved;
+        counts.failed += outcome.failed;
+    }
+
+    m_total.resolved += outcome.resolved;
+    m_total.failed += outcome.failed;
+}
+
+NodeReputation::Counts& NodeReputation::Insert(const Key& fullKey, int length)
+{
+    auto const key = Masked(fullKey, length);
+    std::uint32_t index = 0;
+
+    auto const make = [this](const Key& k, int l, bool scored)
+    {
+        m_nodes.push_back({ Masked(k, l), static_cast<std::uint8_t>(l), scored, { none, none }, { 0, 0 } });
+        return static_cast<std::uint32_t>(m_nodes.size() - 1);
+    };
+
+    // Every node on the way down is a prefix of the key. Indices are used
+    // throughout, as adding nodes moves them.
+    while (true)
+    {
+        if (m_nodes[index].length == length)
+        {
+            m_nodes[index].scored = true;
+            return m_nodes[index].counts;
+        }
+
+        auto const bit = Bit(key, m_nodes[index].length);
+        auto const child = m_nodes[index].children[bit];
+
+        if (child == none)
+        {
+            auto const leaf = make(key, length, true);
+            m_nodes[index].children[bit] = leaf;
+            return m_nodes[leaf].counts;
+        }
+
+        auto const childLength = m_nodes[child].length;
+        auto const common = CommonLength(key, m_nodes[child].key, std::min<int>(length, childLength));
+
+        if (common == childLength)
+        {
+            index = child;
+            continue;
+        }
+
+        // The key branches off, or ends, within the child's edge
+        auto const split = make(key, common, common == length);
+        m_nodes[split].children[Bit(m_nodes[child].key, common)] = child;
+        m_nodes[index].children[bit] = split;
+
+        if (common == length)
+        {
+            return m_nodes[split].counts;
+        }
+
+        auto const leaf = make(key, length, true);
+        m_nodes[split].children[Bit(key, common)] = leaf;
+        return m_nodes[leaf].counts;
+    }
+}
+
+double NodeReputation::WeightOf(const Counts& counts, double average)
+{
+    double const outcomes = counts.resolved + counts.failed;
+
+    if (outcomes < minOutcomes) { return 1; }
+
+    double const ratio = (counts.resolved + priorOutcomes * average) / (outcomes + priorOutcomes);
+    double const relative = ratio / average;
+
+    if (relative >= downWeightBelow) { return 1; }
+    if (relative <= blockBelow) { return 0; }
+
+    return relative / downWeightBelow;
+}
+
+double NodeReputation::Average() const
+{
+    double const outcomes = m_total.resolved + m_total.failed;
+
+    if (outcomes < minTotalOutcomes || m_total.resolved == 0)
+    {
+        return 0;
+    }
+
+    return m_total.resolved / outcomes;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <boost/asio/ip/address.hpp>
+
+namespace hamster
+{
+    // Scores the sources of sampled info hashes by how many of the fetches
+    // they cause resolve to metadata, compared to the average over all
+    // sources. Nodes answering with junk, or with hashes nobody seeds, end up
+    // with a low score and their samples are fetched less often, or not at
+    // all.
+    //
+    // Outcomes are counted per host (an IPv4 address, or an IPv6 /64) and
+    // per subnet (an IPv4 /24, or an IPv6 /48), so a source hopping between
+    // addresses of one network is still caught. The counts are kept in a
+    // path compressed binary trie over the IPv6 address space, with IPv4
+    // addresses mapped into it, and decay so sources can make up for their
+    // past.
+    class NodeReputation
+    {
+    public:
+        struct Summary
+        {
+            std::size_t hosts;
+            std::size_t subnets;
+
+            // Prefixes with a weight below 1, and of 0
+            std::size_t downWeighted;
+            std::size_t blocked;
+        };
+
+        NodeReputation();
+
+        // Records that a fetch of a hash sampled from the address resolved,
+        // or timed out without metadata
+        void Resolved(const boost::asio::ip::address& address);
+        void Failed(const boost::asio::ip::address& address);
+
+        // The share of the hashes sampled from the address worth fetching,
+        // the lower of its host's and its subnet's. 1 for a source which
+        // resolves about as often as the average, or has too few outcomes to
+        // tell, down to 0 for a blocklisted one.
+        double Weight(const boost::asio::ip::address& address) const;
+
+        // Halves the counts, and drops the prefixes with little left
+        void Decay();
+
+        Summary Summarize() const;
+        std::uint64_t MemoryUsage() const;
+
+    private:
+        using Key = std::array<std::uint8_t, 16>;
+
+        struct Counts
+        {
+            float resolved;
+            float failed;
+        };
+
+        struct Node
+        {
+            Key key;
+            std::uint8_t length;
+            bool scored;
+            std::array<std::uint32_t, 2> children;
+            Counts counts;
+        };
+
+        static Key KeyOf(const boost::asio::ip::address& address);
+
+        void Add(const boost::asio::ip::address& address, Counts outcome);
+        Counts& Insert(const Key& key, int length);
+
+        // The weight of a prefix given the average resolve ratio
+        static double WeightOf(const Counts& counts, double average);
+        double Average() const;
+
+        // Calls the visitor with the scored prefixes of the key, shortest
+        // first
+        template <typename Visitor>
+        void Visit(const Key& key, Visitor&& visitor) const;
+
+        // The root is the empty prefix and never scored
+        std::vector<Node> m_nodes;
+        Counts m_total;
+    };
+}
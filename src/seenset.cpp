@@ -0,0 +1,433 @@
+#include "seenset.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using hamster::SharedSeenSet;
+
+static constexpr std::uint64_t Magic = 0x31524554534d4148; // "HAMSTER1"
+
+// A hash is looked for in this many slots from its home slot at most, so a
+// full table costs a bounded probe instead of a scan of every slot
+static const std::uint32_t maxProbes = 64;
+
+// Claims which keep losing races for a free slot give up as if full
+static const int maxClaimAttempts = 4;
+
+// The slot count is a power of two that fits the 32 bit capacity
+static const std::uint32_t maxCapacity = 1u << 31;
+
+// Publishing a reserved slot takes a process a few stores, so a slot that
+// stays reserved for longer than this has a process descheduled in between
+static const std::chrono::milliseconds maxPublishWait(1);
+
+// Each slot is guarded by a single 64 bit word which packs the slot state in
+// the two lowest bits, a flag telling whether the key is a v2 hash in the
+// third bit, and a monotonic timestamp (in milliseconds) in the rest.
+enum SlotState : std::uint64_t
+{
+    Empty    = 0,
+    Reserved = 1,
+    InFlight = 2,
+    Done     = 3
+};
+
+struct SharedSeenSet::Header
+{
+    std::uint64_t magic;
+    std::uint32_t capacity;
+    std::uint32_t unused;
+};
+
+struct SharedSeenSet::Slot
+{
+    std::uint64_t word;
+    std::uint32_t owner;
+    std::uint32_t unused;
+    std::uint8_t key[32];
+};
+
+static_assert(std::atomic_ref<std::uint64_t>::is_always_lock_free);
+static_assert(std::atomic_ref<std::uint32_t>::is_always_lock_free);
+
+struct SharedSeenSet::Key
+{
+    std::uint8_t bytes[32];
+    bool v2;
+};
+
+SharedSeenSet::Key SharedSeenSet::MakeKey(const lt::info_hash_t& hash)
+{
+    Key key{};
+
+    if (hash.has_v1())
+    {
+        std::memcpy(key.bytes, hash.v1.data(), lt::sha1_hash::size());
+    }
+    else
+    {
+        std::memcpy(key.bytes, hash.v2.data(), lt::sha256_hash::size());
+        key.v2 = true;
+    }
+
+    return key;
+}
+
+static std::int64_t NowMs()
+{
+    // steady_clock is CLOCK_MONOTONIC on Linux, which is shared by every
+    // process on the host.
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::uint64_t Pack(std::uint64_t state, bool v2, std::int64_t time)
+{
+    return (static_cast<std::uint64_t>(time) << 3) | (v2 ? 4 : 0) | state;
+}
+
+static std::uint64_t StateOf(std::uint64_t word) { return word & 3; }
+static bool IsV2(std::uint64_t word) { return (word & 4) != 0; }
+static std::int64_t TimeOf(std::uint64_t word) { return static_cast<std::int64_t>(word >> 3); }
+
+// Waits for the process which reserved the slot to publish its key. Returns
+// false if the slot is still reserved once the wait is up.
+static bool AwaitPublished(std::atomic_ref<std::uint64_t>& word, std::uint64_t reserved)
+{
+    auto const until = std::chrono::steady_clock::now() + maxPublishWait;
+
+    while (word.load(std::memory_order_acquire) == reserved)
+    {
+        if (std::chrono::steady_clock::now() >= until) { return false; }
+        std::this_thread::yield();
+    }
+
+    return true;
+}
+
+bool SharedSeenSet::HoldsKey(Slot& slot, std::uint64_t current, const Key& key)
+{
+    if (IsV2(current) != key.v2) { return false; }
+
+    std::uint8_t bytes[32];
+    std::memcpy(bytes, slot.key, sizeof(bytes));
+
+    // Slots are reused, so the key only counts if the slot did not change
+    // while it was read
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (std::atomic_ref<std::uint64_t>(slot.word).load(std::memory_order_relaxed) != current)
+    {
+        return false;
+    }
+
+    return std::memcmp(bytes, key.bytes, sizeof(bytes)) == 0;
+}
+
+std::unique_ptr<SharedSeenSet> SharedSeenSet::Open(
+    const std::string& name,
+    std::uint32_t capacity,
+    std::chrono::seconds staleAfter)
+{
+    if (capacity == 0)
+    {
+        throw std::invalid_argument("The seen-set capacity must be at least 1");
+    }
+
+    capacity = std::min(capacity, maxCapacity);
+
+    std::uint32_t slots = 1;
+    while (slots < capacity) { slots <<= 1; }
+
+    bool created = true;
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+    if (fd < 0 && errno == EEXIST)
+    {
+        created = false;
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+    }
+
+    if (fd < 0) { throw std::system_error(errno, std::generic_category(), "shm_open"); }
+
+    std::size_t size = sizeof(Header) + sizeof(Slot) * slots;
+
+    if (created)
+    {
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+        {
+            int err = errno;
+            close(fd);
+            shm_unlink(name.c_str());
+            throw std::system_error(err, std::generic_category(), "ftruncate");
+        }
+    }
+    else
+    {
+        // The creating process may not have sized the segment yet.
+        struct stat st{};
+
+        for (int i = 0; i < 1000; i++)
+        {
+            if (fstat(fd, &st) != 0)
+            {
+                int err = errno;
+                close(fd);
+                throw std::system_error(err, std::generic_category(), "fstat");
+            }
+
+            if (st.st_size > 0) { break; }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        if (st.st_size < static_cast<off_t>(sizeof(Header)))
+        {
+            close(fd);
+            throw std::runtime_error("Shared memory segment " + name + " was never initialized");
+        }
+
+        size = static_cast<std::size_t>(st.st_size);
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+
+    if (mapping == MAP_FAILED) { throw std::system_error(err, std::generic_category(), "mmap"); }
+
+    auto header = static_cast<Header*>(mapping);
+    std::atomic_ref<std::uint64_t> magic(header->magic);
+
+    if (created)
+    {
+        header->capacity = slots;
+        magic.store(Magic, std::memory_order_release);
+    }
+    else
+    {
+        for (int i = 0; i < 1000 && magic.load(std::memory_order_acquire) != Magic; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        if (magic.load(std::memory_order_acquire) != Magic
+            || sizeof(Header) + sizeof(Slot) * header->capacity > size)
+        {
+            munmap(mapping, size);
+            throw std::runtime_error("Shared memory segment " + name + " is not a hamster seen-set");
+        }
+    }
+
+    return std::unique_ptr<SharedSeenSet>(new SharedSeenSet(mapping, size, staleAfter));
+}
+
+SharedSeenSet::SharedSeenSet(void* mapping, std::size_t size, std::chrono::seconds staleAfter)
+    : m_mapping(mapping),
+      m_size(size),
+      m_pid(static_cast<std::uint32_t>(getpid())),
+      m_staleAfter(staleAfter)
+{
+    m_header = static_cast<Header*>(mapping);
+    m_slots = reinterpret_cast<Slot*>(static_cast<char*>(mapping) + sizeof(Header));
+    m_capacity = m_header->capacity;
+    m_probes = std::min(m_capacity, maxProbes);
+}
+
+SharedSeenSet::~SharedSeenSet() noexcept
+{
+    munmap(m_mapping, m_size);
+}
+
+SharedSeenSet::ClaimResult SharedSeenSet::Claim(const lt::info_hash_t& hash)
+{
+    auto const key = MakeKey(hash);
+
+    // Attempts are used up by lost races and by slots which stay reserved,
+    // not by waiting for a key to be published
+    for (int attempt = 0; attempt < maxClaimAttempts;)
+    {
+        auto const now = NowMs();
+
+        Slot* free = nullptr;
+        std::uint64_t freeWord = 0;
+        Slot* oldest = nullptr;
+        std::uint64_t oldestWord = 0;
+        bool retry = false;
+
+        for (std::uint32_t probe = 0; probe < m_probes; probe++)
+        {
+            Slot& slot = SlotAt(key, probe);
+            std::atomic_ref<std::uint64_t> word(slot.word);
+            std::uint64_t current = word.load(std::memory_order_acquire);
+            auto const state = StateOf(current);
+
+            if (state == Empty || (state == Reserved && now - TimeOf(current) >= m_staleAfter.count()))
+            {
+                // Empty, or reserved by a process which died before publishing
+                // its key. Nothing past an empty slot was ever probed for.
+                if (free == nullptr) { free = &slot; freeWord = current; }
+                if (state == Empty) { break; }
+                continue;
+            }
+
+            // Another process is publishing its key, which may be this one,
+            // so wait for it and look again
+            if (state == Reserved)
+            {
+                if (!AwaitPublished(word, current)) { attempt++; }
+
+                retry = true;
+                break;
+            }
+
+            if (!HoldsKey(slot, current, key))
+            {
+                if (state == InFlight && now - TimeOf(current) >= m_staleAfter.count() && free == nullptr)
+                {
+                    // Someone else's claim, abandoned
+                    free = &slot;
+                    freeWord = current;
+                }
+                else if (state == Done && (oldest == nullptr || TimeOf(current) < TimeOf(oldestWord)))
+                {
+                    oldest = &slot;
+                    oldestWord = current;
+                }
+
+                continue;
+            }
+
+            if (state == Done) { return ClaimResult::Done; }
+
+            if (now - TimeOf(current) < m_staleAfter.count())
+            {
+                return ClaimResult::InFlight;
+            }
+
+            // Take over in-flight claims which have not completed in time. The
+            // owner has either crashed or failed to find any peers.
+            if (word.compare_exchange_strong(
+                current,
+                Pack(InFlight, key.v2, now),
+                std::memory_order_acq_rel,
+                std::memory_order_acquire))
+            {
+                std::atomic_ref<std::uint32_t>(slot.owner).store(m_pid, std::memory_order_relaxed);
+                return ClaimResult::Claimed;
+            }
+
+            attempt++;
+            retry = true;
+            break;
+        }
+
+        if (retry) { continue; }
+
+        // Make room by forgetting the hash which was fetched the longest ago
+        if (free == nullptr && oldest != nullptr)
+        {
+            free = oldest;
+            freeWord = oldestWord;
+        }
+
+        if (free == nullptr) { return ClaimResult::Full; }
+
+        std::atomic_ref<std::uint64_t> word(free->word);
+
+        if (!word.compare_exchange_strong(
+            freeWord,
+            Pack(Reserved, key.v2, now),
+            std::memory_order_acq_rel,
+            std::memory_order_acquire))
+        {
+            // Lost the slot to another process, look again
+            attempt++;
+            continue;
+        }
+
+        std::memcpy(free->key, key.bytes, sizeof(key.bytes));
+        std::atomic_ref<std::uint32_t>(free->owner).store(m_pid, std::memory_order_relaxed);
+        word.store(Pack(InFlight, key.v2, now), std::memory_order_release);
+
+        return ClaimResult::Claimed;
+    }
+
+    return ClaimResult::Full;
+}
+
+void SharedSeenSet::MarkDone(const lt::info_hash_t& hash)
+{
+    std::uint64_t current;
+    Slot* slot = Find(hash, current);
+
+    if (slot == nullptr || StateOf(current) != InFlight) { return; }
+
+    // Fails, and leaves the slot alone, if the claim was taken over or the
+    // slot reused in the meantime
+    std::atomic_ref<std::uint64_t>(slot->word).compare_exchange_strong(
+        current,
+        Pack(Done, IsV2(current), NowMs()),
+        std::memory_order_acq_rel,
+        std::memory_order_acquire);
+}
+
+void SharedSeenSet::Release(const lt::info_hash_t& hash)
+{
+    std::uint64_t current;
+    Slot* slot = Find(hash, current);
+    if (slot == nullptr) { return; }
+
+    if (std::atomic_ref<std::uint32_t>(slot->owner).load(std::memory_order_relaxed) != m_pid)
+    {
+        return;
+    }
+
+    // Make the claim stale right away so the next process to see the hash
+    // takes it over.
+    std::atomic_ref<std::uint64_t> word(slot->word);
+
+    while (StateOf(current) == InFlight
+        && !word.compare_exchange_weak(
+            current,
+            Pack(InFlight, IsV2(current), 0),
+            std::memory_order_acq_rel,
+            std::memory_order_acquire))
+    {
+    }
+}
+
+SharedSeenSet::Slot& SharedSeenSet::SlotAt(const Key& key, std::uint32_t probe)
+{
+    std::uint32_t index;
+    std::memcpy(&index, key.bytes, sizeof(index));
+
+    return m_slots[(index + probe) & (m_capacity - 1)];
+}
+
+SharedSeenSet::Slot* SharedSeenSet::Find(const lt::info_hash_t& hash, std::uint64_t& current)
+{
+    auto const key = MakeKey(hash);
+
+    for (std::uint32_t probe = 0; probe < m_probes; probe++)
+    {
+        Slot& slot = SlotAt(key, probe);
+        current = std::atomic_ref<std::uint64_t>(slot.word).load(std::memory_order_acquire);
+
+        if (StateOf(current) == Empty) { return nullptr; }
+        if (StateOf(current) == Reserved) { continue; }
+
+        if (HoldsKey(slot, current, key)) { return &slot; }
+    }
+
+    return nullptr;
+}
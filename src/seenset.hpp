@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <libtorrent/info_hash.hpp>
+
+namespace hamster
+{
+    // A fixed capacity, lock-free set of info hashes living in a POSIX shared
+    // memory segment. Multiple hamster processes on the same host open the
+    // same segment and use it to decide which one of them fetches the metadata
+    // for a given hash.
+    //
+    // A hash lives within a short probe window of its home slot. Once that
+    // window fills up, the hash which was fetched the longest ago is
+    // forgotten to make room, so a busy table keeps the recent hashes rather
+    // than refusing new ones.
+    class SharedSeenSet
+    {
+    public:
+        enum class ClaimResult
+        {
+            // The caller owns the hash and should fetch it.
+            Claimed,
+            // Another process is currently fetching the hash.
+            InFlight,
+            // The metadata for the hash has already been fetched.
+            Done,
+            // No slot near the hash's home slot could be taken - the caller
+            // should fall back to fetching.
+            Full
+        };
+
+        static std::unique_ptr<SharedSeenSet> Open(
+            const std::string& name,
+            std::uint32_t capacity,
+            std::chrono::seconds staleAfter);
+
+        ~SharedSeenSet() noexcept;
+
+        std::uint32_t Capacity() const { return m_capacity; }
+
+        ClaimResult Claim(const lt::info_hash_t& hash);
+        void MarkDone(const lt::info_hash_t& hash);
+        void Release(const lt::info_hash_t& hash);
+
+    private:
+        struct Header;
+        struct Key;
+        struct Slot;
+
+        SharedSeenSet(void* mapping, std::size_t size, std::chrono::seconds staleAfter);
+
+        static Key MakeKey(const lt::info_hash_t& hash);
+        static bool HoldsKey(Slot& slot, std::uint64_t current, const Key& key);
+
+        Slot& SlotAt(const Key& key, std::uint32_t probe);
+
+        // Returns the slot holding the hash, if any, and the slot word it
+        // was found with
+        Slot* Find(const lt::info_hash_t& hash, std::uint64_t& current);
+
+        void* m_mapping;
+        std::size_t m_size;
+        std::uint32_t m_capacity;
+        std::uint32_t m_probes;
+        std::uint32_t m_pid;
+        std::chrono::milliseconds m_staleAfter;
+        Header* m_header;
+        Slot* m_slots;
+    };
+}
@@ -0,0 +1,99 @@
+#include "sqlitestorage.hpp"
+
+#include "database.hpp"
+#include "tracing.hpp"
+
+using hamster::SqliteStorage;
+
+SqliteStorage::SqliteStorage(sqlite3* db)
+    : m_db(db)
+{
+}
+
+SqliteStorage::~SqliteStorage() noexcept
+{
+    sqlite3_close(m_db);
+}
+
+void SqliteStorage::Begin()
+{
+    if (sqlite3_exec(m_db, "BEGIN;", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        throw DatabaseException(m_db);
+    }
+}
+
+void SqliteStorage::Commit()
+{
+    if (sqlite3_exec(m_db, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        DatabaseException ex(m_db);
+        sqlite3_exec(m_db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        throw ex;
+    }
+}
+
+void SqliteStorage::Checkpoint()
+{
+    HAMSTER_TRACE_SPAN("SqliteStorage::Checkpoint");
+
+    // Leaves an empty WAL behind, so the next start does not have to read
+    // it back
+    if (sqlite3_wal_checkpoint_v2(m_db, nullptr, SQLITE_CHECKPOINT_TRUNCATE, nullptr, nullptr) != SQLITE_OK)
+    {
+        throw DatabaseException(m_db);
+    }
+}
+
+hamster::Models::Torrent::Match SqliteStorage::Exists(const lt::info_hash_t& hash)
+{
+    return Models::Torrent::Exists(m_db, hash);
+}
+
+std::vector<hamster::Models::TorrentSignature::Match> SqliteStorage::FindSimilar(
+    const lt::info_hash_t& hash,
+    std::size_t limit)
+{
+    return Models::TorrentSignature::FindSimilar(m_db, hash, limit);
+}
+
+std::optional<hamster::Models::Torrent> SqliteStorage::GetTorrent(const lt::info_hash_t& hash)
+{
+    return Models::Torrent::GetByInfoHash(m_db, hash);
+}
+
+bool SqliteStorage::InsertTorrent(const lt::torrent_info& torrentInfo)
+{
+    HAMSTER_TRACE_SPAN("SqliteStorage::InsertTorrent");
+
+    // A torrent is several statements, which must not be left half written
+    // in a batch that goes on to commit
+    if (sqlite3_exec(m_db, "SAVEPOINT insert_torrent;", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        throw DatabaseException(m_db);
+    }
+
+    try
+    {
+        bool const inserted = Models::Torrent::Insert(m_db, torrentInfo);
+        sqlite3_exec(m_db, "RELEASE insert_torrent;", nullptr, nullptr, nullptr);
+        return inserted;
+    }
+    catch (const DatabaseException&)
+    {
+        sqlite3_exec(m_db, "ROLLBACK TO insert_torrent;", nullptr, nullptr, nullptr);
+        sqlite3_exec(m_db, "RELEASE insert_torrent;", nullptr, nullptr, nullptr);
+        throw;
+    }
+}
+
+std::uint64_t SqliteStorage::MemoryUsage()
+{
+    // Covers every connection in the process, which is close enough
+    return static_cast<std::uint64_t>(sqlite3_memory_used());
+}
+
+void SqliteStorage::ScanTorrents(const std::function<void(const Models::Torrent&)>& callback)
+{
+    Models::Torrent::Scan(m_db, callback);
+}
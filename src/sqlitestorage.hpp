@@ -0,0 +1,37 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include "storage.hpp"
+
+namespace hamster
+{
+    // Stores the index in a SQLite database through the Models. Takes
+    // ownership of a connection to an already migrated database.
+    class SqliteStorage : public Storage
+    {
+    public:
+        explicit SqliteStorage(sqlite3* db);
+        ~SqliteStorage() noexcept override;
+
+        sqlite3* Handle() const { return m_db; }
+
+        void Begin() override;
+        void Commit() override;
+        void Checkpoint() override;
+
+        Models::Torrent::Match Exists(const lt::info_hash_t& hash) override;
+
+        std::vector<Models::TorrentSignature::Match> FindSimilar(
+            const lt::info_hash_t& hash,
+            std::size_t limit) override;
+
+        std::optional<Models::Torrent> GetTorrent(const lt::info_hash_t& hash) override;
+        bool InsertTorrent(const lt::torrent_info& torrentInfo) override;
+        std::uint64_t MemoryUsage() override;
+        void ScanTorrents(const std::function<void(const Models::Torrent&)>& callback) override;
+
+    private:
+        sqlite3* m_db;
+    };
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+#include <libtorrent/info_hash.hpp>
+#include <libtorrent/torrent_info.hpp>
+
+#include "models/torrent.hpp"
+#include "models/torrentsignature.hpp"
+
+namespace hamster
+{
+    // The index as seen by the indexer and the importer, independent of how
+    // it is stored. Implementations are used from one thread at a time.
+    class Storage
+    {
+    public:
+        virtual ~Storage() noexcept = default;
+
+        // Writes between Begin and Commit are batched, and are durable once
+        // Commit returns. Commit throws a DatabaseException if they could not
+        // be made durable.
+        virtual void Begin() = 0;
+        virtual void Commit() = 0;
+
+        // Makes every write so far durable, so the next start has nothing to
+        // recover. Used on shutdown. Throws a DatabaseException on failure.
+        virtual void Checkpoint() = 0;
+
+        // Looks the hash up by its v1 and v2 forms. A v1 hash also matches
+        // the v2 torrent whose truncated v2 hash it is, which is reported as
+        // an alias match.
+        virtual Models::Torrent::Match Exists(const lt::info_hash_t& hash) = 0;
+
+        virtual std::vector<Models::TorrentSignature::Match> FindSimilar(
+            const lt::info_hash_t& hash,
+            std::size_t limit) = 0;
+
+        // Returns the torrent with its file list.
+        virtual std::optional<Models::Torrent> GetTorrent(const lt::info_hash_t& hash) = 0;
+
+        // Stores the torrent unless it already exists under any of its info
+        // hashes, in which case the hashes it is missing are added to it.
+        // Returns true if the torrent was new. Throws a DatabaseException if
+        // it could not be written, leaving the index as it was.
+        virtual bool InsertTorrent(const lt::torrent_info& torrentInfo) = 0;
+
+        // An estimate of the memory held by the engine, in bytes.
+        virtual std::uint64_t MemoryUsage() = 0;
+
+        // Calls the callback with every stored torrent, in insertion order.
+        virtual void ScanTorrents(const std::function<void(const Models::Torrent&)>& callback) = 0;
+    };
+}
@@ -0,0 +1,255 @@
+#include "tracing.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <nlohmann/json.hpp>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using hamster::Tracing::Buffer;
+using hamster::Tracing::Event;
+
+static std::mutex buffersMutex;
+static std::vector<std::unique_ptr<Buffer>> buffers;
+
+static std::mutex namesMutex;
+static std::unordered_map<std::string_view, std::unique_ptr<std::string>> names;
+
+// Writes nanoseconds as microseconds, the unit of the trace event format
+static void WriteMicros(std::ostream& stream, std::uint64_t ns)
+{
+    auto const fraction = ns % 1000;
+
+    stream << ns / 1000 << '.'
+           << static_cast<char>('0' + fraction / 100)
+           << static_cast<char>('0' + fraction / 10 % 10)
+           << static_cast<char>('0' + fraction % 10);
+}
+
+#ifdef HAMSTER_TRACING
+// Statements which have started running on this thread, and when. SQLite
+// reports their duration at millisecond resolution only, so they are
+// timed here instead.
+static thread_local std::vector<std::pair<sqlite3_stmt*, std::uint64_t>> runningStatements;
+
+static int TraceStatement(unsigned type, void*, void* p, void*)
+{
+    auto const stmt = static_cast<sqlite3_stmt*>(p);
+
+    auto it = std::find_if(
+        runningStatements.begin(),
+        runningStatements.end(),
+        [stmt](const auto& running) { return running.first == stmt; });
+
+    switch (type)
+    {
+        case SQLITE_TRACE_STMT:
+            // Also reported at the start of each trigger the statement runs
+            if (it == runningStatements.end())
+            {
+                runningStatements.emplace_back(stmt, hamster::Tracing::Now());
+            }
+            break;
+
+        case SQLITE_TRACE_PROFILE:
+            if (it != runningStatements.end())
+            {
+                hamster::Tracing::ThreadBuffer().Record(
+                    hamster::Tracing::Intern(sqlite3_sql(stmt)),
+                    it->second,
+                    hamster::Tracing::Now());
+
+                runningStatements.erase(it);
+            }
+            break;
+    }
+
+    return 0;
+}
+#endif
+
+Buffer::Buffer()
+    : m_head(0),
+      m_tid(::syscall(SYS_gettid))
+{
+    char name[16] = {};
+
+    if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0)
+    {
+        m_threadName = name;
+    }
+}
+
+std::vector<Event> Buffer::Snapshot() const
+{
+    auto const head = m_head.load(std::memory_order_acquire);
+    auto const first = head > BufferSize ? head - BufferSize : 0;
+
+    std::vector<Event> events;
+    events.reserve(head - first);
+
+    for (auto i = first; i < head; i++)
+    {
+        auto const& slot = m_slots[i & (BufferSize - 1)];
+
+        events.push_back({
+            slot.name.load(std::memory_order_relaxed),
+            slot.start.load(std::memory_order_relaxed),
+            slot.end.load(std::memory_order_relaxed)
+        });
+    }
+
+    // Drop the oldest events if the thread went on to overwrite them while
+    // they were copied
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    auto const after = m_head.load(std::memory_order_relaxed);
+    auto const valid = after >= BufferSize ? after - BufferSize + 1 : 0;
+
+    if (valid > first)
+    {
+        events.erase(events.begin(), events.begin() + static_cast<std::ptrdiff_t>(std::min(valid - first, events.size())));
+    }
+
+    return events;
+}
+
+Buffer* hamster::Tracing::RegisterThread()
+{
+    auto buffer = std::make_unique<Buffer>();
+    auto const raw = buffer.get();
+
+    std::scoped_lock lock(buffersMutex);
+    buffers.push_back(std::move(buffer));
+
+    return raw;
+}
+
+const char* hamster::Tracing::Intern(std::string_view name)
+{
+    std::scoped_lock lock(namesMutex);
+
+    auto it = names.find(name);
+
+    if (it == names.end())
+    {
+        auto copy = std::make_unique<std::string>(name);
+        std::string_view const key = *copy;
+
+        it = names.emplace(key, std::move(copy)).first;
+    }
+
+    return it->second->c_str();
+}
+
+void hamster::Tracing::TraceDatabase([[maybe_unused]] sqlite3* db)
+{
+#ifdef HAMSTER_TRACING
+    sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, &TraceStatement, nullptr);
+#endif
+}
+
+std::size_t hamster::Tracing::Dump(std::ostream& stream)
+{
+    std::vector<Buffer*> threads;
+
+    {
+        std::scoped_lock lock(buffersMutex);
+
+        for (auto const& buffer : buffers)
+        {
+            threads.push_back(buffer.get());
+        }
+    }
+
+    auto const pid = ::getpid();
+
+    // Names are escaped once, there are few of them
+    std::unordered_map<const char*, std::string> escaped;
+    std::size_t written = 0;
+    bool first = true;
+
+    stream << "{\"traceEvents\":[";
+
+    for (auto const thread : threads)
+    {
+        if (!first) { stream << ','; }
+        first = false;
+
+        stream << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << thread->Tid()
+               << ",\"args\":{\"name\":" << nlohmann::json(thread->ThreadName()).dump() << "}}";
+
+        for (auto const& event : thread->Snapshot())
+        {
+            if (event.name == nullptr || event.end < event.start) { continue; }
+
+            auto it = escaped.find(event.name);
+
+            if (it == escaped.end())
+            {
+                it = escaped.emplace(event.name, nlohmann::json(event.name).dump()).first;
+            }
+
+            stream << ",\n{\"name\":" << it->second << ",\"ph\":\"X\",\"ts\":";
+            WriteMicros(stream, event.start);
+            stream << ",\"dur\":";
+            WriteMicros(stream, event.end - event.start);
+            stream << ",\"pid\":" << pid << ",\"tid\":" << thread->Tid() << '}';
+
+            written += 1;
+        }
+    }
+
+    stream << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    return written;
+}
+
+std::size_t hamster::Tracing::Dump(const std::string& path)
+{
+    // The path comes from whoever can reach the control socket, so only a
+    // new file is created, never one which exists or a symlink followed
+    int const fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+
+    if (fd < 0)
+    {
+        throw std::runtime_error("Failed to create " + path + ": " + std::strerror(errno));
+    }
+
+    std::ostringstream stream;
+    auto const written = Dump(stream);
+    auto const data = stream.str();
+
+    std::size_t offset = 0;
+
+    while (offset < data.size())
+    {
+        auto const res = ::write(fd, data.data() + offset, data.size() - offset);
+
+        if (res < 0 && errno == EINTR) { continue; }
+
+        if (res < 0)
+        {
+            auto const error = errno;
+            ::close(fd);
+            ::unlink(path.c_str());
+            throw std::runtime_error("Failed to write " + path + ": " + std::strerror(error));
+        }
+
+        offset += static_cast<std::size_t>(res);
+    }
+
+    ::close(fd);
+
+    return written;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct sqlite3;
+
+#ifdef HAMSTER_TRACING
+#define HAMSTER_TRACE_CONCAT_(a, b) a##b
+#define HAMSTER_TRACE_CONCAT(a, b) HAMSTER_TRACE_CONCAT_(a, b)
+
+// Records the time from here to the end of the enclosing scope. The name
+// must outlive the process, like a string literal, an alert's what() or a
+// name returned by Tracing::Intern. Compiles to nothing, without evaluating
+// the name, unless built with HAMSTER_TRACING.
+#define HAMSTER_TRACE_SPAN(name) \
+    ::hamster::Tracing::Span HAMSTER_TRACE_CONCAT(hamsterTraceSpan, __LINE__)(name)
+#else
+#define HAMSTER_TRACE_SPAN(name) do {} while (false)
+#endif
+
+namespace hamster::Tracing
+{
+#ifdef HAMSTER_TRACING
+    inline constexpr bool Compiled = true;
+#else
+    inline constexpr bool Compiled = false;
+#endif
+
+    // The number of spans kept per thread. Older spans are overwritten.
+    inline constexpr std::size_t BufferSize = 1 << 17;
+
+    inline std::uint64_t Now()
+    {
+        return static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    struct Event
+    {
+        const char* name;
+        std::uint64_t start;
+        std::uint64_t end;
+    };
+
+    // The spans of a single thread. Only that thread writes to it, Dump may
+    // read it from any other.
+    class Buffer
+    {
+    public:
+        Buffer();
+
+        void Record(const char* name, std::uint64_t start, std::uint64_t end)
+        {
+            auto const head = m_head.load(std::memory_order_relaxed);
+            auto& slot = m_slots[head & (BufferSize - 1)];
+
+            // Orders the previous head before the overwrite, so a reader
+            // which sees a torn event also sees the head which tells it so
+            std::atomic_thread_fence(std::memory_order_release);
+
+            slot.name.store(name, std::memory_order_relaxed);
+            slot.start.store(start, std::memory_order_relaxed);
+            slot.end.store(end, std::memory_order_relaxed);
+
+            m_head.store(head + 1, std::memory_order_release);
+        }
+
+        // Copies the spans which are complete, oldest first
+        std::vector<Event> Snapshot() const;
+
+        long Tid() const { return m_tid; }
+        const std::string& ThreadName() const { return m_threadName; }
+
+    private:
+        struct Slot
+        {
+            std::atomic<const char*> name;
+            std::atomic<std::uint64_t> start;
+            std::atomic<std::uint64_t> end;
+        };
+
+        std::array<Slot, BufferSize> m_slots;
+        std::atomic<std::uint64_t> m_head;
+        long m_tid;
+        std::string m_threadName;
+    };
+
+    // Allocates a buffer for the calling thread. Buffers are kept after
+    // their thread exits, so its spans are still dumped.
+    Buffer* RegisterThread();
+
+    inline Buffer& ThreadBuffer()
+    {
+        thread_local Buffer* buffer = RegisterThread();
+        return *buffer;
+    }
+
+    class Span
+    {
+    public:
+        explicit Span(const char* name)
+            : m_name(name),
+              m_start(Now())
+        {
+        }
+
+        ~Span()
+        {
+            // Before the first span of a thread allocates its buffer
+            auto const end = Now();
+            ThreadBuffer().Record(m_name, m_start, end);
+        }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+    private:
+        const char* m_name;
+        std::uint64_t m_start;
+    };
+
+    // Returns a copy of the name which lives as long as the process, the
+    // same copy for equal names
+    const char* Intern(std::string_view name);
+
+    // Records a span for every statement run on the connection, named by
+    // its SQL. Does nothing unless built with HAMSTER_TRACING.
+    void TraceDatabase(sqlite3* db);
+
+    // Writes the spans of every thread in the Chrome trace event format,
+    // which chrome://tracing and Perfetto open. Returns the number of spans
+    // written.
+    std::size_t Dump(std::ostream& stream);
+
+    // Dumps to a new file, readable by the owner only. Throws
+    // std::runtime_error if the file exists or cannot be written.
+    std::size_t Dump(const std::string& path);
+}